@@ -0,0 +1,184 @@
+// Benchmark of the ray/model intersection in rt::Renderer, with and without the BVH.
+//
+// usage: exercise_10_bench [max_triangles] [seconds_per_test]
+//
+// Scenes are made of cubes (12 triangles each) scattered in a [-1, 1]^3 volume, from a single cube
+// up to max_triangles (default 1M). Each test traces the primary rays of a 64x64 camera for at most
+// seconds_per_test (default 2) and reports closest hit queries per second for the linear search, the BVH, and
+// the BVH traversed with packets of 2x2 primary rays (x86 only).
+// A second table compares the node memory and the closest hit queries per second of the binary BVH with the wide
+// BVHs with quantized child boxes (BVH4 and BVH8, see rt_wide_bvh.h) built from it.
+
+#include <cstdint>
+#include <cfloat>
+#include <cassert>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include "rt_renderer.h"
+#include "primitives.h"
+
+using namespace std;
+
+// deterministic pseudo random numbers, so that all runs use the same scenes
+float random01(uint32_t &state){
+    state = state * 1664525u + 1013904223u;
+    return float(state >> 8) / float(1u << 24);
+}
+
+vector<rt::vertex> makeScene(unsigned int cube_count){
+    vector<glm::vec3> points;
+    vector<glm::vec4> colors;
+    vector<glm::vec3> normals;
+    vector<glm::vec2> uvs;
+    Primitives::makeCube(2.f, points, normals, uvs, colors);
+
+    vector<rt::vertex> vts;
+    vts.reserve(cube_count * points.size());
+    // cubes get smaller as there are more of them, so that the scene volume stays the same
+    float size = cube_count == 1 ? .5f : .5f / cbrt(float(cube_count));
+    uint32_t state = 1;
+    for (unsigned int c = 0; c < cube_count; c++){
+        glm::vec3 center = cube_count == 1 ? glm::vec3(0) :
+                glm::vec3(random01(state), random01(state), random01(state)) * 2.0f - 1.0f;
+        glm::mat4 transform = glm::translate(center) *
+                glm::rotate(random01(state) * 3.14f, glm::vec3(random01(state), 1, random01(state))) *
+                glm::scale(glm::vec3(size));
+        for (unsigned int i = 0; i < points.size(); i++){
+            vts.push_back(rt::vertex{transform * glm::vec4(points[i], 1.0f),
+                                     transform * glm::vec4(normals[i], 0),
+                                     colors[i],
+                                     uvs[i]});
+        }
+    }
+    return vts;
+}
+
+// same primary rays as rt::Renderer::render with an identity model matrix, column by column
+vector<rt::Ray> makePrimaryRays(const glm::mat4 &view, float fov_degrees, unsigned int W, unsigned int H){
+    rt::PrimaryRays primary(glm::mat4(1), view, fov_degrees, W, H);
+    vector<rt::Ray> rays;
+    for (unsigned int c = 0; c < W; c++)
+        for (unsigned int r = 0; r < H; r++)
+            rays.push_back(primary.at(c, r));
+    return rays;
+}
+
+// returns rays per second, stops early if the time budget is exhausted
+template <typename Query>
+double measureQuery(const vector<rt::Ray> &rays, double budget_seconds, const Query &query){
+    auto start = chrono::high_resolution_clock::now();
+    size_t traced = 0;
+    double elapsed = 0;
+    for (const auto &ray : rays){
+        rt::Hit hit;
+        query(ray, hit);
+        traced++;
+        // checking the clock is relatively expensive, so we only do it from time to time
+        if ((traced & 15) == 0){
+            elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+            if (elapsed > budget_seconds) break;
+        }
+    }
+    elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+    return traced / elapsed;
+}
+
+double measure(const rt::Renderer &renderer, const vector<rt::Ray> &rays, const vector<rt::vertex> &vts,
+               double budget_seconds){
+    return measureQuery(rays, budget_seconds, [&](const rt::Ray &ray, rt::Hit &hit){
+        renderer.rayModelIntersection(ray, vts, hit);
+    });
+}
+
+#ifdef RT_PACKET_SIMD
+// same as measure, but traces 2x2 pixel quads as packets (W and H must be even)
+double measurePackets(const rt::Renderer &renderer, const vector<rt::Ray> &rays,
+                      unsigned int W, unsigned int H, double budget_seconds){
+    auto start = chrono::high_resolution_clock::now();
+    size_t traced = 0;
+    double elapsed = 0;
+    for (unsigned int c = 0; c < W && elapsed <= budget_seconds; c += 2){
+        for (unsigned int r = 0; r < H; r += 2){
+            // rays are stored column by column
+            rt::Ray packet[4] = {rays[c * H + r], rays[(c + 1) * H + r], rays[c * H + r + 1], rays[(c + 1) * H + r + 1]};
+            rt::Hit hits[4];
+            rt::packetClosestHit(renderer.bvh(), packet, 15, hits);
+            traced += 4;
+        }
+        elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+    }
+    return traced / elapsed;
+}
+#endif
+
+int main(int argc, char **argv){
+    unsigned int max_triangles = argc > 1 ? stoul(argv[1]) : 1000000;
+    double budget = argc > 2 ? stod(argv[2]) : 2.0;
+
+    glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 3), glm::vec3(0), glm::vec3(0, 1, 0));
+    vector<rt::Ray> rays = makePrimaryRays(view, 70.0f, 64, 64);
+
+    cout << setw(10) << "triangles" << setw(14) << "build (ms)" << setw(16) << "nodes"
+         << setw(18) << "linear (rays/s)" << setw(16) << "bvh (rays/s)" << setw(10) << "speedup"
+         << setw(18) << "packet (rays/s)" << setw(10) << "speedup" << endl;
+
+    const unsigned int scene_sizes[] = {12u, 120u, 1200u, 12000u, 120000u, 1000000u};
+    for (unsigned int triangles : scene_sizes){
+        if (triangles > max_triangles) break;
+        vector<rt::vertex> vts = makeScene((triangles + 11) / 12);
+
+        rt::Renderer renderer;
+        auto build_start = chrono::high_resolution_clock::now();
+        renderer.buildBVH(vts);
+        double build_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - build_start).count();
+
+        renderer.use_bvh = false;
+        double linear = measure(renderer, rays, vts, budget);
+        renderer.use_bvh = true;
+        double bvh = measure(renderer, rays, vts, budget);
+#ifdef RT_PACKET_SIMD
+        double packet = measurePackets(renderer, rays, 64, 64, budget);
+#else
+        double packet = bvh;
+#endif
+
+        cout << setw(10) << vts.size() / 3 << setw(14) << fixed << setprecision(2) << build_ms
+             << setw(16) << renderer.bvh().nodes.size()
+             << setw(18) << setprecision(0) << linear << setw(16) << bvh
+             << setw(9) << setprecision(1) << bvh / linear << "x"
+             << setw(18) << setprecision(0) << packet << setw(9) << setprecision(1) << packet / bvh << "x" << endl;
+    }
+
+    // node layouts: memory of the nodes (the triangles are shared) and single ray closest hit queries
+    cout << endl << setw(10) << "triangles" << setw(16) << "bvh2 (KB)" << setw(16) << "bvh4 (KB)" << setw(16) << "bvh8 (KB)"
+         << setw(16) << "bvh2 (rays/s)" << setw(16) << "bvh4 (rays/s)" << setw(10) << "speedup"
+         << setw(16) << "bvh8 (rays/s)" << setw(10) << "speedup" << endl;
+    for (unsigned int triangles : scene_sizes){
+        if (triangles > max_triangles) break;
+        vector<rt::vertex> vts = makeScene((triangles + 11) / 12);
+
+        rt::BVH bvh;
+        bvh.build(vts);
+        rt::WideBVH<4> bvh4;
+        bvh4.build(bvh);
+        rt::WideBVH<8> bvh8;
+        bvh8.build(bvh);
+
+        double rate2 = measureQuery(rays, budget, [&](const rt::Ray &ray, rt::Hit &hit){ bvh.closestHit(ray, hit); });
+        double rate4 = measureQuery(rays, budget, [&](const rt::Ray &ray, rt::Hit &hit){ bvh4.closestHit(ray, hit); });
+        double rate8 = measureQuery(rays, budget, [&](const rt::Ray &ray, rt::Hit &hit){ bvh8.closestHit(ray, hit); });
+
+        cout << setw(10) << vts.size() / 3 << fixed << setprecision(1)
+             << setw(16) << bvh.nodes.size() * sizeof(rt::BVHNode) / 1024.0
+             << setw(16) << bvh4.nodeBytes() / 1024.0 << setw(16) << bvh8.nodeBytes() / 1024.0
+             << setw(16) << setprecision(0) << rate2
+             << setw(16) << rate4 << setw(9) << setprecision(2) << rate4 / rate2 << "x"
+             << setw(16) << setprecision(0) << rate8 << setw(9) << setprecision(2) << rate8 / rate2 << "x" << endl;
+    }
+    return 0;
+}
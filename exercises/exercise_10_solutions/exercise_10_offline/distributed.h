@@ -0,0 +1,669 @@
+//
+// Distributed rendering for the offline renderer: a coordinator splits every frame in tiles and hands them to worker
+// processes over TCP or Unix sockets, the workers hold the scene and its BVH and send back the finished tiles
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_OFFLINE_DISTRIBUTED_H
+#define ITU_GRAPHICS_PROGRAMMING_OFFLINE_DISTRIBUTED_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <glm/glm.hpp>
+#ifndef _WIN32
+#include <csignal>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include "rt_renderer.h"
+#include "rt_texture.h"
+#include "rt_lights.h"
+
+namespace distributed{
+
+    // Hash of everything in the vertex buffer, and in the texture and the lights of the renderer, that changes the
+    // image, a worker only renders for a coordinator that has the same scene (FNV-1a on 32 bit words, like rt::bvhFileKey)
+    inline uint64_t sceneKey(const std::vector<rt::vertex> &vts, const rt::Renderer &renderer){
+        uint64_t h = 14695981039346656037ull;
+        auto add = [&](uint32_t word){ h = (h ^ word) * 1099511628211ull; };
+        add(uint32_t(vts.size()));
+        add(uint32_t(uint64_t(vts.size()) >> 32));
+        auto addFloat = [&](float value){
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            add(bits);
+        };
+        for (const rt::vertex &v : vts){
+            const float values[14] = {v.pos.x, v.pos.y, v.pos.z, v.pos.w, v.norm.x, v.norm.y, v.norm.z, v.norm.w,
+                                      v.col.r, v.col.g, v.col.b, v.col.a, v.uv.x, v.uv.y};
+            for (float value : values)
+                addFloat(value);
+        }
+        add(uint32_t(renderer.lights().size()));
+        for (const rt::PointLight &light : renderer.lights())
+            for (float value : {light.position.x, light.position.y, light.position.z, light.color.r, light.color.g, light.color.b})
+                addFloat(value);
+        for (float value : {renderer.light_attenuation.constant, renderer.light_attenuation.linear, renderer.light_attenuation.quadratic})
+            addFloat(value);
+        const rt::Texture *texture = renderer.texture;
+        if (texture){
+            add(texture->width());
+            add(texture->height());
+            for (unsigned int y = 0; y < texture->height(); y++)
+                for (unsigned int x = 0; x < texture->width(); x++)
+                    add(texture->texel(0, x, y));
+        }
+        return h;
+    }
+
+    // the renderer settings that change the image, sent by the coordinator
+    struct RenderSettings{
+        bool use_bvh = true, use_packets = true;
+        unsigned int bvh_width = 2;
+        unsigned int light_samples = 1;
+    };
+
+    // Messages are a header followed by size bytes of payload, in the byte order of the coordinator: the magic
+    // number of the handshake does not match on a machine with the other byte order, the worker is not used then
+    const uint32_t protocol_magic = 0x52544431; // "RTD1"
+    const uint32_t protocol_version = 2;
+
+    enum class MessageType : uint32_t { hello = 1, frame = 2, tile = 3, result = 4 };
+
+    struct MessageHeader{
+        MessageType type;
+        uint32_t size;
+    };
+
+    // hello of the coordinator: magic, version. The worker answers with its own and the key of its scene
+    struct Hello{
+        uint64_t scene_key;
+        uint32_t magic, version;
+    };
+
+    // largest width and height of a frame a worker accepts, so that a corrupt message can't make it allocate gigabytes
+    const uint32_t max_frame_size = 16384;
+
+    // settings of a frame, the tiles that follow belong to it
+    struct FrameMessage{
+        uint32_t frame_ID, W, H, depth, use_bvh, use_packets, bvh_width, light_samples;
+        float fov_degrees;
+        float view[16];
+    };
+
+    // a tile to render, the worker answers with a result: the same TileMessage followed by the RGBA32 colors of the
+    // tile, row by row
+    struct TileMessage{
+        uint32_t frame_ID, tile_ID, x0, y0, x1, y1;
+    };
+
+#ifdef _WIN32
+
+    // the sockets below are POSIX only
+    class TileCoordinator{
+    public:
+        unsigned int tile_size = 64;
+        bool addWorker(const std::string &address, uint64_t){
+            std::cerr << "distributed rendering is not supported on Windows, can't use worker " << address << std::endl;
+            return false;
+        }
+        bool addLocalWorkers(unsigned int, const std::function<void(int)> &){
+            std::cerr << "distributed rendering is not supported on Windows" << std::endl;
+            return false;
+        }
+        size_t workerCount() const { return 0; }
+        void render(rt::Renderer &, const std::vector<rt::vertex> &, const RenderSettings &, const glm::mat4 &, float,
+                    unsigned int, FrameBuffer<uint32_t> &){}
+        std::string report() const { return ""; }
+    };
+
+    inline bool runWorker(const std::string &, const std::function<void(int)> &){
+        std::cerr << "distributed rendering is not supported on Windows" << std::endl;
+        return false;
+    }
+
+    inline void serveCoordinator(int, const std::vector<rt::vertex> &, rt::Renderer &, uint64_t, unsigned int){}
+
+#else
+
+    // writes all of data, false if the connection is closed
+    inline bool sendAll(int fd, const void *data, size_t size){
+        const char *bytes = static_cast<const char*>(data);
+        while (size > 0){
+            ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= size_t(sent);
+        }
+        return true;
+    }
+
+    // reads exactly size bytes, false if the connection is closed first
+    inline bool receiveAll(int fd, void *data, size_t size){
+        char *bytes = static_cast<char*>(data);
+        while (size > 0){
+            ssize_t received = recv(fd, bytes, size, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+            bytes += received;
+            size -= size_t(received);
+        }
+        return true;
+    }
+
+    // makes receiveAll fail when no data arrives for ms milliseconds, 0 waits forever
+    inline void setReceiveTimeout(int fd, double ms){
+        timeval timeout{};
+        timeout.tv_sec = time_t(ms / 1000);
+        timeout.tv_usec = suseconds_t((ms - double(timeout.tv_sec) * 1000) * 1000);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    inline bool sendMessage(int fd, MessageType type, const void *payload, size_t size,
+                            const void *extra = nullptr, size_t extra_size = 0){
+        MessageHeader header{type, uint32_t(size + extra_size)};
+        return sendAll(fd, &header, sizeof(header)) && sendAll(fd, payload, size) &&
+               (extra_size == 0 || sendAll(fd, extra, extra_size));
+    }
+
+    // Addresses are unix:<path> for a Unix socket, or <host>:<port> for TCP (an empty host is localhost for
+    // connections, all interfaces for a worker). Returns a connected socket, -1 on failure
+    inline int connectTo(const std::string &address){
+        if (address.compare(0, 5, "unix:") == 0){
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            std::string path = address.substr(5);
+            if (path.size() >= sizeof(addr.sun_path)) return -1;
+            std::strcpy(addr.sun_path, path.c_str());
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) return fd;
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        size_t colon = address.find_last_of(':');
+        if (colon == std::string::npos) return -1;
+        std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+        addrinfo hints{}, *results = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &results) != 0) return -1;
+        int fd = -1;
+        for (addrinfo *ai = results; ai && fd < 0; ai = ai->ai_next){
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0){
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(results);
+        if (fd >= 0){
+            // requests are small and answered right away, they should not wait for more data
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    // listening socket on address (see connectTo), -1 on failure. An existing Unix socket file is replaced
+    inline int listenOn(const std::string &address){
+        int fd = -1;
+        if (address.compare(0, 5, "unix:") == 0){
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            std::string path = address.substr(5);
+            if (path.size() >= sizeof(addr.sun_path)) return -1;
+            std::strcpy(addr.sun_path, path.c_str());
+            unlink(path.c_str());
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0){
+                close(fd);
+                fd = -1;
+            }
+        }
+        else {
+            size_t colon = address.find_last_of(':');
+            if (colon == std::string::npos) return -1;
+            std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+            addrinfo hints{}, *results = nullptr;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) != 0) return -1;
+            for (addrinfo *ai = results; ai && fd < 0; ai = ai->ai_next){
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                int one = 1;
+                if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if (fd >= 0 && bind(fd, ai->ai_addr, ai->ai_addrlen) != 0){
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(results);
+        }
+        if (fd >= 0 && listen(fd, 16) != 0){
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    // Worker side of a connection: answers the hello, then renders the tiles it is sent until the coordinator
+    // disconnects. delay_ms is slept before every tile, to try out what the coordinator does with slow workers
+    inline void serveCoordinator(int fd, const std::vector<rt::vertex> &vts, rt::Renderer &renderer,
+                                 uint64_t scene_key, unsigned int delay_ms){
+        MessageHeader header;
+        Hello hello;
+        if (!receiveAll(fd, &header, sizeof(header)) || header.type != MessageType::hello ||
+            header.size != sizeof(hello) || !receiveAll(fd, &hello, sizeof(hello)))
+            return;
+        Hello answer{scene_key, protocol_magic, protocol_version};
+        if (!sendMessage(fd, MessageType::hello, &answer, sizeof(answer)) ||
+            hello.magic != protocol_magic || hello.version != protocol_version)
+            return;
+
+        FrameMessage settings{};
+        glm::mat4 view(1);
+        std::unique_ptr<FrameBuffer<uint32_t>> fb;
+        std::vector<uint32_t> pixels;
+        while (receiveAll(fd, &header, sizeof(header))){
+            if (header.type == MessageType::frame && header.size == sizeof(FrameMessage)){
+                if (!receiveAll(fd, &settings, sizeof(settings))) return;
+                if (settings.W == 0 || settings.H == 0 || settings.W > max_frame_size || settings.H > max_frame_size)
+                    return;
+                std::memcpy(&view, settings.view, sizeof(settings.view));
+                renderer.use_bvh = settings.use_bvh != 0;
+                renderer.use_packets = settings.use_packets != 0;
+                renderer.bvh_width = settings.bvh_width;
+                renderer.light_samples = settings.light_samples;
+                if (!fb || fb->W != settings.W || fb->H != settings.H)
+                    fb.reset(new FrameBuffer<uint32_t>(settings.W, settings.H));
+            }
+            else if (header.type == MessageType::tile && header.size == sizeof(TileMessage) && fb){
+                TileMessage request;
+                if (!receiveAll(fd, &request, sizeof(request))) return;
+                if (request.x0 >= request.x1 || request.y0 >= request.y1 || request.x1 > fb->W || request.y1 > fb->H)
+                    return;
+                if (delay_ms > 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+                rt::Tile region{request.x0, request.y0, request.x1, request.y1};
+                renderer.renderRegion(vts, glm::mat4(1), view, settings.fov_degrees, settings.depth, region, *fb);
+                pixels.clear();
+                for (unsigned int y = region.y0; y < region.y1; y++)
+                    pixels.insert(pixels.end(), fb->buffer + region.x0 + y * fb->W, fb->buffer + region.x1 + y * fb->W);
+                if (!sendMessage(fd, MessageType::result, &request, sizeof(request),
+                                 pixels.data(), pixels.size() * sizeof(uint32_t)))
+                    return;
+            }
+            else
+                return; // not a message of this protocol
+        }
+    }
+
+    // Listens on address and serves one coordinator after the other with serve(socket). Only returns if the address
+    // can't be listened on
+    inline bool runWorker(const std::string &address, const std::function<void(int)> &serve){
+        signal(SIGPIPE, SIG_IGN);
+        int listener = listenOn(address);
+        if (listener < 0){
+            std::cerr << "can't listen on " << address << std::endl;
+            return false;
+        }
+        std::cout << "worker listening on " << address << std::endl;
+        while (true){
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
+            std::cout << "worker: coordinator connected" << std::endl;
+            serve(fd);
+            close(fd);
+            std::cout << "worker: coordinator disconnected" << std::endl;
+        }
+    }
+
+    // Coordinator side: splits every frame in tiles of tile_size x tile_size pixels and keeps max_in_flight tiles
+    // queued on every worker, so that a worker does not wait for its next tile. Tiles are handed out in order as the
+    // workers finish them, so fast workers get more of them. When a worker disconnects or stays silent for
+    // worker_timeout_ms, it is dropped and its tiles go back to the queue. Once the queue is empty, idle workers
+    // also take the tiles that have been in flight for more than straggler_factor times the average tile time, and
+    // the first copy that comes back is used. If no worker is left, the coordinator renders the rest itself.
+    // Every tile is rendered with renderRegion, so the image is the same as the one rendered by a single process.
+    class TileCoordinator{
+    public:
+        unsigned int tile_size = 64;
+        unsigned int max_in_flight = 2;
+        float straggler_factor = 4.0f;
+        double worker_timeout_ms = 30000;
+        // time a worker has to answer the hello, a silent one is not used
+        double handshake_timeout_ms = 5000;
+
+        TileCoordinator(){ signal(SIGPIPE, SIG_IGN); }
+
+        ~TileCoordinator(){
+            for (Worker &worker : m_workers)
+                if (worker.fd >= 0) close(worker.fd);
+            for (pid_t child : m_children)
+                waitpid(child, nullptr, 0);
+        }
+
+        // connects to the worker at address (see connectTo), false if it can't be reached or has another scene
+        bool addWorker(const std::string &address, uint64_t scene_key){
+            int fd = connectTo(address);
+            if (fd < 0){
+                std::cerr << "can't connect to worker " << address << std::endl;
+                return false;
+            }
+            return handshake(fd, address, scene_key);
+        }
+
+        // Starts count worker processes on this machine, connected by Unix socket pairs. Each child process calls
+        // serve(socket) and exits when it returns, with a copy of everything the coordinator has loaded. Must be
+        // called before the coordinator starts any thread: only the calling thread exists in the children
+        bool addLocalWorkers(unsigned int count, const std::function<void(int)> &serve){
+            for (unsigned int i = 0; i < count; i++){
+                int fds[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+                pid_t child = fork();
+                if (child < 0){
+                    close(fds[0]);
+                    close(fds[1]);
+                    return false;
+                }
+                if (child == 0){
+                    close(fds[0]);
+                    for (Worker &worker : m_workers)
+                        if (worker.fd >= 0) close(worker.fd);
+                    serve(fds[1]);
+                    _exit(0);
+                }
+                close(fds[1]);
+                m_children.push_back(child);
+                // the children have the same scene
+                Worker worker;
+                worker.fd = fds[0];
+                worker.name = "local " + std::to_string(i);
+                m_workers.push_back(worker);
+                setReceiveTimeout(worker.fd, handshake_timeout_ms);
+                if (!sendHello(worker.fd) || !receiveHello(worker.fd, nullptr)){
+                    close(worker.fd);
+                    m_workers.back().fd = -1;
+                    std::cerr << "local worker " << i << " did not start" << std::endl;
+                    return false;
+                }
+                setReceiveTimeout(worker.fd, 0);
+            }
+            return true;
+        }
+
+        // workers that are still connected
+        size_t workerCount() const {
+            return std::count_if(m_workers.begin(), m_workers.end(), [](const Worker &worker){ return worker.fd >= 0; });
+        }
+
+        // renders a frame of the scene vts (which has to be the scene of the workers) seen with the view matrix v
+        void render(rt::Renderer &renderer, const std::vector<rt::vertex> &vts, const RenderSettings &settings,
+                    const glm::mat4 &v, float fov_degrees, unsigned int depth, FrameBuffer<uint32_t> &fb){
+            m_frame_ID++;
+            m_tiles = rt::makeTiles(fb.W, fb.H, tile_size);
+            m_done.assign(m_tiles.size(), 0);
+            size_t remaining = m_tiles.size();
+            std::deque<uint32_t> queue;
+            for (uint32_t i = 0; i < m_tiles.size(); i++)
+                queue.push_back(i);
+
+            FrameMessage frame{m_frame_ID, fb.W, fb.H, depth, settings.use_bvh, settings.use_packets,
+                               settings.bvh_width, settings.light_samples, fov_degrees, {}};
+            std::memcpy(frame.view, &v, sizeof(frame.view));
+            for (Worker &worker : m_workers)
+                if (worker.fd >= 0 && !sendMessage(worker.fd, MessageType::frame, &frame, sizeof(frame)))
+                    drop(worker, queue, "the connection was closed");
+
+            std::vector<pollfd> polled;
+            std::vector<Worker*> polled_workers;
+            while (remaining > 0){
+                if (workerCount() == 0){
+                    // nobody left to render the rest
+                    for (uint32_t i = 0; i < m_tiles.size(); i++)
+                        if (!m_done[i]){
+                            renderer.renderRegion(vts, glm::mat4(1), v, fov_degrees, depth, m_tiles[i], fb);
+                            m_done[i] = 1;
+                            m_local_tiles++;
+                        }
+                    break;
+                }
+
+                // hand out tiles
+                auto now = Clock::now();
+                for (Worker &worker : m_workers){
+                    while (worker.fd >= 0 && worker.in_flight.size() < max_in_flight){
+                        uint32_t tile_ID;
+                        if (!nextTile(queue, worker, now, tile_ID)) break;
+                        const rt::Tile &tile = m_tiles[tile_ID];
+                        TileMessage request{m_frame_ID, tile_ID, tile.x0, tile.y0, tile.x1, tile.y1};
+                        if (worker.in_flight.empty()) worker.last_message = now;
+                        worker.in_flight.push_back(InFlight{m_frame_ID, tile_ID, now});
+                        if (!sendMessage(worker.fd, MessageType::tile, &request, sizeof(request)))
+                            drop(worker, queue, "the connection was closed");
+                    }
+                }
+
+                // wait for results
+                polled.clear();
+                polled_workers.clear();
+                for (Worker &worker : m_workers)
+                    if (worker.fd >= 0 && !worker.in_flight.empty()){
+                        polled.push_back(pollfd{worker.fd, POLLIN, 0});
+                        polled_workers.push_back(&worker);
+                    }
+                if (!polled.empty() && poll(polled.data(), polled.size(), 10) < 0 && errno != EINTR)
+                    break;
+                now = Clock::now();
+                for (size_t i = 0; i < polled.size(); i++){
+                    Worker &worker = *polled_workers[i];
+                    if (polled[i].revents != 0 && !receive(worker, fb, remaining))
+                        drop(worker, queue, "the connection was closed or a message was invalid");
+                    else if (worker.fd >= 0 && !worker.in_flight.empty() &&
+                             millisecondsBetween(worker.last_message, now) > worker_timeout_ms)
+                        drop(worker, queue, "it did not answer for " + std::to_string(int(worker_timeout_ms)) + " ms");
+                }
+            }
+        }
+
+        // tiles rendered by each worker and reassigned, one line
+        std::string report() const {
+            std::string text;
+            for (const Worker &worker : m_workers)
+                text += (text.empty() ? "" : ", ") + worker.name + ": " + std::to_string(worker.tiles) +
+                        (worker.fd < 0 ? " (dropped)" : "");
+            text += "; " + std::to_string(m_reassigned) + " reassigned, " + std::to_string(m_duplicated) +
+                    " duplicated, " + std::to_string(m_local_tiles) + " rendered locally";
+            return text;
+        }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct InFlight{
+            uint32_t frame_ID, tile_ID;
+            Clock::time_point sent;
+        };
+
+        struct Worker{
+            int fd = -1;
+            std::string name;
+            // tiles sent and not answered yet, in the order they were sent (and are answered)
+            std::deque<InFlight> in_flight;
+            // bytes received that do not make a whole message yet
+            std::vector<uint8_t> received;
+            Clock::time_point last_message;
+            size_t tiles = 0;
+        };
+
+        std::vector<Worker> m_workers;
+        std::vector<pid_t> m_children;
+        uint32_t m_frame_ID = 0;
+        std::vector<rt::Tile> m_tiles;
+        std::vector<uint8_t> m_done;
+        // average time from sending a tile to receiving it, and the number of tiles it is measured over
+        double m_tile_ms = 0;
+        size_t m_timed_tiles = 0;
+        size_t m_reassigned = 0, m_duplicated = 0, m_local_tiles = 0;
+
+        static double millisecondsBetween(Clock::time_point a, Clock::time_point b){
+            return std::chrono::duration<double, std::milli>(b - a).count();
+        }
+
+        static bool sendHello(int fd){
+            Hello hello{0, protocol_magic, protocol_version};
+            return sendMessage(fd, MessageType::hello, &hello, sizeof(hello));
+        }
+
+        // reads the answer to the hello, scene_key is checked unless it is null
+        static bool receiveHello(int fd, const uint64_t *scene_key){
+            MessageHeader header;
+            Hello answer;
+            return receiveAll(fd, &header, sizeof(header)) && header.type == MessageType::hello &&
+                   header.size == sizeof(answer) && receiveAll(fd, &answer, sizeof(answer)) &&
+                   answer.magic == protocol_magic && answer.version == protocol_version &&
+                   (!scene_key || answer.scene_key == *scene_key);
+        }
+
+        bool handshake(int fd, const std::string &name, uint64_t scene_key){
+            setReceiveTimeout(fd, handshake_timeout_ms);
+            if (!sendHello(fd) || !receiveHello(fd, &scene_key)){
+                std::cerr << "worker " << name << " did not answer in " << int(handshake_timeout_ms)
+                          << " ms or has another scene or protocol version, not used" << std::endl;
+                close(fd);
+                return false;
+            }
+            setReceiveTimeout(fd, 0);
+            Worker worker;
+            worker.fd = fd;
+            worker.name = name;
+            m_workers.push_back(worker);
+            return true;
+        }
+
+        // the next tile for worker: from the queue, or a tile that another worker takes too long for
+        bool nextTile(std::deque<uint32_t> &queue, const Worker &worker, Clock::time_point now, uint32_t &tile_ID){
+            while (!queue.empty()){
+                tile_ID = queue.front();
+                queue.pop_front();
+                if (!m_done[tile_ID]) return true;
+            }
+            if (m_timed_tiles == 0) return false;
+            double oldest = straggler_factor * m_tile_ms;
+            bool found = false;
+            for (const Worker &other : m_workers){
+                if (&other == &worker || other.fd < 0) continue;
+                for (const InFlight &sent : other.in_flight){
+                    if (sent.frame_ID != m_frame_ID || m_done[sent.tile_ID] || isInFlight(worker, sent.tile_ID))
+                        continue;
+                    double age = millisecondsBetween(sent.sent, now);
+                    if (age > oldest && copies(sent.tile_ID) < 2){
+                        oldest = age;
+                        tile_ID = sent.tile_ID;
+                        found = true;
+                    }
+                }
+            }
+            if (found) m_duplicated++;
+            return found;
+        }
+
+        bool isInFlight(const Worker &worker, uint32_t tile_ID) const {
+            for (const InFlight &sent : worker.in_flight)
+                if (sent.frame_ID == m_frame_ID && sent.tile_ID == tile_ID) return true;
+            return false;
+        }
+
+        // workers the tile of the current frame is in flight on
+        unsigned int copies(uint32_t tile_ID) const {
+            unsigned int count = 0;
+            for (const Worker &worker : m_workers)
+                if (worker.fd >= 0 && isInFlight(worker, tile_ID)) count++;
+            return count;
+        }
+
+        // disconnects worker, its unfinished tiles of the current frame go to the front of the queue
+        void drop(Worker &worker, std::deque<uint32_t> &queue, const std::string &reason){
+            std::cerr << "worker " << worker.name << " dropped, " << reason << ", its tiles are reassigned" << std::endl;
+            close(worker.fd);
+            worker.fd = -1;
+            for (auto sent = worker.in_flight.rbegin(); sent != worker.in_flight.rend(); ++sent)
+                if (sent->frame_ID == m_frame_ID && !m_done[sent->tile_ID]){
+                    queue.push_front(sent->tile_ID);
+                    m_reassigned++;
+                }
+            worker.in_flight.clear();
+        }
+
+        // reads what worker has sent and stores the tiles it completed, false if the connection is closed or a
+        // message is not what was expected
+        bool receive(Worker &worker, FrameBuffer<uint32_t> &fb, size_t &remaining){
+            uint8_t buffer[65536];
+            ssize_t received = recv(worker.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (received == 0) return false;
+            if (received < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            worker.received.insert(worker.received.end(), buffer, buffer + received);
+            worker.last_message = Clock::now();
+
+            size_t used = 0;
+            while (worker.received.size() - used >= sizeof(MessageHeader)){
+                MessageHeader header;
+                std::memcpy(&header, worker.received.data() + used, sizeof(header));
+                if (header.type != MessageType::result || header.size < sizeof(TileMessage) || worker.in_flight.empty())
+                    return false;
+                if (worker.received.size() - used - sizeof(header) < header.size) break;
+                const uint8_t *payload = worker.received.data() + used + sizeof(header);
+                used += sizeof(header) + header.size;
+
+                // the worker answers in order
+                TileMessage tile;
+                std::memcpy(&tile, payload, sizeof(tile));
+                InFlight sent = worker.in_flight.front();
+                worker.in_flight.pop_front();
+                if (tile.frame_ID != sent.frame_ID || tile.tile_ID != sent.tile_ID) return false;
+                if (sent.frame_ID != m_frame_ID) continue; // answer of a copy sent in a previous frame
+
+                const rt::Tile &region = m_tiles[tile.tile_ID];
+                unsigned int w = region.x1 - region.x0;
+                if (header.size != sizeof(TileMessage) + size_t(w) * (region.y1 - region.y0) * sizeof(uint32_t))
+                    return false;
+                double ms = millisecondsBetween(sent.sent, worker.last_message);
+                m_tile_ms = (m_tile_ms * m_timed_tiles + ms) / (m_timed_tiles + 1);
+                m_timed_tiles++;
+                if (m_done[tile.tile_ID]) continue; // another worker was faster
+                for (unsigned int y = region.y0; y < region.y1; y++)
+                    std::memcpy(fb.buffer + region.x0 + y * fb.W,
+                                payload + sizeof(TileMessage) + size_t(y - region.y0) * w * sizeof(uint32_t),
+                                w * sizeof(uint32_t));
+                m_done[tile.tile_ID] = 1;
+                remaining--;
+                worker.tiles++;
+            }
+            worker.received.erase(worker.received.begin(), worker.received.begin() + used);
+            return true;
+        }
+    };
+
+#endif
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_OFFLINE_DISTRIBUTED_H
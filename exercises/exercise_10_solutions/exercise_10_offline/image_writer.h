@@ -0,0 +1,111 @@
+//
+// Writes frame buffers to PPM and PNG files, without any external library
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_OFFLINE_IMAGE_WRITER_H
+#define ITU_GRAPHICS_PROGRAMMING_OFFLINE_IMAGE_WRITER_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <algorithm>
+#include "frame_buffer.h"
+
+// RGB rows of the frame buffer (RGBA32 colors), top row first. Row 0 of the frame buffer is the bottom of the image
+inline std::vector<uint8_t> toRGBRows(FrameBuffer<uint32_t> &fb){
+    std::vector<uint8_t> rgb;
+    rgb.reserve(fb.W * fb.H * 3);
+    for (unsigned int y = fb.H; y-- > 0;)
+        for (unsigned int x = 0; x < fb.W; x++){
+            uint32_t c = fb.valueAt(x, y);
+            rgb.push_back(c & 0xff);
+            rgb.push_back((c >> 8) & 0xff);
+            rgb.push_back((c >> 16) & 0xff);
+        }
+    return rgb;
+}
+
+// binary PPM (P6)
+inline bool writePPM(const std::string &path, FrameBuffer<uint32_t> &fb){
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::vector<uint8_t> rgb = toRGBRows(fb);
+    file << "P6\n" << fb.W << " " << fb.H << "\n255\n";
+    file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+    return bool(file);
+}
+
+// crc used by the PNG chunks
+inline uint32_t pngCRC(const uint8_t *data, size_t size, uint32_t crc = 0xffffffffu){
+    for (size_t i = 0; i < size; i++){
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+    }
+    return crc;
+}
+
+inline void pushBigEndian(std::vector<uint8_t> &out, uint32_t value){
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(uint8_t(value >> shift));
+}
+
+// RGB PNG. The image data is stored without compression (deflate "stored" blocks), that keeps the writer small
+// and the files are still readable by any PNG decoder
+inline bool writePNG(const std::string &path, FrameBuffer<uint32_t> &fb){
+    std::vector<uint8_t> rgb = toRGBRows(fb);
+
+    // every row starts with its filter type, 0 is no filter
+    std::vector<uint8_t> raw;
+    raw.reserve(rgb.size() + fb.H);
+    for (unsigned int y = 0; y < fb.H; y++){
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + y * fb.W * 3, rgb.begin() + (y + 1) * fb.W * 3);
+    }
+
+    // zlib stream made of stored blocks of at most 65535 bytes
+    std::vector<uint8_t> zlib = {0x78, 0x01};
+    size_t pos = 0;
+    do {
+        size_t size = std::min<size_t>(65535, raw.size() - pos);
+        bool last = pos + size == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(uint8_t(size));
+        zlib.push_back(uint8_t(size >> 8));
+        zlib.push_back(uint8_t(~size));
+        zlib.push_back(uint8_t(~size >> 8));
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + size);
+        pos += size;
+    } while (pos < raw.size());
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : raw){
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    pushBigEndian(zlib, (b << 16) | a);
+
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    auto chunk = [&](const char *type, const std::vector<uint8_t> &data){
+        pushBigEndian(png, data.size());
+        size_t start = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        pushBigEndian(png, ~pngCRC(png.data() + start, png.size() - start));
+    };
+
+    std::vector<uint8_t> header;
+    pushBigEndian(header, fb.W);
+    pushBigEndian(header, fb.H);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bits per channel, RGB, default compression, filter, no interlace
+    chunk("IHDR", header);
+    chunk("IDAT", zlib);
+    chunk("IEND", {});
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    file.write(reinterpret_cast<const char*>(png.data()), png.size());
+    return bool(file);
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_OFFLINE_IMAGE_WRITER_H
@@ -0,0 +1,562 @@
+// Offline (headless) renderer for the ray tracer of exercise_10_sol. It does not open a window or create an OpenGL
+// context, so it can run on machines without a GPU, and it reports how long each stage takes.
+//
+// usage: exercise_10_offline [options]
+//   --scene cubes|<file.obj>|car:<dir>|<file.stream>
+//                              scene to render (default cubes, the scene of exercise_10_sol). car:<dir> loads the car
+//                              of exercises 9 to 12 from dir, with the wheel instanced four times (rt::Scene), the
+//                              wheels turn from one frame to the next and the top level BVH is refitted.
+//                              A .stream file is an out-of-core mesh written by --write-stream, it is not loaded, its
+//                              pages are mapped as the rays reach them (rt::StreamedMesh)
+//   --page-cache <MB>          memory budget of the mapped pages of a .stream scene (default 256)
+//   --write-stream <file.stream>
+//                              converts the cubes or OBJ scene to an out-of-core mesh and exits
+//   --page-triangles <n>       triangles per page of --write-stream (default 4096)
+//   --texture <file>|checker   texture of the cubes or OBJ scene, looked up with the uv of the vertices and filtered
+//                              with the ray differentials (rt::Texture). checker is a generated checkerboard
+//   --no-textures              renders the car with the colors of its vertices only, instead of the diffuse textures
+//                              of its materials (map_Kd)
+//   --lights <n>               replaces the light of exercise 10 by n lights arranged like the 128 lights of exercise 12
+//                              (around the car, or over the floor of the bounding box of the cubes or OBJ scene)
+//   --light-samples <k>        shadow rays per hit (rt::Renderer::light_samples, default 1). With more than k lights,
+//                              k of them are picked at random by the light BVH instead of tracing one ray to each
+//   --fit                      center and scale the OBJ model to fit in [-1, 1]^3
+//   --size <W>x<H>             resolution (default 512x512)
+//   --depth <n>                ray recursion depth, 1 means no reflections (default 2)
+//   --eye <x,y,z>              camera position (default 0.9,0,1.5, the start position of exercise_10_sol)
+//   --target <x,y,z>           point the camera looks at (default: looks down the -z axis)
+//   --fov <degrees>            vertical field of view (default 70)
+//   --frames <n>               renders the image n times, the timings are averaged (default 1)
+//   --threads <n>              render threads, 0 for one per core (default 0)
+//   --no-bvh, --no-packets     disables the BVH / the packet traversal of primary rays
+//   --bvh-width 2|4|8          children per BVH node, 4 and 8 use the wide BVH with quantized boxes (default 2)
+//   --bvh-cache                stores the BVH of OBJ scenes next to the OBJ file (<file.obj>.bvh) and maps it on the
+//                              next start instead of building it. Stale files are detected and rewritten
+//   --wavefront                traces the frame stage by stage over ray queues (rt::Renderer::use_wavefront)
+//   --dynamic-resolution <ms>  traces only as many pixels as fit in ms per frame and upsamples the rest
+//                              (rt::DynamicResolution). The camera does not move, so every frame adds pixels until the
+//                              image is complete. Cubes and OBJ scenes only
+//   --checkerboard 2|4         traces 1/2 or 1/4 of the pixels per frame and reprojects the others from the previous
+//                              frame (rt::CheckerboardRenderer). Cubes and OBJ scenes only
+//   --path-trace <spp>         renders with diffuse path tracing instead (rt::Renderer::renderPathTraced), spp paths per
+//                              pixel with --depth bounces at most, a different random sequence every frame. Cubes and
+//                              OBJ scenes only
+//   --denoise                  filters the path traced frame with the edge avoiding a-trous filter (rt::ATrousDenoiser)
+//   --orbit <degrees>          turns the camera around the target by this angle every frame (default 0)
+//   --workers <address>[,<address>...]
+//                              renders the frames on worker processes (see distributed.h): the frame is split in
+//                              tiles that are handed to the workers, the tiles of workers that disconnect or are slow
+//                              are reassigned. The image is the same as without workers. Addresses are
+//                              unix:<path> or <host>:<port>. Cubes and OBJ scenes only
+//   --local-workers <n>        starts n worker processes on this machine (forked after the BVH is built), with
+//                              --threads threads each (default: the cores divided between them). Can be combined
+//                              with --workers
+//   --worker <address>         runs as a worker for a coordinator started with --workers, on the scene given by
+//                              --scene (the coordinator checks that it is the same). Serves one coordinator after
+//                              the other until it is stopped
+//   --worker-delay <ms>        a worker sleeps ms before every tile, to try out the reassignment of slow workers
+//   --out <file.ppm|file.png>  output image (default out.png)
+//   --stats <prefix>           writes heatmaps of the last frame to <prefix>_<field>.png (rays, node visits, triangle
+//                              tests, depth...) and a summary to <prefix>.json. Needs a build with RT_STATS
+
+#include <cstdint>
+#include <cfloat>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+// the implementation of stb_image is compiled here, scene.h only includes its declarations
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#include "rt_renderer.h"
+#include "rt_dynamic_resolution.h"
+#include "rt_checkerboard.h"
+#include "rt_denoiser.h"
+#include "scene.h"
+#include "image_writer.h"
+#include "distributed.h"
+
+using namespace std;
+
+struct Options{
+    string scene = "cubes";
+    bool fit = false;
+    unsigned int W = 512, H = 512;
+    unsigned int depth = 2;
+    glm::vec3 eye = glm::vec3(0.9f, 0.0f, 1.5f);
+    glm::vec3 target = glm::vec3(0.9f, 0.0f, 0.5f);
+    float fov = 70.0f;
+    unsigned int frames = 1;
+    unsigned int threads = 0;
+    bool bvh = true, packets = true;
+    bool wavefront = false;
+    bool bvh_cache = false;
+    unsigned int bvh_width = 2;
+    string out = "out.png";
+    string stats;
+    uint64_t page_cache_MB = 256;
+    string write_stream;
+    uint32_t page_triangles = 4096;
+    float dynamic_ms = 0;
+    unsigned int checkerboard = 0;
+    unsigned int path_spp = 0;
+    bool denoise = false;
+    float orbit = 0;
+    string texture;
+    bool textures = true;
+    unsigned int lights = 0;
+    unsigned int light_samples = 1;
+    vector<string> workers;
+    unsigned int local_workers = 0;
+    string worker;
+    unsigned int worker_delay_ms = 0;
+};
+
+void printUsage(){
+    cout << "usage: exercise_10_offline [--scene cubes|<file.obj>|car:<dir>|<file.stream>] [--fit] [--size WxH] [--depth n]" << endl
+         << "                           [--texture file|checker] [--no-textures] [--lights n] [--light-samples k]" << endl
+         << "                           [--eye x,y,z] [--target x,y,z] [--fov degrees] [--frames n]" << endl
+         << "                           [--threads n] [--no-bvh] [--no-packets] [--wavefront] [--dynamic-resolution ms]" << endl
+         << "                           [--checkerboard 2|4] [--path-trace spp] [--denoise] [--orbit degrees]" << endl
+         << "                           [--workers address,...] [--local-workers n] [--worker address] [--worker-delay ms]" << endl
+         << "                           [--bvh-width 2|4|8] [--bvh-cache]" << endl
+         << "                           [--out file.ppm|file.png] [--stats prefix]" << endl
+         << "                           [--page-cache MB] [--write-stream file.stream] [--page-triangles n]" << endl;
+}
+
+bool parseVec3(const string &text, glm::vec3 &v){
+    return sscanf(text.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+bool parseOptions(int argc, char **argv, Options &options){
+    bool target_set = false;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "--fit") options.fit = true;
+        else if (arg == "--no-bvh") options.bvh = false;
+        else if (arg == "--no-packets") options.packets = false;
+        else if (arg == "--wavefront") options.wavefront = true;
+        else if (arg == "--bvh-cache") options.bvh_cache = true;
+        else if (arg == "--no-textures") options.textures = false;
+        else if (arg == "--denoise") options.denoise = true;
+        else if (arg == "--help" || arg == "-h") return false;
+        else if (arg.compare(0, 2, "--") != 0) {
+            cerr << "unknown option " << arg << endl;
+            return false;
+        }
+        // the other options take a value
+        else if (i + 1 >= argc) {
+            cerr << "missing value for " << arg << endl;
+            return false;
+        }
+        else if (arg == "--scene") options.scene = argv[++i];
+        else if (arg == "--out") options.out = argv[++i];
+        else if (arg == "--texture") options.texture = argv[++i];
+        else if (arg == "--stats") options.stats = argv[++i];
+        else if (arg == "--write-stream") options.write_stream = argv[++i];
+        else if (arg == "--page-cache") options.page_cache_MB = stoull(argv[++i]);
+        else if (arg == "--page-triangles") options.page_triangles = max(1ul, stoul(argv[++i]));
+        else if (arg == "--size") {
+            if (sscanf(argv[++i], "%ux%u", &options.W, &options.H) != 2 || options.W == 0 || options.H == 0){
+                cerr << "invalid size " << argv[i] << endl;
+                return false;
+            }
+        }
+        else if (arg == "--depth") options.depth = stoul(argv[++i]);
+        else if (arg == "--fov") options.fov = stof(argv[++i]);
+        else if (arg == "--frames") options.frames = max(1ul, stoul(argv[++i]));
+        else if (arg == "--threads") options.threads = stoul(argv[++i]);
+        else if (arg == "--lights") options.lights = stoul(argv[++i]);
+        else if (arg == "--light-samples") options.light_samples = max(1ul, stoul(argv[++i]));
+        else if (arg == "--dynamic-resolution") options.dynamic_ms = stof(argv[++i]);
+        else if (arg == "--path-trace") options.path_spp = max(1ul, stoul(argv[++i]));
+        else if (arg == "--orbit") options.orbit = stof(argv[++i]);
+        else if (arg == "--local-workers") options.local_workers = stoul(argv[++i]);
+        else if (arg == "--worker") options.worker = argv[++i];
+        else if (arg == "--worker-delay") options.worker_delay_ms = stoul(argv[++i]);
+        else if (arg == "--workers") {
+            string list = argv[++i];
+            for (size_t begin = 0, end; begin <= list.size(); begin = end + 1){
+                end = min(list.find(',', begin), list.size());
+                if (end > begin) options.workers.push_back(list.substr(begin, end - begin));
+            }
+        }
+        else if (arg == "--checkerboard") {
+            options.checkerboard = stoul(argv[++i]);
+            if (options.checkerboard != 2 && options.checkerboard != 4){
+                cerr << "invalid checkerboard interval " << argv[i] << ", expected 2 or 4" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--bvh-width") {
+            options.bvh_width = stoul(argv[++i]);
+            if (options.bvh_width != 2 && options.bvh_width != 4 && options.bvh_width != 8){
+                cerr << "invalid BVH width " << argv[i] << ", expected 2, 4 or 8" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--eye" || arg == "--target") {
+            glm::vec3 &v = arg == "--eye" ? options.eye : options.target;
+            if (!parseVec3(argv[++i], v)){
+                cerr << "invalid vector " << argv[i] << ", expected x,y,z" << endl;
+                return false;
+            }
+            target_set |= arg == "--target";
+        }
+        else {
+            cerr << "unknown option " << arg << endl;
+            return false;
+        }
+    }
+    // by default the camera looks down the -z axis, like the camera of exercise_10_sol
+    if (!target_set)
+        options.target = options.eye + glm::vec3(0, 0, -1);
+    return true;
+}
+
+bool endsWith(const string &text, const string &suffix){
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// peak resident memory of the process in MB, 0 where it is not available
+double peakMemoryMB(){
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+    return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+double millisecondsSince(chrono::high_resolution_clock::time_point start){
+    return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+int main(int argc, char **argv){
+    Options options;
+    if (!parseOptions(argc, argv, options)){
+        printUsage();
+        return 1;
+    }
+    auto begin = chrono::high_resolution_clock::now();
+
+    // load the scene
+    // --------------
+    auto start = chrono::high_resolution_clock::now();
+    bool car_scene = options.scene.compare(0, 4, "car:") == 0;
+    bool stream_scene = endsWith(options.scene, ".stream");
+    vector<rt::vertex> vts;
+    CarParts car;
+    rt::StreamedMesh streamed;
+    if (stream_scene) {
+        if (!streamed.open(options.scene, options.page_cache_MB * 1024 * 1024)){
+            cerr << "can't open " << options.scene << ", or it is not a file written by --write-stream" << endl;
+            return 1;
+        }
+    }
+    else if (car_scene) {
+        if (!loadCar(options.scene.substr(4), car, options.textures))
+            return 1;
+    }
+    else if (options.scene == "cubes")
+        vts = makeCubeScene();
+    else if (!loadOBJScene(options.scene, options.fit, vts))
+        return 1;
+    rt::Texture texture;
+    if (options.texture == "checker")
+        texture = makeCheckerTexture();
+    else if (!options.texture.empty() && !loadTexture(options.texture, texture))
+        return 1;
+    double load_ms = millisecondsSince(start);
+    if (!options.texture.empty() && (car_scene || stream_scene)){
+        cerr << "--texture is for cubes or OBJ scenes, the car uses the textures of its materials" << endl;
+        return 1;
+    }
+    if (!car_scene && (stream_scene ? streamed.triangleCount() == 0 : vts.empty())){
+        cerr << "the scene has no triangles" << endl;
+        return 1;
+    }
+
+    if (options.lights > 0 && stream_scene){
+        cerr << "--lights is for cubes, OBJ or car scenes" << endl;
+        return 1;
+    }
+
+    if ((options.dynamic_ms > 0 || options.checkerboard) && (car_scene || stream_scene)){
+        cerr << "--dynamic-resolution and --checkerboard render cubes or OBJ scenes" << endl;
+        return 1;
+    }
+
+    if (options.denoise && !options.path_spp){
+        cerr << "--denoise filters path traced frames, it needs --path-trace" << endl;
+        return 1;
+    }
+    if (options.path_spp && (car_scene || stream_scene || options.dynamic_ms > 0 || options.checkerboard)){
+        cerr << "--path-trace renders whole frames of cubes or OBJ scenes, without --dynamic-resolution or --checkerboard" << endl;
+        return 1;
+    }
+
+    bool distributed = !options.workers.empty() || options.local_workers > 0;
+    if ((distributed || !options.worker.empty()) && (car_scene || stream_scene)){
+        cerr << "--workers, --local-workers and --worker render cubes or OBJ scenes" << endl;
+        return 1;
+    }
+    if (distributed && (options.dynamic_ms > 0 || options.checkerboard || options.wavefront || options.path_spp)){
+        cerr << "--workers and --local-workers render whole frames, without --dynamic-resolution, --checkerboard, --wavefront or --path-trace" << endl;
+        return 1;
+    }
+
+    if (!options.write_stream.empty()){
+        if (car_scene || stream_scene){
+            cerr << "--write-stream converts a cubes or OBJ scene" << endl;
+            return 1;
+        }
+        start = chrono::high_resolution_clock::now();
+        if (!rt::writeStreamedMesh(options.write_stream, vts, options.page_triangles)){
+            cerr << "can't write " << options.write_stream << endl;
+            return 1;
+        }
+        cout << "written:       " << options.write_stream << " (" << vts.size() / 3 << " triangles, "
+             << fixed << setprecision(2) << millisecondsSince(start) << " ms)" << endl;
+        return 0;
+    }
+
+    rt::Renderer renderer;
+    renderer.use_bvh = options.bvh;
+    renderer.use_packets = options.packets;
+    renderer.use_wavefront = options.wavefront;
+    renderer.thread_count = options.threads;
+    renderer.bvh_width = options.bvh_width;
+    renderer.texture = texture.empty() ? nullptr : &texture;
+    renderer.light_samples = options.light_samples;
+    if (options.lights > 0)
+        renderer.setLights(car_scene ? makeLights(options.lights, glm::vec3(0), 8.f, 2.f, renderer.light_attenuation) :
+                                       makeLights(options.lights, vts, renderer.light_attenuation));
+
+    // build the acceleration structure, render() would build it on the first frame otherwise
+    // ---------------------------------------------------------------------------------------
+    start = chrono::high_resolution_clock::now();
+    rt::Scene scene;
+    vector<uint32_t> wheel_IDs;
+    // the cube scene is generated, there is no file to store its BVH next to
+    bool bvh_cache = options.bvh_cache && options.scene != "cubes" && !stream_scene;
+    bool bvh_loaded = false;
+    if (car_scene) {
+        // the instanced scene always uses BVHs
+        wheel_IDs = addCar(car, scene, bvh_cache);
+        scene.update();
+    }
+    else if (stream_scene) {
+        // the BVH is in the file
+    }
+    else if (options.bvh && bvh_cache)
+        bvh_loaded = renderer.buildBVH(vts, options.scene + ".bvh");
+    else if (options.bvh)
+        renderer.buildBVH(vts);
+    double build_ms = millisecondsSince(start);
+
+    // distributed rendering
+    // ---------------------
+    uint64_t scene_key = distributed::sceneKey(vts, renderer);
+    if (!options.worker.empty()){
+        // the coordinator sends the view and the settings of every frame
+        return distributed::runWorker(options.worker, [&](int fd){
+            distributed::serveCoordinator(fd, vts, renderer, scene_key, options.worker_delay_ms);
+        }) ? 0 : 1;
+    }
+    distributed::TileCoordinator coordinator;
+    distributed::RenderSettings settings{options.bvh, options.packets, options.bvh_width, options.light_samples};
+    if (options.local_workers > 0){
+        // nothing has started a thread yet, so the children are complete copies of this process with the BVH
+        unsigned int threads = options.threads > 0 ? options.threads :
+                               max(1u, thread::hardware_concurrency() / options.local_workers);
+        bool started = coordinator.addLocalWorkers(options.local_workers, [&](int fd){
+            renderer.thread_count = threads;
+            distributed::serveCoordinator(fd, vts, renderer, scene_key, options.worker_delay_ms);
+        });
+        if (!started){
+            cerr << "can't start the local workers" << endl;
+            return 1;
+        }
+    }
+    for (const string &address : options.workers)
+        coordinator.addWorker(address, scene_key);
+    if (distributed && coordinator.workerCount() == 0){
+        cerr << "no worker is available" << endl;
+        return 1;
+    }
+
+    // render
+    // ------
+    FrameBuffer<uint32_t> fb(options.W, options.H);
+    glm::mat4 view = glm::lookAt(options.eye, options.target, glm::vec3(0, 1, 0));
+    double render_ms = 0, min_render_ms = DBL_MAX, refit_ms = 0;
+    rt::DynamicResolution dynamic;
+    dynamic.controller.target_ms = options.dynamic_ms;
+    rt::CheckerboardRenderer checkerboard;
+    checkerboard.interval = options.checkerboard;
+    rt::GBuffer gbuffer;
+    rt::ATrousDenoiser denoiser;
+    double denoise_ms = 0;
+    size_t traced_pixels = 0;
+    for (unsigned int frame = 0; frame < options.frames; frame++){
+        if (car_scene && frame > 0) {
+            // turn the wheels, only the top level BVH has to be refitted
+            start = chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < wheel_IDs.size(); i++)
+                scene.setTransform(wheel_IDs[i], car.wheel_transforms[i] * glm::rotate(.2f * frame, glm::vec3(1, 0, 0)));
+            scene.update();
+            refit_ms += millisecondsSince(start);
+        }
+
+        if (options.orbit != 0)
+            view = glm::lookAt(options.target + glm::vec3(glm::rotate(glm::radians(options.orbit * frame), glm::vec3(0, 1, 0)) *
+                                                          glm::vec4(options.eye - options.target, 0)),
+                               options.target, glm::vec3(0, 1, 0));
+
+        start = chrono::high_resolution_clock::now();
+        fb.clearBuffer(rt::Colors::toRGBA32(rt::Colors::black));
+        if (car_scene)
+            renderer.render(scene, view, options.fov, options.depth, fb);
+        else if (stream_scene)
+            renderer.render(streamed, glm::mat4(1), view, options.fov, options.depth, fb);
+        else if (distributed)
+            coordinator.render(renderer, vts, settings, view, options.fov, options.depth, fb);
+        else if (options.checkerboard)
+            traced_pixels += checkerboard.render(renderer, vts, glm::mat4(1), view, options.fov, options.depth, fb);
+        else if (options.dynamic_ms > 0)
+            traced_pixels += dynamic.render(renderer, vts, glm::mat4(1), view, options.fov, options.depth, fb);
+        else if (options.path_spp){
+            renderer.renderPathTraced(vts, glm::mat4(1), view, options.fov, options.depth, options.path_spp, fb,
+                                      options.denoise ? &gbuffer : nullptr, frame);
+            if (options.denoise){
+                auto denoise_start = chrono::high_resolution_clock::now();
+                denoiser.denoise(renderer, gbuffer, fb);
+                denoise_ms += millisecondsSince(denoise_start);
+            }
+        }
+        else
+            renderer.render(vts, glm::mat4(1), view, options.fov, options.depth, fb);
+        double ms = millisecondsSince(start);
+        render_ms += ms;
+        min_render_ms = min(min_render_ms, ms);
+    }
+
+    // write the image
+    // ---------------
+    start = chrono::high_resolution_clock::now();
+    bool png = options.out.size() >= 4 && options.out.compare(options.out.size() - 4, 4, ".png") == 0;
+    bool written = png ? writePNG(options.out, fb) : writePPM(options.out, fb);
+    double write_ms = millisecondsSince(start);
+    if (!written){
+        cerr << "can't write " << options.out << endl;
+        return 1;
+    }
+
+    // write the statistics of the last frame
+    // --------------------------------------
+    if (!options.stats.empty()){
+#ifdef RT_STATS
+        const vector<rt::RayStats> &pixel_stats = renderer.pixelStats();
+        const rt::StatField fields[] = {rt::StatField::rays, rt::StatField::shadow_rays, rt::StatField::reflection_rays,
+                                        rt::StatField::node_visits, rt::StatField::triangle_tests, rt::StatField::depth};
+        FrameBuffer<uint32_t> heatmap(options.W, options.H);
+        for (rt::StatField field : fields){
+            string path = options.stats + "_" + rt::statName(field) + ".png";
+            uint64_t max_value = rt::paintHeatmap(pixel_stats, field, heatmap);
+            if (!writePNG(path, heatmap)){
+                cerr << "can't write " << path << endl;
+                return 1;
+            }
+            cout << "heatmap:       " << path << " (max " << max_value << " per pixel)" << endl;
+        }
+        ofstream json(options.stats + ".json");
+        rt::writeStatsJSON(json, pixel_stats, options.W, options.H);
+        if (!json){
+            cerr << "can't write " << options.stats << ".json" << endl;
+            return 1;
+        }
+        cout << "statistics:    " << options.stats << ".json" << endl;
+#else
+        cerr << "--stats needs a build with RT_STATS defined (cmake -DRT_STATS=ON), no statistics written" << endl;
+#endif
+    }
+    double total_ms = millisecondsSince(begin);
+
+    // report
+    // ------
+    double primary_rays = options.dynamic_ms > 0 || options.checkerboard ? double(traced_pixels) : double(options.W) * options.H * options.frames;
+    cout << "scene:         " << options.scene << " (";
+    if (car_scene)
+        cout << scene.sceneTriangleCount() << " triangles, " << scene.storedTriangleCount() << " stored in "
+             << scene.meshCount() << " meshes, " << scene.instanceCount() << " instances)" << endl;
+    else if (stream_scene)
+        cout << streamed.triangleCount() << " triangles in " << streamed.pageCount() << " pages)" << endl;
+    else
+        cout << vts.size() / 3 << " triangles)" << endl;
+    cout << "image:         " << options.out << " (" << options.W << "x" << options.H << ", depth " << options.depth
+         << (options.wavefront ? ", wavefront" : "")
+         << ", " << options.frames << " frame" << (options.frames > 1 ? "s" : "") << ")" << endl
+         << fixed << setprecision(2)
+         << "scene load:    " << setw(10) << load_ms << " ms" << endl
+         << "bvh build:     " << setw(10) << build_ms << " ms" << (options.bvh || car_scene ? "" : " (disabled)")
+         << (bvh_loaded ? " (mapped from " + options.scene + ".bvh)" : bvh_cache && options.bvh && !car_scene ? " (written to " + options.scene + ".bvh)" : "")
+         << endl;
+    if (options.lights > 0)
+        cout << "lights:        " << renderer.lights().size() << " (light BVH of " << renderer.lightBVH().nodeCount()
+             << " nodes), " << options.light_samples << " shadow ray" << (options.light_samples > 1 ? "s" : "") << " per hit" << endl;
+    if (!texture.empty())
+        cout << "texture:       " << options.texture << " (" << texture.width() << "x" << texture.height() << ", "
+             << texture.levelCount() << " mip levels, " << setw(4) << texture.bytes() / (1024.0 * 1024.0) << " MB)" << endl;
+    if (stream_scene){
+        rt::StreamedMesh::CacheStats cache = streamed.cacheStats();
+        cout << "page cache:    " << setw(10) << cache.peak_resident_bytes / (1024.0 * 1024.0) << " MB peak (budget "
+             << options.page_cache_MB << " MB), " << cache.loads << " page loads, " << cache.evictions << " evictions" << endl;
+    }
+    if (options.bvh && !car_scene && !stream_scene){
+        size_t binary_bytes = renderer.bvh().nodes.size() * sizeof(rt::BVHNode);
+        size_t node_bytes = options.bvh_width == 4 ? renderer.bvh4().nodeBytes() :
+                            options.bvh_width == 8 ? renderer.bvh8().nodeBytes() : binary_bytes;
+        cout << "bvh nodes:     " << setw(10) << node_bytes / 1024.0 << " KB (width " << options.bvh_width;
+        if (options.bvh_width != 2)
+            cout << ", binary " << binary_bytes / 1024.0 << " KB";
+        cout << ")" << endl;
+    }
+    if (options.dynamic_ms > 0)
+        cout << "dynamic res:   " << setw(10) << dynamic.controller.scale() << " scale, traced " << dynamic.gridWidth()
+             << "x" << dynamic.gridHeight() << " in the last frame, " << dynamic.exactPixels() << " of "
+             << options.W * options.H << " pixels complete" << endl;
+    if (options.path_spp)
+        cout << "path tracing:  " << options.path_spp << " paths per pixel, up to " << options.depth << " bounces"
+             << (options.denoise ? ", denoised" : "") << endl;
+    if (options.denoise)
+        cout << "denoise:       " << setw(10) << denoise_ms / options.frames << " ms per frame (" << denoiser.iterations
+             << " a-trous iterations, included in render)" << endl;
+    if (distributed)
+        cout << "workers:       " << setw(10) << coordinator.workerCount() << " connected, tiles: " << coordinator.report() << endl;
+    if (car_scene && options.frames > 1)
+        cout << "bvh refit:     " << setw(10) << refit_ms / (options.frames - 1) << " ms per frame" << endl;
+    cout << "render:        " << setw(10) << render_ms / options.frames << " ms per frame (best "
+         << min_render_ms << " ms)" << endl
+         << "image write:   " << setw(10) << write_ms << " ms" << endl
+         << "wall time:     " << setw(10) << total_ms << " ms" << endl;
+    if (peakMemoryMB() > 0)
+        cout << "peak memory:   " << setw(10) << peakMemoryMB() << " MB" << endl;
+    cout << setprecision(0)
+         << "primary rays/s:" << setw(10) << primary_rays / (render_ms / 1000.0) << endl;
+    return 0;
+}
@@ -0,0 +1,312 @@
+//
+// Scenes for the offline renderer
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_OFFLINE_SCENE_H
+#define ITU_GRAPHICS_PROGRAMMING_OFFLINE_SCENE_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cfloat>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <glm/gtc/constants.hpp>
+#include <stb_image.h>
+#include "rt_types.h"
+#include "rt_scene.h"
+#include "rt_texture.h"
+#include "rt_lights.h"
+#include "primitives.h"
+
+// the scene of exercise_10_sol: a small cube inside a big grey cube that is seen from the inside
+inline std::vector<rt::vertex> makeCubeScene(){
+    std::vector<glm::vec3> points;
+    std::vector<glm::vec4> colors;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> uvs;
+    Primitives::makeCube(2.f, points, normals, uvs, colors);
+
+    std::vector<rt::vertex> vts;
+    glm::mat4 scale = glm::scale(glm::vec3(.25f,.25f,.25f));
+    for (unsigned int i = 0; i < points.size(); i++)
+        vts.push_back(rt::vertex{scale * glm::vec4(points[i], 1.0f), glm::vec4(normals[i], 0), colors[i], uvs[i]});
+
+    glm::mat4 outsideout = glm::scale(glm::vec3(-2.f,-2.f,-2.f));
+    for (unsigned int i = 0; i < points.size(); i++)
+        vts.push_back(rt::vertex{outsideout * glm::vec4(points[i], 1.0f), glm::vec4(normals[i], 0), rt::Colors::grey, uvs[i]});
+
+    return vts;
+}
+
+// obj indices start at 1, negative indices count from the end of the list
+inline int objIndex(int index, size_t count){
+    return index > 0 ? index - 1 : int(count) + index;
+}
+
+// Loads the triangles of an OBJ file (v, vt, vn and f, polygons are split in triangle fans). Faces without
+// normals get the normal of the face plane. If fit is true, the model is centered and scaled to fit in [-1, 1]^3.
+// Returns false if the file can't be read.
+inline bool loadOBJScene(const std::string &path, bool fit, std::vector<rt::vertex> &vts){
+    std::ifstream file(path);
+    if (!file){
+        std::cerr << "can't open " << path << std::endl;
+        return false;
+    }
+
+    std::vector<glm::vec3> positions, normals;
+    std::vector<glm::vec2> uvs;
+    std::string line;
+    while (std::getline(file, line)){
+        std::istringstream in(line);
+        std::string type;
+        in >> type;
+        if (type == "v"){
+            glm::vec3 p(0);
+            in >> p.x >> p.y >> p.z;
+            positions.push_back(p);
+        } else if (type == "vn"){
+            glm::vec3 n(0);
+            in >> n.x >> n.y >> n.z;
+            normals.push_back(n);
+        } else if (type == "vt"){
+            glm::vec2 uv(0);
+            in >> uv.x >> uv.y;
+            uvs.push_back(uv);
+        } else if (type == "f"){
+            // each corner is v, v/vt, v//vn or v/vt/vn
+            std::vector<rt::vertex> face;
+            bool has_normals = true;
+            std::string corner;
+            while (in >> corner){
+                int v = 0, t = 0, n = 0;
+                if (sscanf(corner.c_str(), "%d/%d/%d", &v, &t, &n) != 3 &&
+                    sscanf(corner.c_str(), "%d//%d", &v, &n) != 2 &&
+                    sscanf(corner.c_str(), "%d/%d", &v, &t) != 2)
+                    sscanf(corner.c_str(), "%d", &v);
+
+                int vi = objIndex(v, positions.size()), ti = objIndex(t, uvs.size()), ni = objIndex(n, normals.size());
+                if (v == 0 || vi < 0 || vi >= int(positions.size()))
+                    continue; // broken index, skip the corner
+                rt::vertex vtx{glm::vec4(positions[vi], 1), glm::vec4(0), rt::Colors::white, glm::vec2(0)};
+                if (t != 0 && ti >= 0 && ti < int(uvs.size())) vtx.uv = uvs[ti];
+                if (n != 0 && ni >= 0 && ni < int(normals.size())) vtx.norm = glm::vec4(glm::normalize(normals[ni]), 0);
+                else has_normals = false;
+                face.push_back(vtx);
+            }
+
+            for (size_t i = 2; i < face.size(); i++){
+                rt::vertex tri[3] = {face[0], face[i - 1], face[i]};
+                if (!has_normals){
+                    glm::vec3 n = glm::cross(glm::vec3(tri[1].pos - tri[0].pos), glm::vec3(tri[2].pos - tri[0].pos));
+                    float len = glm::length(n);
+                    glm::vec4 face_normal = len > 0 ? glm::vec4(n / len, 0) : glm::vec4(0, 1, 0, 0);
+                    for (auto &vtx : tri) vtx.norm = face_normal;
+                }
+                vts.insert(vts.end(), tri, tri + 3);
+            }
+        }
+    }
+
+    if (fit && !vts.empty()){
+        glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+        for (const auto &vtx : vts){
+            bmin = glm::min(bmin, glm::vec3(vtx.pos));
+            bmax = glm::max(bmax, glm::vec3(vtx.pos));
+        }
+        glm::vec3 extent = bmax - bmin;
+        float scale = 2.0f / glm::max(glm::max(extent.x, extent.y), glm::max(extent.z, 1e-6f));
+        glm::vec3 center = (bmin + bmax) * .5f;
+        for (auto &vtx : vts)
+            vtx.pos = glm::vec4((glm::vec3(vtx.pos) - center) * scale, 1);
+    }
+    return true;
+}
+
+// Loads an image file (PNG, JPG, TGA...) as a texture. The bottom row of the image is row 0 of the texture, where the
+// v texture coordinate of OBJ files is 0. Returns false if the file can't be read
+inline bool loadTexture(const std::string &path, rt::Texture &texture){
+    int W, H, channels;
+    stbi_set_flip_vertically_on_load(true);
+    unsigned char *data = stbi_load(path.c_str(), &W, &H, &channels, 4);
+    if (!data){
+        std::cerr << "can't load texture " << path << std::endl;
+        return false;
+    }
+    texture.build(W, H, data);
+    stbi_image_free(data);
+    return true;
+}
+
+// a checkerboard of 16 x 16 squares in a 1024 x 1024 texture, fine enough to show aliasing on every surface
+inline rt::Texture makeCheckerTexture(){
+    const unsigned int size = 1024, square = 64;
+    std::vector<uint8_t> rgba(size * size * 4);
+    for (unsigned int y = 0; y < size; y++)
+        for (unsigned int x = 0; x < size; x++){
+            bool light = ((x / square) + (y / square)) % 2 == 0;
+            uint8_t *texel = &rgba[4 * (x + y * size)];
+            texel[0] = light ? 240 : 40;
+            texel[1] = light ? 230 : 70;
+            texel[2] = light ? 210 : 120;
+            texel[3] = 255;
+        }
+    return rt::Texture(size, size, rgba.data());
+}
+
+// The diffuse texture (map_Kd) of the first material of an OBJ file that has one, looked up in the material
+// libraries (mtllib) of the file. Paths are relative to the directory of the OBJ file. Empty if there is none
+inline std::string objDiffuseTexture(const std::string &path){
+    std::string dir = path.substr(0, path.find_last_of("/\\") + 1);
+    std::ifstream file(path);
+    std::vector<std::string> libraries, materials;
+    std::string line;
+    while (std::getline(file, line)){
+        std::istringstream in(line);
+        std::string type, name;
+        in >> type;
+        std::getline(in >> std::ws, name);
+        if (!name.empty() && name.back() == '\r') name.pop_back();
+        if (type == "mtllib") libraries.push_back(name);
+        else if (type == "usemtl" && std::find(materials.begin(), materials.end(), name) == materials.end())
+            materials.push_back(name);
+    }
+
+    // diffuse texture of every material of the libraries
+    std::vector<std::pair<std::string, std::string>> textures;
+    for (const std::string &library : libraries){
+        std::ifstream mtl(dir + library);
+        std::string material;
+        while (std::getline(mtl, line)){
+            std::istringstream in(line);
+            std::string type;
+            in >> type;
+            if (type == "newmtl"){
+                std::getline(in >> std::ws, material);
+                if (!material.empty() && material.back() == '\r') material.pop_back();
+            }
+            else if (type == "map_Kd"){
+                // the options (-bm 1, -s 1 1 1...) come before the file name, which is the last word
+                std::string word, texture;
+                while (in >> word) texture = word;
+                textures.emplace_back(material, texture);
+            }
+        }
+    }
+    for (const std::string &material : materials)
+        for (const auto &texture : textures)
+            if (texture.first == material && !texture.second.empty())
+                return dir + texture.second;
+    return "";
+}
+
+// the car of exercises 9 to 12, the wheel mesh is used four times
+struct CarParts{
+    std::vector<std::vector<rt::vertex>> body_parts;
+    std::vector<rt::vertex> wheel;
+    // the OBJ files the meshes were loaded from
+    std::vector<std::string> body_files;
+    std::string wheel_file;
+    // diffuse textures of the body parts and of the wheel, empty if they have none
+    std::vector<rt::Texture> body_textures;
+    rt::Texture wheel_texture;
+    // transforms of the four wheels, same as in exercise 9
+    std::vector<glm::mat4> wheel_transforms;
+};
+
+// Loads the OBJ files of the car from dir (Body_LOD0.obj, Wheel_LOD0.obj, ...), and the diffuse textures of their
+// materials if textures is true. A part whose texture can't be loaded is rendered with its vertex colors
+inline bool loadCar(const std::string &dir, CarParts &car, bool textures = true){
+    for (const char *part : {"Body", "Interior", "Paint", "Light", "Windows"}){
+        car.body_parts.emplace_back();
+        car.body_files.push_back(dir + "/" + part + "_LOD0.obj");
+        if (!loadOBJScene(car.body_files.back(), false, car.body_parts.back()))
+            return false;
+    }
+    car.wheel_file = dir + "/Wheel_LOD0.obj";
+    if (!loadOBJScene(car.wheel_file, false, car.wheel))
+        return false;
+
+    car.body_textures.resize(car.body_files.size());
+    for (size_t i = 0; textures && i < car.body_files.size(); i++){
+        std::string texture = objDiffuseTexture(car.body_files[i]);
+        if (!texture.empty()) loadTexture(texture, car.body_textures[i]);
+    }
+    std::string wheel_texture = textures ? objDiffuseTexture(car.wheel_file) : "";
+    if (!wheel_texture.empty()) loadTexture(wheel_texture, car.wheel_texture);
+
+    glm::mat4 flip = glm::rotate(glm::mat4(1.0f), glm::pi<float>(), glm::vec3(0.0, 1.0, 0.0));
+    car.wheel_transforms = {glm::translate(glm::mat4(1.0f), glm::vec3(-.7432, .328, 1.39)),
+                            glm::translate(glm::mat4(1.0f), glm::vec3(-.7432, .328, -1.296)),
+                            glm::translate(flip, glm::vec3(-.7432, .328, 1.296)),
+                            glm::translate(flip, glm::vec3(-.7432, .328, -1.39))};
+    return true;
+}
+
+// adds the car to the scene (this builds the BVH of each mesh), the wheel mesh is stored once and instanced
+// four times. Returns the IDs of the wheel instances, so that they can be animated. With bvh_cache the BVH of
+// each mesh is stored next to its OBJ file (<file.obj>.bvh) and loaded from there the next time. The meshes use
+// the textures of car, which must stay alive while the scene is rendered
+inline std::vector<uint32_t> addCar(const CarParts &car, rt::Scene &scene, bool bvh_cache = false){
+    for (size_t i = 0; i < car.body_parts.size(); i++){
+        uint32_t mesh = scene.addMesh(car.body_parts[i], bvh_cache ? car.body_files[i] + ".bvh" : "");
+        scene.setTexture(mesh, &car.body_textures[i]);
+        scene.addInstance(mesh, glm::mat4(1.0f));
+    }
+
+    uint32_t wheel_mesh = scene.addMesh(car.wheel, bvh_cache ? car.wheel_file + ".bvh" : "");
+    scene.setTexture(wheel_mesh, &car.wheel_texture);
+    std::vector<uint32_t> wheel_IDs;
+    for (const glm::mat4 &transform : car.wheel_transforms)
+        wheel_IDs.push_back(scene.addInstance(wheel_mesh, transform));
+    return wheel_IDs;
+}
+
+// The lights of exercise 12: count lights at random positions (same seed and generator) in a disk of radius max_dist
+// around center, up to max_height above it, with random colors between .5 and 1 times the light intensity of
+// exercise 12 (.3). attenuation receives the falloff used there. With center 0, max_dist 8 and max_height 2 these are
+// the lights around the car of exercise 12
+inline std::vector<rt::PointLight> makeLights(unsigned int count, const glm::vec3 &center, float max_dist, float max_height,
+                                              rt::LightAttenuation &attenuation){
+    const float ex12_dist = 8.f, ex12_height = 2.0f, intensity = .3f;
+    glm::vec3 scale(max_dist / ex12_dist, max_height / ex12_height, max_dist / ex12_dist);
+    std::vector<rt::PointLight> lights;
+    srand(13);
+    for (unsigned int i = 0; i < count; i++){
+        glm::vec3 pos, col;
+        bool valid = false;
+        while (!valid){ // in a circle instead of a square
+            pos.x = ((rand() % 100) / 100.f) * ex12_dist * 2 - ex12_dist;
+            pos.z = ((rand() % 100) / 100.f) * ex12_dist * 2 - ex12_dist;
+            pos.y = ((rand() % 100) / 100.f) * ex12_height;
+            valid = glm::dot(pos, pos) < ex12_dist * ex12_dist + ex12_height * ex12_height;
+        }
+        col.r = ((rand() % 100) / 200.f) + 0.5f;
+        col.g = ((rand() % 100) / 200.f) + 0.5f;
+        col.b = ((rand() % 100) / 200.f) + 0.5f;
+        lights.push_back(rt::PointLight{center + pos * scale, col * intensity});
+    }
+    attenuation = rt::LightAttenuation{.2f, .5f, 1.0f};
+    return lights;
+}
+
+// same, with the disk on the floor of the bounding box of vts and almost as large as the box
+inline std::vector<rt::PointLight> makeLights(unsigned int count, const std::vector<rt::vertex> &vts, rt::LightAttenuation &attenuation){
+    glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+    for (const rt::vertex &v : vts){
+        bmin = glm::min(bmin, glm::vec3(v.pos));
+        bmax = glm::max(bmax, glm::vec3(v.pos));
+    }
+    if (vts.empty()) bmin = bmax = glm::vec3(0);
+    glm::vec3 extent = bmax - bmin;
+    glm::vec3 center((bmin.x + bmax.x) * .5f, bmin.y, (bmin.z + bmax.z) * .5f);
+    return makeLights(count, center, .45f * std::max(extent.x, extent.z), .9f * extent.y, attenuation);
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_OFFLINE_SCENE_H
@@ -5,8 +5,11 @@
 #include <vector>
 #include <chrono>
 #include <string>
+#include <memory>
 #include <glm/gtx/transform.hpp>
 #include "rt_renderer.h"
+#include "rt_dynamic_resolution.h"
+#include "rt_checkerboard.h"
 #include "primitives.h"
 
 #include "camera.h"
@@ -17,7 +20,7 @@ void button_input_callback(GLFWwindow* window, int button, int action, int mods)
 void cursor_input_callback(GLFWwindow* window, double posX, double posY);
 void processInput(GLFWwindow* window);
 
-// rasterization grid resolution
+// rasterization grid resolution, used when dynamic resolution is off and by progressive rendering
 const int max_W = 64, max_H = 64;
 
 // window resolution
@@ -29,6 +32,12 @@ rt::Renderer renderer;
 
 float deltaTime = 0;
 unsigned int rtDepth = 2;
+bool progressive = false;
+// render at the window resolution, tracing as many pixels as the frame time allows (see rt_dynamic_resolution.h)
+bool dynamicResolution = true;
+// 0 traces every pixel, 2 and 4 trace 1/2 or 1/4 of the pixels of the window every frame and reproject the others
+// from the previous frame (see rt_checkerboard.h)
+unsigned int checkerboardInterval = 0;
 
 int main()
 {
@@ -106,6 +115,12 @@ int main()
     // ----------------------------------
     // every frame we will: draw to it, upload it to a texture, and copy the texture to the window frame buffer.
     FrameBuffer<uint32_t> customBuffer(max_W, max_H);
+    // with dynamic resolution we draw to a buffer of the size of the window instead
+    std::unique_ptr<FrameBuffer<uint32_t>> windowBuffer;
+    rt::DynamicResolution dynamic;
+    // leaves some of the 1/60 s of a frame to upload and show the image
+    dynamic.controller.target_ms = 12.0f;
+    rt::CheckerboardRenderer checkerboard;
 
 
     // initialize texture we will use to upload our buffer to GPU
@@ -139,6 +154,9 @@ int main()
     std::cout << "3 - two reflections" << std::endl;
     std::cout << "4 - three reflections" << std::endl;
     std::cout << "5 - four reflections" << std::endl;
+    std::cout << "P - toggle progressive rendering (accumulates samples while the camera is still)" << std::endl;
+    std::cout << "R - toggle dynamic resolution (traces as many pixels as fit in the frame time)" << std::endl;
+    std::cout << "C - checkerboard rendering: off, half of the pixels per frame, a quarter (the others are reprojected)" << std::endl;
 
     while (!glfwWindowShouldClose(window))
     {
@@ -148,20 +166,38 @@ int main()
 
         processInput(window);
 
+        int size_W, size_H;
+        glfwGetFramebufferSize(window, &size_W, &size_H);
+
         // render to our custom frame buffer
         // ---------------------------------
-        customBuffer.clearBuffer(rt::Colors::toRGBA32(rt::Colors::black));
-
-        glm::mat4 scale = glm::scale(glm::vec3(.5f,.5f,.5f));
+        FrameBuffer<uint32_t> *shownBuffer = &customBuffer;
+        if ((dynamicResolution || checkerboardInterval) && !progressive && size_W > 0 && size_H > 0) {
+            if (!windowBuffer || windowBuffer->W != (unsigned int) size_W || windowBuffer->H != (unsigned int) size_H)
+                windowBuffer.reset(new FrameBuffer<uint32_t>(size_W, size_H));
+            if (checkerboardInterval) {
+                checkerboard.interval = checkerboardInterval;
+                checkerboard.render(renderer, vts, glm::mat4(1), camera.GetViewMatrix(), 70.0f, rtDepth, *windowBuffer);
+            }
+            else
+                dynamic.render(renderer, vts, glm::mat4(1), camera.GetViewMatrix(), 70.0f, rtDepth, *windowBuffer);
+            shownBuffer = windowBuffer.get();
+        }
+        else {
+            customBuffer.clearBuffer(rt::Colors::toRGBA32(rt::Colors::black));
 
-        renderer.render(vts, glm::mat4(1), camera.GetViewMatrix(), 70.0f, rtDepth, customBuffer);
+            if (progressive)
+                renderer.renderProgressive(vts, glm::mat4(1), camera.GetViewMatrix(), 70.0f, rtDepth, customBuffer);
+            else
+                renderer.render(vts, glm::mat4(1), camera.GetViewMatrix(), 70.0f, rtDepth, customBuffer);
+        }
 
         // show our rendered image
         // -----------------------
         // upload the custom color buffer to the GPU using the texture
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, bufferTexture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, max_W, max_H, 0, GL_RGBA, GL_UNSIGNED_BYTE, customBuffer.buffer);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, shownBuffer->W, shownBuffer->H, 0, GL_RGBA, GL_UNSIGNED_BYTE, shownBuffer->buffer);
 
         // set opengl frame buffer object to read from our texture, we will copy from it
         glBindFramebuffer(GL_READ_FRAMEBUFFER, oglFrameBuffer);
@@ -171,9 +207,7 @@ int main()
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
         // copy from the frame buffer object (access the texture) to the window frame buffer
-        int size_W, size_H;
-        glfwGetFramebufferSize(window, &size_W, &size_H);
-        glBlitFramebuffer(0,0, max_W, max_H, 0, 0, size_W, size_H, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBlitFramebuffer(0,0, shownBuffer->W, shownBuffer->H, 0, 0, size_W, size_H, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 
         // display frame buffer
         glfwSwapBuffers(window);
@@ -185,7 +219,12 @@ int main()
             elapsed = std::chrono::high_resolution_clock::now() - frameStart;
         }
         deltaTime = elapsed.count();
-        glfwSetWindowTitle(window, ("Exercise 10 - FPS: " + std::to_string(int(1.0f/deltaTime + .5f))).c_str());
+        std::string title = "Exercise 10 - FPS: " + std::to_string(int(1.0f/deltaTime + .5f));
+        if (shownBuffer == windowBuffer.get() && checkerboardInterval)
+            title += " - checkerboard 1/" + std::to_string(checkerboardInterval);
+        else if (shownBuffer == windowBuffer.get())
+            title += " - traced " + std::to_string(dynamic.gridWidth()) + "x" + std::to_string(dynamic.gridHeight());
+        glfwSetWindowTitle(window, title.c_str());
     }
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
@@ -236,6 +275,22 @@ void processInput(GLFWwindow *window) {
     if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS) rtDepth = 4;
     if (glfwGetKey(window, GLFW_KEY_5) == GLFW_PRESS) rtDepth = 5;
 
+    // toggle on key press only, not while the key is held down
+    static bool progressiveKeyDown = false;
+    bool pDown = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+    if (pDown && !progressiveKeyDown) progressive = !progressive;
+    progressiveKeyDown = pDown;
+
+    static bool dynamicKeyDown = false;
+    bool rDown = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
+    if (rDown && !dynamicKeyDown) dynamicResolution = !dynamicResolution;
+    dynamicKeyDown = rDown;
+
+    static bool checkerboardKeyDown = false;
+    bool cDown = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+    if (cDown && !checkerboardKeyDown) checkerboardInterval = checkerboardInterval == 0 ? 2 : checkerboardInterval == 2 ? 4 : 0;
+    checkerboardKeyDown = cDown;
+
     // movement commands
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
         camera.ProcessKeyboard(FORWARD, deltaTime);
@@ -0,0 +1,405 @@
+//
+// Bounding volume hierarchy used to accelerate ray/model intersection queries
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_BVH_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cassert>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+#include "rt_triangles.h"
+#include "rt_storage.h"
+#include "rt_stats.h"
+
+namespace rt{
+
+    // axis aligned bounding box
+    struct AABB{
+        glm::vec3 bmin = glm::vec3(FLT_MAX);
+        glm::vec3 bmax = glm::vec3(-FLT_MAX);
+
+        void grow(const glm::vec3 &p){
+            bmin = glm::min(bmin, p);
+            bmax = glm::max(bmax, p);
+        }
+
+        void grow(const AABB &b){
+            bmin = glm::min(bmin, b.bmin);
+            bmax = glm::max(bmax, b.bmax);
+        }
+
+        // half of the surface area, the constant factor does not matter for the SAH
+        float halfArea() const {
+            glm::vec3 e = bmax - bmin;
+            if (e.x < 0) return 0; // empty box
+            return e.x * e.y + e.y * e.z + e.z * e.x;
+        }
+    };
+
+    // slab test, returns the distance to the entry point of the box or FLT_MAX if the box is missed
+    // or if it is farther than t_max. inv_dir is 1 / ray.direction, computed once per ray
+    inline float rayAABBIntersection(const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                                     const glm::vec3 &bmin, const glm::vec3 &bmax, float t_max){
+        glm::vec3 t1 = (bmin - origin) * inv_dir;
+        glm::vec3 t2 = (bmax - origin) * inv_dir;
+        glm::vec3 t_near = glm::min(t1, t2);
+        glm::vec3 t_far = glm::max(t1, t2);
+        float t_enter = glm::max(glm::max(t_near.x, t_near.y), t_near.z);
+        float t_exit = glm::min(glm::min(t_far.x, t_far.y), t_far.z);
+        // <= so that hits at exactly the current closest distance are still visited (keeps ties deterministic)
+        if (t_exit >= t_enter && t_exit >= 0 && t_enter <= t_max) return t_enter;
+        return FLT_MAX;
+    }
+
+    // 32 bytes, two nodes per cache line
+    struct BVHNode{
+        glm::vec3 bmin;
+        // leaf: index of the first triangle in BVH::tri_IDs, inner node: index of the left child (right is left + 1)
+        uint32_t left_first;
+        glm::vec3 bmax;
+        // number of triangles, 0 for inner nodes
+        uint32_t count;
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    // Top down binned SAH construction over primitives given by their bounding boxes. order receives the
+    // primitive indices sorted so that each leaf references the contiguous range [left_first, left_first + count)
+    class SAHBuilder{
+    public:
+        // number of bins used to evaluate SAH split candidates along each axis
+        static const int sah_bins = 16;
+
+        SAHBuilder(const std::vector<AABB> &bounds, unsigned int max_leaf_size, int max_depth):
+                m_bounds(bounds), m_max_leaf_size(max_leaf_size), m_max_depth(max_depth){}
+
+        void build(std::vector<BVHNode> &nodes, std::vector<uint32_t> &order){
+            uint32_t count = m_bounds.size();
+            nodes.clear();
+            order.resize(count);
+            if (count == 0) return;
+
+            // centroids are computed once and reused during the top down construction
+            m_centroids.resize(count);
+            for (uint32_t i = 0; i < count; i++){
+                order[i] = i;
+                m_centroids[i] = (m_bounds[i].bmin + m_bounds[i].bmax) * .5f;
+            }
+
+            m_nodes = &nodes;
+            m_order = &order;
+            // a binary tree with N leaves has at most 2N - 1 nodes
+            nodes.reserve(count * 2);
+            nodes.push_back(BVHNode{});
+            nodes[0].left_first = 0;
+            nodes[0].count = count;
+            updateBounds(0);
+            subdivide(0);
+        }
+
+    private:
+        const std::vector<AABB> &m_bounds;
+        unsigned int m_max_leaf_size;
+        int m_max_depth;
+        std::vector<glm::vec3> m_centroids;
+        std::vector<BVHNode> *m_nodes = nullptr;
+        std::vector<uint32_t> *m_order = nullptr;
+
+        void updateBounds(uint32_t node_ID){
+            BVHNode &node = (*m_nodes)[node_ID];
+            AABB b;
+            for (uint32_t i = node.left_first; i < node.left_first + node.count; i++)
+                b.grow(m_bounds[(*m_order)[i]]);
+            node.bmin = b.bmin;
+            node.bmax = b.bmax;
+        }
+
+        // binned SAH, returns the cost of the best split and the corresponding axis/position
+        float findBestSplit(const BVHNode &node, int &best_axis, float &best_pos) const {
+            AABB centroid_bounds;
+            for (uint32_t i = node.left_first; i < node.left_first + node.count; i++)
+                centroid_bounds.grow(m_centroids[(*m_order)[i]]);
+
+            float best_cost = FLT_MAX;
+            for (int axis = 0; axis < 3; axis++){
+                float lo = centroid_bounds.bmin[axis], hi = centroid_bounds.bmax[axis];
+                if (lo == hi) continue; // all centroids are on the same plane, can't split along this axis
+
+                AABB bin_bounds[sah_bins];
+                unsigned int bin_count[sah_bins] = {0};
+                float scale = sah_bins / (hi - lo);
+                for (uint32_t i = node.left_first; i < node.left_first + node.count; i++){
+                    uint32_t tri = (*m_order)[i];
+                    int bin = glm::min(sah_bins - 1, (int)((m_centroids[tri][axis] - lo) * scale));
+                    bin_count[bin]++;
+                    bin_bounds[bin].grow(m_bounds[tri]);
+                }
+
+                // sweep from both sides to get the area and count at each of the sah_bins - 1 split planes
+                float left_area[sah_bins - 1], right_area[sah_bins - 1];
+                unsigned int left_count[sah_bins - 1], right_count[sah_bins - 1];
+                AABB left_box, right_box;
+                unsigned int left_sum = 0, right_sum = 0;
+                for (int i = 0; i < sah_bins - 1; i++){
+                    left_sum += bin_count[i];
+                    left_count[i] = left_sum;
+                    left_box.grow(bin_bounds[i]);
+                    left_area[i] = left_box.halfArea();
+                    right_sum += bin_count[sah_bins - 1 - i];
+                    right_count[sah_bins - 2 - i] = right_sum;
+                    right_box.grow(bin_bounds[sah_bins - 1 - i]);
+                    right_area[sah_bins - 2 - i] = right_box.halfArea();
+                }
+
+                float bin_width = (hi - lo) / sah_bins;
+                for (int i = 0; i < sah_bins - 1; i++){
+                    float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+                    if (left_count[i] > 0 && right_count[i] > 0 && cost < best_cost){
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_pos = lo + bin_width * (i + 1);
+                    }
+                }
+            }
+            return best_cost;
+        }
+
+        void subdivide(uint32_t node_ID, int depth = 0){
+            std::vector<BVHNode> &nodes = *m_nodes;
+            std::vector<uint32_t> &order = *m_order;
+            // copy, the reference would be invalidated when children are pushed
+            BVHNode node = nodes[node_ID];
+            // the depth limit ensures that the traversal stack can't overflow
+            if (node.count <= 2 || depth >= m_max_depth) return;
+
+            int axis = 0;
+            float split_pos = 0;
+            float split_cost = findBestSplit(node, axis, split_pos);
+            // the cost of intersecting all primitives in this node, in the same unit as split_cost
+            glm::vec3 e = node.bmax - node.bmin;
+            float leaf_cost = node.count * (e.x * e.y + e.y * e.z + e.z * e.x);
+            if (split_cost >= leaf_cost && node.count <= m_max_leaf_size) return;
+            if (split_cost == FLT_MAX) return; // no valid split (e.g. all centroids are the same point)
+
+            // in place partition of the primitive indices
+            int64_t i = node.left_first;
+            int64_t j = i + node.count - 1;
+            while (i <= j){
+                if (m_centroids[order[i]][axis] < split_pos) i++;
+                else std::swap(order[i], order[j--]);
+            }
+            uint32_t left_count = (uint32_t) i - node.left_first;
+            if (left_count == 0 || left_count == node.count) return;
+
+            uint32_t left_ID = nodes.size();
+            nodes.push_back(BVHNode{});
+            nodes.push_back(BVHNode{});
+            nodes[left_ID].left_first = node.left_first;
+            nodes[left_ID].count = left_count;
+            nodes[left_ID + 1].left_first = (uint32_t) i;
+            nodes[left_ID + 1].count = node.count - left_count;
+            nodes[node_ID].left_first = left_ID;
+            nodes[node_ID].count = 0;
+
+            updateBounds(left_ID);
+            updateBounds(left_ID + 1);
+            subdivide(left_ID, depth + 1);
+            subdivide(left_ID + 1, depth + 1);
+        }
+    };
+
+    // recomputes the bounds of all nodes bottom up after the primitives moved, the topology stays the same.
+    // children are always stored after their parent, so a reverse sweep visits the children first.
+    // leafBounds(node) returns the bounds of the primitives of a leaf. nodes is a std::vector or a Storage
+    template <typename Nodes, typename LeafBounds>
+    void refitNodes(Nodes &nodes, const LeafBounds &leafBounds){
+        for (size_t n = nodes.size(); n-- > 0;){
+            BVHNode &node = nodes[n];
+            AABB b;
+            if (node.isLeaf())
+                b = leafBounds(node);
+            else {
+                const BVHNode &left = nodes[node.left_first], &right = nodes[node.left_first + 1];
+                b.grow(AABB{left.bmin, left.bmax});
+                b.grow(AABB{right.bmin, right.bmax});
+            }
+            node.bmin = b.bmin;
+            node.bmax = b.bmax;
+        }
+    }
+
+    // binary BVH over a triangle soup (3 consecutive vertices per triangle), built with the surface area heuristic
+    class BVH{
+    public:
+        // the max number of triangles that a leaf can hold, leaves are usually smaller since the SAH decides
+        unsigned int max_leaf_size = 8;
+        // max depth of the tree, also the size of the traversal stack
+        static const int max_depth = 64;
+
+        Storage<BVHNode> nodes;
+        // index of the first vertex of each triangle, ordered so that each leaf references a contiguous range
+        Storage<uint32_t> tri_IDs;
+        // triangle positions and edges in the same order as tri_IDs, this is all that the traversal reads
+        TriangleStore triangles;
+
+        void build(const std::vector<vertex> &vts){
+            unsigned int tri_count = vts.size() / 3;
+            m_source = &vts;
+            m_source_size = vts.size();
+
+            std::vector<AABB> tri_bounds(tri_count);
+            for (unsigned int i = 0; i < tri_count; i++)
+                tri_bounds[i] = triangleBounds(vts, i * 3);
+
+            std::vector<BVHNode> built_nodes;
+            std::vector<uint32_t> order;
+            SAHBuilder(tri_bounds, max_leaf_size, max_depth).build(built_nodes, order);
+            for (unsigned int i = 0; i < tri_count; i++)
+                order[i] *= 3;
+            nodes.assign(std::move(built_nodes));
+            tri_IDs.assign(std::move(order));
+
+            triangles.build(vts, tri_IDs);
+        }
+
+        // marks the hierarchy as built for vts when nodes, tri_IDs and triangles were set by other means than
+        // build(), e.g. loaded from a file by loadBVH
+        void attach(const std::vector<vertex> &vts){
+            m_source = &vts;
+            m_source_size = vts.size();
+        }
+
+        // updates the bounds after the vertices were moved, much faster than build but the quality of the tree
+        // degrades if the triangles move far from where they were when it was built. vts must have the same
+        // number of vertices as the buffer the hierarchy was built from
+        void refit(const std::vector<vertex> &vts){
+            assert(vts.size() == m_source_size);
+            m_source = &vts;
+            refitNodes(nodes, [&](const BVHNode &leaf){
+                AABB b;
+                for (uint32_t i = leaf.left_first; i < leaf.left_first + leaf.count; i++)
+                    b.grow(triangleBounds(vts, tri_IDs[i]));
+                return b;
+            });
+            triangles.build(vts, tri_IDs);
+        }
+
+        // true if the hierarchy was built from this vertex buffer (it does not detect in place modifications)
+        bool builtFor(const std::vector<vertex> &vts) const {
+            return m_source == &vts && m_source_size == vts.size();
+        }
+
+        // stack based closest hit traversal, children are visited front to back so that far subtrees are culled
+        // by the closest hit found so far. hit.hit_ID is the index of the first vertex of the triangle
+        bool closestHit(const Ray &ray, Hit &hit) const {
+            if (nodes.empty()) return false;
+
+            glm::vec3 inv_dir = 1.0f / ray.direction;
+            if (rayAABBIntersection(ray.origin, inv_dir, nodes[0].bmin, nodes[0].bmax, hit.dist) == FLT_MAX)
+                return hit.hit_ID >= 0;
+
+            const BVHNode *stack[max_depth];
+            int stack_ptr = 0;
+            const BVHNode *node = &nodes[0];
+            while (true){
+                RT_COUNT(node_visits, 1);
+                if (node->isLeaf()){
+                    RT_COUNT(triangle_tests, node->count);
+                    for (uint32_t i = node->left_first, end = node->left_first + node->count; i < end; i++){
+                        int vertex_ID = (int) tri_IDs[i];
+                        float dist_temp;
+                        glm::vec3 barycentric_temp;
+                        // ties are resolved in favour of the lowest ID, so the result matches the linear search
+                        if (triangles.intersect(ray, i, dist_temp, barycentric_temp) &&
+                            (dist_temp < hit.dist || (dist_temp == hit.dist && vertex_ID < hit.hit_ID))){
+                            hit.hit_ID = vertex_ID;
+                            hit.dist = dist_temp;
+                            hit.barycentric = barycentric_temp;
+                        }
+                    }
+                    if (stack_ptr == 0) break;
+                    node = stack[--stack_ptr];
+                    continue;
+                }
+
+                const BVHNode *child1 = &nodes[node->left_first];
+                const BVHNode *child2 = &nodes[node->left_first + 1];
+                float dist1 = rayAABBIntersection(ray.origin, inv_dir, child1->bmin, child1->bmax, hit.dist);
+                float dist2 = rayAABBIntersection(ray.origin, inv_dir, child2->bmin, child2->bmax, hit.dist);
+                if (dist1 > dist2) { std::swap(dist1, dist2); std::swap(child1, child2); }
+
+                if (dist1 == FLT_MAX){
+                    // missed both children
+                    if (stack_ptr == 0) break;
+                    node = stack[--stack_ptr];
+                }
+                else {
+                    node = child1;
+                    if (dist2 != FLT_MAX) stack[stack_ptr++] = child2;
+                }
+            }
+            return hit.hit_ID >= 0;
+        }
+
+        // any hit query, true if the ray hits any triangle closer than t_max. The traversal stops at the first
+        // hit that it finds, so nodes are not sorted, and no barycentric coordinates are computed
+        bool occluded(const Ray &ray, float t_max) const {
+            if (nodes.empty()) return false;
+
+            glm::vec3 inv_dir = 1.0f / ray.direction;
+            const BVHNode *stack[max_depth];
+            int stack_ptr = 0;
+            const BVHNode *node = &nodes[0];
+            if (rayAABBIntersection(ray.origin, inv_dir, node->bmin, node->bmax, t_max) == FLT_MAX)
+                return false;
+            while (true){
+                RT_COUNT(node_visits, 1);
+                if (node->isLeaf()){
+                    for (uint32_t i = node->left_first, end = node->left_first + node->count; i < end; i++){
+                        RT_COUNT(triangle_tests, 1);
+                        if (triangles.occludes(ray, i, t_max))
+                            return true;
+                    }
+                    if (stack_ptr == 0) return false;
+                    node = stack[--stack_ptr];
+                    continue;
+                }
+
+                const BVHNode *child1 = &nodes[node->left_first];
+                const BVHNode *child2 = &nodes[node->left_first + 1];
+                bool hit1 = rayAABBIntersection(ray.origin, inv_dir, child1->bmin, child1->bmax, t_max) != FLT_MAX;
+                bool hit2 = rayAABBIntersection(ray.origin, inv_dir, child2->bmin, child2->bmax, t_max) != FLT_MAX;
+                if (hit1 && hit2){
+                    node = child1;
+                    stack[stack_ptr++] = child2;
+                }
+                else if (hit1 || hit2){
+                    node = hit1 ? child1 : child2;
+                }
+                else {
+                    if (stack_ptr == 0) return false;
+                    node = stack[--stack_ptr];
+                }
+            }
+        }
+
+    private:
+        const std::vector<vertex> *m_source = nullptr;
+        size_t m_source_size = 0;
+
+        static AABB triangleBounds(const std::vector<vertex> &vts, uint32_t first_vertex){
+            AABB b;
+            b.grow(glm::vec3(vts[first_vertex].pos));
+            b.grow(glm::vec3(vts[first_vertex + 1].pos));
+            b.grow(glm::vec3(vts[first_vertex + 2].pos));
+            return b;
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_BVH_H
@@ -0,0 +1,269 @@
+//
+// BVH files: a built BVH is stored on disk and mapped back in memory, so that large meshes don't have to be
+// rebuilt every time the program starts
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_BVH_CACHE_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_BVH_CACHE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include "rt_types.h"
+#include "rt_bvh.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace rt{
+
+    // File layout, in the byte order of the machine that wrote it. The file holds no pointers, only indices and
+    // offsets from its start, so the sections can be used in place once the file is mapped:
+    //   BVHFileHeader | nodes (BVHNode x node_count) | tri_IDs (uint32_t x tri_count) | triangles (TriangleStore)
+    // every section starts at a multiple of bvh_file_alignment bytes
+    struct BVHFileHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t node_size;       // sizeof(BVHNode), files written with a different node layout are rejected
+        uint64_t key;             // bvhFileKey of the vertices and build parameters the BVH was built with
+        uint64_t file_size;
+        uint64_t node_count;
+        uint64_t tri_count;
+        uint64_t nodes_offset;
+        uint64_t tri_IDs_offset;
+        uint64_t triangles_offset;
+        uint64_t triangles_size;  // floats in the triangles section
+    };
+
+    const char bvh_file_magic[8] = {'R', 'T', 'B', 'V', 'H', 0, 0, 0};
+    // increase when the layout of the file or the BVH construction changes, older files are then rebuilt
+    const uint32_t bvh_file_version = 1;
+    const uint64_t bvh_file_alignment = 64;
+
+    // Hash of what the BVH depends on: vertex positions, build parameters and file version. A file whose key
+    // does not match the vertices is stale. The positions are hashed 32 bits at a time (FNV-1a on words), which
+    // is much faster than a build
+    inline uint64_t bvhFileKey(const std::vector<vertex> &vts, const BVH &bvh){
+        uint64_t h = 14695981039346656037ull;
+        auto add = [&](uint32_t word){ h = (h ^ word) * 1099511628211ull; };
+        add(bvh_file_version);
+        add(bvh.max_leaf_size);
+        add(BVH::max_depth);
+        add(SAHBuilder::sah_bins);
+        add(uint32_t(vts.size()));
+        add(uint32_t(uint64_t(vts.size()) >> 32));
+        for (const vertex &v : vts)
+            for (int axis = 0; axis < 3; axis++){
+                uint32_t bits;
+                std::memcpy(&bits, &v.pos[axis], sizeof(bits));
+                add(bits);
+            }
+        return h;
+    }
+
+    // A file, or a part of a file, mapped in memory, copy-on-write: the memory can be modified (e.g. by BVH::refit)
+    // without changing the file. The mapping is released when the last Storage that refers to it is destroyed
+    class MappedFile{
+    public:
+        // offsets of partial mappings must be multiples of this (the allocation granularity of Windows, which is
+        // a multiple of the page size everywhere)
+        static const uint64_t offset_alignment = 65536;
+
+        // maps size bytes from offset, or the whole file if size is 0. nullptr if the file can't be opened or
+        // mapped, or if the range is not inside the file
+        static std::shared_ptr<MappedFile> open(const std::string &path, uint64_t offset = 0, uint64_t size = 0){
+            if (offset % offset_alignment != 0) return nullptr;
+            std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+            HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                        FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (handle == INVALID_HANDLE_VALUE) return nullptr;
+            LARGE_INTEGER file_size;
+            if (!GetFileSizeEx(handle, &file_size) || !rangeOK(uint64_t(file_size.QuadPart), offset, size)) {
+                CloseHandle(handle);
+                return nullptr;
+            }
+            HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+            CloseHandle(handle);
+            if (!mapping) return nullptr;
+            file->m_data = MapViewOfFile(mapping, FILE_MAP_COPY, DWORD(offset >> 32), DWORD(offset), SIZE_T(size));
+            CloseHandle(mapping);
+            if (!file->m_data) return nullptr;
+            file->m_size = size_t(size);
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return nullptr;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || !rangeOK(uint64_t(st.st_size), offset, size)) { close(fd); return nullptr; }
+            void *data = mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, off_t(offset));
+            close(fd);
+            if (data == MAP_FAILED) return nullptr;
+            file->m_data = data;
+            file->m_size = size_t(size);
+#endif
+            return file;
+        }
+
+        ~MappedFile(){
+            if (!m_data) return;
+#ifdef _WIN32
+            UnmapViewOfFile(m_data);
+#else
+            munmap(m_data, m_size);
+#endif
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        // page aligned
+        char *data() { return static_cast<char*>(m_data); }
+        size_t size() const { return m_size; }
+
+    private:
+        MappedFile() = default;
+        void *m_data = nullptr;
+        size_t m_size = 0;
+
+        // replaces a size of 0 by the rest of the file
+        static bool rangeOK(uint64_t file_size, uint64_t offset, uint64_t &size){
+            if (offset >= file_size) return false;
+            if (size == 0) size = file_size - offset;
+            return size <= file_size - offset;
+        }
+    };
+
+    // true if nodes read from a file form a tree whose leaves reference ranges inside [0, leaf_limit). Children are
+    // stored after their parent, so a forward sweep knows the depth of each node. The checks guarantee that the
+    // traversal stays in the arrays and that its stack can't overflow
+    inline bool validNodes(const BVHNode *nodes, uint64_t node_count, uint64_t leaf_limit){
+        if ((node_count == 0) != (leaf_limit == 0)) return false;
+        std::vector<uint8_t> depth(node_count, 0);
+        for (uint64_t n = 0; n < node_count; n++){
+            const BVHNode &node = nodes[n];
+            if (node.isLeaf()){
+                if (uint64_t(node.left_first) + node.count > leaf_limit) return false;
+            }
+            else {
+                if (node.left_first <= n || uint64_t(node.left_first) + 1 >= node_count) return false;
+                if (depth[n] + 1 >= BVH::max_depth) return false;
+                depth[node.left_first] = depth[node.left_first + 1] = depth[n] + 1;
+            }
+        }
+        return true;
+    }
+
+    // Uses the BVH stored in the file at path for vts, without building it. The sections of the file are used
+    // in place, nothing is parsed or copied. Returns false, and leaves bvh unchanged, if the file does not exist,
+    // was written for other vertices or build parameters (stale), or is truncated or inconsistent
+    inline bool loadBVH(const std::string &path, const std::vector<vertex> &vts, BVH &bvh){
+        std::shared_ptr<MappedFile> file = MappedFile::open(path);
+        if (!file || file->size() < sizeof(BVHFileHeader)) return false;
+
+        BVHFileHeader header;
+        std::memcpy(&header, file->data(), sizeof(header));
+        uint64_t tri_count = vts.size() / 3;
+        uint64_t padded_count = (tri_count + 7) / 8 * 8;
+        if (std::memcmp(header.magic, bvh_file_magic, sizeof(bvh_file_magic)) != 0 ||
+            header.version != bvh_file_version || header.node_size != sizeof(BVHNode) ||
+            header.file_size != file->size() || header.tri_count != tri_count ||
+            header.triangles_size != 9 * padded_count)
+            return false;
+
+        // every section must be aligned and inside the file
+        auto sectionOK = [&](uint64_t offset, uint64_t bytes){
+            return offset % bvh_file_alignment == 0 && offset >= sizeof(header) &&
+                   offset <= header.file_size && bytes <= header.file_size - offset;
+        };
+        if (!sectionOK(header.nodes_offset, header.node_count * sizeof(BVHNode)) ||
+            !sectionOK(header.tri_IDs_offset, tri_count * sizeof(uint32_t)) ||
+            !sectionOK(header.triangles_offset, header.triangles_size * sizeof(float)))
+            return false;
+
+        // the key is checked last, it is the only test that reads the whole vertex buffer
+        if (header.key != bvhFileKey(vts, bvh))
+            return false;
+
+        BVHNode *nodes = reinterpret_cast<BVHNode*>(file->data() + header.nodes_offset);
+        uint32_t *tri_IDs = reinterpret_cast<uint32_t*>(file->data() + header.tri_IDs_offset);
+        if (!validNodes(nodes, header.node_count, tri_count)) return false;
+        for (uint64_t i = 0; i < tri_count; i++)
+            if (tri_IDs[i] % 3 != 0 || tri_IDs[i] + 2 >= vts.size()) return false;
+
+        bvh.nodes.view(nodes, header.node_count, file);
+        bvh.tri_IDs.view(tri_IDs, tri_count, file);
+        bvh.triangles.view(reinterpret_cast<float*>(file->data() + header.triangles_offset), tri_count, file);
+        bvh.attach(vts);
+        return true;
+    }
+
+    // Writes the BVH built for vts to path. The file is written next to it first and then renamed, so a program
+    // that has the old file mapped, or that reads it at the same time, never sees a partially written file
+    inline bool saveBVH(const std::string &path, const std::vector<vertex> &vts, const BVH &bvh){
+        auto align = [](uint64_t offset){ return (offset + bvh_file_alignment - 1) / bvh_file_alignment * bvh_file_alignment; };
+
+        BVHFileHeader header = {};
+        std::memcpy(header.magic, bvh_file_magic, sizeof(bvh_file_magic));
+        header.version = bvh_file_version;
+        header.node_size = sizeof(BVHNode);
+        header.key = bvhFileKey(vts, bvh);
+        header.node_count = bvh.nodes.size();
+        header.tri_count = bvh.tri_IDs.size();
+        header.triangles_size = bvh.triangles.dataSize();
+        header.nodes_offset = align(sizeof(header));
+        header.tri_IDs_offset = align(header.nodes_offset + header.node_count * sizeof(BVHNode));
+        header.triangles_offset = align(header.tri_IDs_offset + header.tri_count * sizeof(uint32_t));
+        header.file_size = header.triangles_offset + header.triangles_size * sizeof(float);
+
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream file(temp_path, std::ios::binary);
+            if (!file) return false;
+            auto section = [&](uint64_t offset, const void *data, uint64_t bytes){
+                static const char zeros[bvh_file_alignment] = {};
+                file.write(zeros, std::streamsize(offset - uint64_t(file.tellp())));
+                file.write(static_cast<const char*>(data), std::streamsize(bytes));
+            };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            section(header.nodes_offset, bvh.nodes.data(), header.node_count * sizeof(BVHNode));
+            section(header.tri_IDs_offset, bvh.tri_IDs.data(), header.tri_count * sizeof(uint32_t));
+            section(header.triangles_offset, bvh.triangles.data(), header.triangles_size * sizeof(float));
+            if (!file) { file.close(); std::remove(temp_path.c_str()); return false; }
+        }
+        // rename does not replace an existing file on every platform
+        std::remove(path.c_str());
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0){
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // loads the BVH of vts from path, or builds it and writes it to path if the file is missing or stale.
+    // Returns true if it was loaded. A file that can't be written only costs the build on the next start
+    inline bool loadOrBuildBVH(const std::string &path, const std::vector<vertex> &vts, BVH &bvh){
+        if (loadBVH(path, vts, bvh))
+            return true;
+        bvh.build(vts);
+        saveBVH(path, vts, bvh);
+        return false;
+    }
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_BVH_CACHE_H
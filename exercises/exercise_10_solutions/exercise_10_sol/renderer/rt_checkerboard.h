@@ -0,0 +1,283 @@
+//
+// Checkerboard rendering: traces a part of the pixels every frame and reprojects the others from the previous frame
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_CHECKERBOARD_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_CHECKERBOARD_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <glm/glm.hpp>
+#include "rt_renderer.h"
+
+namespace rt{
+
+    // Traces 1 / interval of the pixels every frame, in a pattern that rotates so that every pixel is traced once
+    // every interval frames: a checkerboard for interval 2, one pixel of each 2x2 block for interval 4.
+    // Every pixel keeps its color and the distance to its primary hit. The pixels that are not traced are filled by
+    // reprojection: the hit of every pixel of the previous frame is moved to world space with the previous view,
+    // projected with the new view, and the nearest one that lands on a pixel wins. A reprojected hit is kept if
+    // its distance matches one of the traced neighbours of the pixel, the pixel then takes the bilinear
+    // interpolation of the previous frame at that point (clamped to the colors of the neighbours). Otherwise (e.g.
+    // the pixel was hidden in the previous frame) it interpolates the traced neighbours of the surface most of
+    // them are on.
+    // Shading that depends on the view (highlights, reflections) lags behind by up to interval frames. When the
+    // camera does not move the reprojection is exact and every pixel that is not traced copies its previous value
+    // without the checks above, so after interval still frames the image is the same as a fully traced one.
+    class CheckerboardRenderer{
+    public:
+        // 2 (checkerboard) or 4 (2x2 blocks), 1 traces every pixel
+        unsigned int interval = 2;
+        // relative difference of hit distance above which two pixels belong to different surfaces
+        float depth_tolerance = 0.05f;
+
+        // renders fb, returns the number of pixels that were traced
+        size_t render(Renderer &renderer,
+                      const std::vector<vertex> &vts,
+                      const glm::mat4 &m,
+                      const glm::mat4 &v,
+                      const float fov_degrees,
+                      unsigned int depth,
+                      FrameBuffer <uint32_t> &fb){
+            unsigned int W = fb.W, H = fb.H;
+            size_t pixel_count = size_t(W) * H;
+            // the previous frame can only be reused for the same scene and projection
+            ImageKey key{m, fov_degrees, depth, W, H, &vts, vts.size()};
+            bool reuse = key == m_key && interval == m_interval && m_color[0];
+            if (!reuse){
+                m_key = key;
+                m_interval = interval;
+                for (int i = 0; i < 2; i++){
+                    m_color[i].reset(new FrameBuffer<uint32_t>(W, H));
+                    m_dist[i].reset(new FrameBuffer<float>(W, H));
+                }
+                m_reprojected.reset(new std::atomic<uint64_t>[pixel_count]);
+                m_frame = 0;
+            }
+            FrameBuffer<uint32_t> &color = *m_color[0];
+            FrameBuffer<float> &dist = *m_dist[0];
+
+            // pixels traced in this frame, all of them if there is no previous frame
+            m_pixels.clear();
+            for (unsigned int y = 0; y < H; y++)
+                for (unsigned int x = 0; x < W; x++)
+                    if (!reuse || traced(x, y))
+                        m_pixels.push_back(x + y * W);
+
+            Views views{PrimaryRays(m, m_previous_view, fov_degrees, W, H), PrimaryRays(m, v, fov_degrees, W, H),
+                        m_previous_view * m, v * m, v == m_previous_view};
+            if (reuse)
+                reproject(renderer, views, W, H);
+            renderer.renderPixels(vts, m, v, fov_degrees, depth, m_pixels, color, &dist);
+            if (reuse)
+                resolve(renderer, views, W, H);
+
+            std::memcpy(fb.buffer, color.buffer, pixel_count * sizeof(uint32_t));
+            // this frame is the previous one of the next frame
+            std::swap(m_color[0], m_color[1]);
+            std::swap(m_dist[0], m_dist[1]);
+            m_previous_view = v;
+            m_frame++;
+            return m_pixels.size();
+        }
+
+    private:
+        // what the previous frame depends on, the view is not part of it since reprojection accounts for it
+        ImageKey m_key;
+        unsigned int m_interval = 0;
+
+        // colors and hit distances of the frame being rendered ([0]) and of the previous frame ([1])
+        std::unique_ptr<FrameBuffer<uint32_t>> m_color[2];
+        std::unique_ptr<FrameBuffer<float>> m_dist[2];
+        glm::mat4 m_previous_view = glm::mat4(1);
+        unsigned int m_frame = 0;
+        std::vector<uint32_t> m_pixels;
+        // nearest previous pixel that lands on each pixel, as (distance bits << 32) | previous pixel, so that the
+        // smallest value is the nearest hit. Floats >= 0 compare like their bits
+        std::unique_ptr<std::atomic<uint64_t>[]> m_reprojected;
+        static const uint64_t no_reprojection = ~uint64_t(0);
+
+        // primary rays and model to view transforms of the previous and the current frame
+        struct Views{
+            PrimaryRays previous, current;
+            glm::mat4 previous_model_to_view, model_to_view;
+            bool still;
+        };
+
+        // true if pixel (x, y) is traced in the current frame
+        bool traced(unsigned int x, unsigned int y) const {
+            if (interval == 2) return ((x + y + m_frame) & 1) == 0;
+            if (interval == 4){
+                // the diagonal of the block first, so that two consecutive frames cover it evenly
+                static const unsigned int order[4] = {0, 3, 1, 2};
+                return ((x & 1) | ((y & 1) << 1)) == order[m_frame & 3];
+            }
+            return true;
+        }
+
+        // pixel of the image plane of primary that point (in model space) projects to, false if it is behind the camera
+        static bool project(const PrimaryRays &primary, const glm::mat4 &model_to_view, glm::vec3 point, glm::vec2 &pixel){
+            glm::vec4 p = model_to_view * glm::vec4(point, 1.0f);
+            if (p.z >= 0.0f) return false;
+            glm::vec2 on_plane = glm::vec2(p) / -p.z;
+            pixel = (on_plane - glm::vec2(primary.lower_left_corner)) / primary.pixel_size;
+            return true;
+        }
+
+        // scatters the hits of the previous frame to the pixels that are not traced in this frame
+        void reproject(Renderer &renderer, const Views &views, unsigned int W, unsigned int H){
+            for (size_t i = 0, n = size_t(W) * H; i < n; i++)
+                m_reprojected[i].store(no_reprojection, std::memory_order_relaxed);
+
+            const PrimaryRays &previous = views.previous, &current = views.current;
+            const FrameBuffer<float> &previous_dist = *m_dist[1];
+            renderer.parallelTiles(W, H, [&](const Tile &tile){
+                for (unsigned int y = tile.y0; y < tile.y1; y++)
+                    for (unsigned int x = tile.x0; x < tile.x1; x++){
+                        float d = previous_dist.buffer[x + y * W];
+                        if (d == FLT_MAX) continue;
+                        Ray ray = previous.at(x, y);
+                        glm::vec3 hit = ray.origin + ray.direction * d;
+                        glm::vec2 pixel;
+                        if (!project(current, views.model_to_view, hit, pixel)) continue;
+                        // pixel centers are at integer coordinates, like the rays of PrimaryRays::at
+                        int px = int(std::floor(pixel.x + .5f)), py = int(std::floor(pixel.y + .5f));
+                        if (px < 0 || py < 0 || px >= int(W) || py >= int(H) || traced(px, py)) continue;
+
+                        float new_dist = glm::length(hit - glm::vec3(current.cam_pos));
+                        uint32_t bits;
+                        std::memcpy(&bits, &new_dist, sizeof(bits));
+                        uint64_t value = (uint64_t(bits) << 32) | uint32_t(x + y * W);
+                        std::atomic<uint64_t> &target = m_reprojected[px + py * W];
+                        uint64_t old = target.load(std::memory_order_relaxed);
+                        while (value < old && !target.compare_exchange_weak(old, value, std::memory_order_relaxed));
+                    }
+            });
+        }
+
+        // fills the pixels that were not traced, see the class comment
+        void resolve(Renderer &renderer, const Views &views, unsigned int W, unsigned int H){
+            FrameBuffer<uint32_t> &color = *m_color[0];
+            FrameBuffer<float> &dist = *m_dist[0];
+
+            renderer.parallelTiles(W, H, [&](const Tile &tile){
+                for (unsigned int y = tile.y0; y < tile.y1; y++)
+                    for (unsigned int x = tile.x0; x < tile.x1; x++){
+                        if (traced(x, y)) continue;
+                        uint32_t pixel = x + y * W;
+
+                        // the traced pixels around this one
+                        uint32_t neighbours[8];
+                        unsigned int count = 0;
+                        for (int dy = -1; dy <= 1; dy++)
+                            for (int dx = -1; dx <= 1; dx++){
+                                int nx = int(x) + dx, ny = int(y) + dy;
+                                if ((dx || dy) && nx >= 0 && ny >= 0 && nx < int(W) && ny < int(H) && traced(nx, ny))
+                                    neighbours[count++] = nx + ny * W;
+                            }
+
+                        uint64_t reprojected = m_reprojected[pixel].load(std::memory_order_relaxed);
+                        if (views.still){
+                            // without motion the reprojection is exact, the previous pixel is copied as it is, even
+                            // if no traced neighbour confirms it (thin geometry, silhouettes). Pixels without a hit
+                            // are not reprojected, they keep their previous value
+                            uint32_t previous = reprojected != no_reprojection ? uint32_t(reprojected) : pixel;
+                            color.buffer[pixel] = m_color[1]->buffer[previous];
+                            dist.buffer[pixel] = m_dist[1]->buffer[previous];
+                            continue;
+                        }
+                        if (reprojected != no_reprojection){
+                            uint32_t bits = uint32_t(reprojected >> 32);
+                            float d;
+                            std::memcpy(&d, &bits, sizeof(d));
+                            // range of the colors of the neighbours on the same surface
+                            glm::vec4 low(FLT_MAX), high(-FLT_MAX);
+                            bool confirmed = count == 0;
+                            for (unsigned int i = 0; i < count; i++)
+                                if (sameSurface(d, dist.buffer[neighbours[i]])){
+                                    glm::vec4 neighbour = Colors::fromRGBA32(color.buffer[neighbours[i]]);
+                                    low = glm::min(low, neighbour);
+                                    high = glm::max(high, neighbour);
+                                    confirmed = true;
+                                }
+                            if (confirmed){
+                                // the previous frame is resampled where the point of this pixel was, the result
+                                // is clamped to the range of the neighbours (as temporal anti-aliasing does) to
+                                // hide the errors of the resampling on edges and highlights
+                                uint32_t reused = m_color[1]->buffer[uint32_t(reprojected)];
+                                glm::vec4 resampled = resample(views, x, y, d, Colors::fromRGBA32(reused), W, H);
+                                color.buffer[pixel] = Colors::toRGBA32(count > 0 ? glm::clamp(resampled, low, high) : resampled);
+                                dist.buffer[pixel] = d;
+                                continue;
+                            }
+                        }
+
+                        // nothing to reuse, the surface of most of the neighbours is interpolated
+                        unsigned int surface = 0, surface_count = 0;
+                        for (unsigned int i = 0; i < count; i++){
+                            unsigned int same = 0;
+                            for (unsigned int k = 0; k < count; k++)
+                                same += sameSurface(dist.buffer[neighbours[i]], dist.buffer[neighbours[k]]);
+                            if (same > surface_count){
+                                surface = i;
+                                surface_count = same;
+                            }
+                        }
+                        glm::vec4 sum(0);
+                        float dist_sum = 0;
+                        for (unsigned int i = 0; i < count; i++){
+                            float d = dist.buffer[neighbours[i]];
+                            if (!sameSurface(dist.buffer[neighbours[surface]], d)) continue;
+                            sum += Colors::fromRGBA32(color.buffer[neighbours[i]]);
+                            dist_sum += d == FLT_MAX ? 0.0f : d;
+                        }
+                        if (surface_count > 0){
+                            color.buffer[pixel] = Colors::toRGBA32(sum / float(surface_count));
+                            float reference = dist.buffer[neighbours[surface]];
+                            dist.buffer[pixel] = reference == FLT_MAX ? FLT_MAX : dist_sum / surface_count;
+                        }
+                        else {
+                            color.buffer[pixel] = Colors::toRGBA32(Colors::black);
+                            dist.buffer[pixel] = FLT_MAX;
+                        }
+                    }
+            });
+        }
+
+        // color of the previous frame at the point hit by the ray of pixel (x, y) at distance d, interpolated between
+        // the previous pixels around it that are on the same surface, fallback if there are none
+        glm::vec4 resample(const Views &views, unsigned int x, unsigned int y, float d, glm::vec4 fallback,
+                           unsigned int W, unsigned int H) const {
+            Ray ray = views.current.at(x, y);
+            glm::vec3 point = ray.origin + ray.direction * d;
+            glm::vec2 pixel;
+            if (!project(views.previous, views.previous_model_to_view, point, pixel)) return fallback;
+            float previous_d = glm::length(point - glm::vec3(views.previous.cam_pos));
+
+            glm::vec2 base = glm::floor(pixel), t = pixel - base;
+            glm::vec4 sum(0);
+            float weight_sum = 0;
+            for (int i = 0; i < 4; i++){
+                int px = int(base.x) + (i & 1), py = int(base.y) + (i >> 1);
+                if (px < 0 || py < 0 || px >= int(W) || py >= int(H)) continue;
+                if (!sameSurface(m_dist[1]->buffer[px + py * W], previous_d)) continue;
+                float weight = ((i & 1) ? t.x : 1 - t.x) * ((i >> 1) ? t.y : 1 - t.y);
+                sum += weight * Colors::fromRGBA32(m_color[1]->buffer[px + py * W]);
+                weight_sum += weight;
+            }
+            return weight_sum > 1e-4f ? sum / weight_sum : fallback;
+        }
+
+        // true if two pixels with these hit distances are on the same surface, misses are a surface of their own
+        bool sameSurface(float a, float b) const {
+            if (a == FLT_MAX || b == FLT_MAX) return a == b;
+            return std::abs(a - b) <= depth_tolerance * std::min(a, b);
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_CHECKERBOARD_H
@@ -0,0 +1,224 @@
+//
+// Edge avoiding a-trous wavelet filter for path traced frames with few samples per pixel
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_DENOISER_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_DENOISER_H
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "rt_renderer.h"
+#include "rt_gbuffer.h"
+#include "rt_packet.h"
+#ifdef RT_PACKET_SIMD
+#include <emmintrin.h>
+#endif
+
+namespace rt{
+
+    // Dammertz et al., "Edge-avoiding a-trous wavelet transform for fast global illumination filtering", 2010.
+    // Every iteration blurs with the 5x5 B3 spline kernel, with its taps 2^i pixels apart at iteration i, so five
+    // iterations cover 129 x 129 pixels with 25 taps per pixel each. A tap q of pixel p is weighted by
+    //   exp(-|c_p - c_q|^2 / sigma_color_i^2 - |n_p - n_q|^2 / sigma_normal^2 - ((z_p - z_q) / (sigma_depth z_p))^2)
+    // (color, normal, hit distance), so the filter stops at edges of the geometry and of the light. sigma_color_i
+    // halves every iteration, the coarse iterations only smooth what is already smooth. The color that is filtered
+    // is the radiance divided by the albedo of the GBuffer, and the result is multiplied by it again, so that the
+    // texture and the vertex colors stay sharp. The image is padded by repeating its borders. Rows are processed in
+    // tiles on the render threads, and with SSE four pixels of a row at a time.
+    class ATrousDenoiser{
+    public:
+        unsigned int iterations = 5;
+        float sigma_color = 1.0f;
+        float sigma_normal = .3f;
+        float sigma_depth = .05f;   // relative to the hit distance
+
+        // filters in and writes the result to out (same size), on the render threads of renderer
+        void denoise(Renderer &renderer, const GBuffer &in, FrameBuffer <uint32_t> &out){
+            m_W = in.W;
+            m_H = in.H;
+            m_border = iterations > 0 ? 2u << (iterations - 1) : 0;
+            m_stride = m_W + 2 * m_border;
+            size_t size = size_t(m_stride) * (m_H + 2 * m_border);
+            for (std::vector<float> *plane : {&m_color[0][0], &m_color[0][1], &m_color[0][2], &m_color[1][0],
+                                              &m_color[1][1], &m_color[1][2], &m_normal[0], &m_normal[1], &m_normal[2], &m_depth})
+                plane->assign(size, 0);
+
+            for (unsigned int y = 0; y < m_H; y++)
+                for (unsigned int x = 0; x < m_W; x++){
+                    size_t i = x + size_t(y) * m_W, p = index(x, y);
+                    glm::vec3 irradiance = in.color[i] / glm::max(in.albedo[i], glm::vec3(1e-3f));
+                    for (int c = 0; c < 3; c++){
+                        m_color[0][c][p] = irradiance[c];
+                        m_normal[c][p] = in.normal[i][c];
+                    }
+                    // misses are far away but finite, so that differences with them stay finite
+                    m_depth[p] = in.depth[i] < FLT_MAX ? in.depth[i] : 1e18f;
+                }
+            padBorders(m_normal[0]);
+            padBorders(m_normal[1]);
+            padBorders(m_normal[2]);
+            padBorders(m_depth);
+
+            int source = 0;
+            for (unsigned int iteration = 0; iteration < iterations; iteration++){
+                for (int c = 0; c < 3; c++)
+                    padBorders(m_color[source][c]);
+                Pass pass{this, m_color[source], m_color[1 - source], 1u << iteration,
+                          1.0f / sqr(sigma_color / float(1u << iteration)), 1.0f / sqr(sigma_normal), sigma_depth};
+                renderer.parallelTiles(m_W, m_H, [&](const Tile &tile){
+                    for (unsigned int y = tile.y0; y < tile.y1; y++)
+                        pass.filterRow(y, tile.x0, tile.x1);
+                });
+                source = 1 - source;
+            }
+
+            for (unsigned int y = 0; y < m_H; y++)
+                for (unsigned int x = 0; x < m_W; x++){
+                    size_t i = x + size_t(y) * m_W, p = index(x, y);
+                    glm::vec3 irradiance(m_color[source][0][p], m_color[source][1][p], m_color[source][2][p]);
+                    out.buffer[i] = Colors::toRGBA32(Colors::color(irradiance * glm::max(in.albedo[i], glm::vec3(1e-3f)), 1));
+                }
+        }
+
+    private:
+        unsigned int m_W = 0, m_H = 0, m_border = 0, m_stride = 0;
+        // padded planes: the colors of two iterations (ping pong), the normal and the depth
+        std::vector<float> m_color[2][3];
+        std::vector<float> m_normal[3];
+        std::vector<float> m_depth;
+
+        static float sqr(float x){ return x * x; }
+
+        size_t index(unsigned int x, unsigned int y) const {
+            return (x + m_border) + size_t(y + m_border) * m_stride;
+        }
+
+        // copies the pixels of the edges of the image to the border around it
+        void padBorders(std::vector<float> &plane) const {
+            for (unsigned int y = 0; y < m_H + 2 * m_border; y++){
+                unsigned int source_y = unsigned(glm::clamp(int(y) - int(m_border), 0, int(m_H) - 1));
+                float *row = &plane[size_t(y) * m_stride];
+                const float *source = &plane[index(0, source_y)];
+                if (source_y + m_border != y)
+                    std::copy(source, source + m_W, row + m_border);
+                std::fill(row, row + m_border, source[0]);
+                std::fill(row + m_border + m_W, row + m_stride, source[m_W - 1]);
+            }
+        }
+
+        // one iteration, reads the colors of source and writes them to target
+        struct Pass{
+            const ATrousDenoiser *denoiser;
+            const std::vector<float> (&source)[3];
+            std::vector<float> (&target)[3];
+            unsigned int step;
+            float inv_sigma_color2, inv_sigma_normal2, sigma_depth;
+
+            // B3 spline
+            static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+            void filterRow(unsigned int y, unsigned int x0, unsigned int x1) const {
+                unsigned int x = x0;
+#ifdef RT_PACKET_SIMD
+                for (; x + 4 <= x1; x += 4)
+                    filter4(denoiser->index(x, y));
+#endif
+                for (; x < x1; x++)
+                    filter1(denoiser->index(x, y));
+            }
+
+            void filter1(size_t p) const {
+                const ATrousDenoiser &d = *denoiser;
+                float c[3] = {source[0][p], source[1][p], source[2][p]};
+                float n[3] = {d.m_normal[0][p], d.m_normal[1][p], d.m_normal[2][p]};
+                float z = d.m_depth[p];
+                float inv_sigma_depth2 = 1.0f / sqr(sigma_depth * std::max(z, 1e-4f));
+                float sum[3] = {0, 0, 0}, weight_sum = 0;
+                for (int ky = 0; ky < 5; ky++)
+                    for (int kx = 0; kx < 5; kx++){
+                        size_t q = p + (ptrdiff_t(ky - 2) * d.m_stride + (kx - 2)) * ptrdiff_t(step);
+                        float color_dist = 0, normal_dist = 0;
+                        for (int i = 0; i < 3; i++){
+                            color_dist += sqr(c[i] - source[i][q]);
+                            normal_dist += sqr(n[i] - d.m_normal[i][q]);
+                        }
+                        float dist = color_dist * inv_sigma_color2 + normal_dist * inv_sigma_normal2 +
+                                     sqr(z - d.m_depth[q]) * inv_sigma_depth2;
+                        float weight = kernel[kx] * kernel[ky] * std::exp(-std::min(dist, 87.0f));
+                        for (int i = 0; i < 3; i++)
+                            sum[i] += weight * source[i][q];
+                        weight_sum += weight;
+                    }
+                for (int i = 0; i < 3; i++)
+                    target[i][p] = sum[i] / weight_sum;
+            }
+
+#ifdef RT_PACKET_SIMD
+            // exp(x) for x <= 0, 2^(x log2(e)) split in an integer power (exponent bits) and a polynomial for the
+            // fraction, relative error below 1e-6
+            static __m128 exp4(__m128 x){
+                x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+                __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+                // floor, cvtt rounds towards 0
+                __m128i i = _mm_cvttps_epi32(t);
+                __m128 fi = _mm_cvtepi32_ps(i);
+                __m128 below = _mm_cmplt_ps(t, fi);
+                fi = _mm_sub_ps(fi, _mm_and_ps(below, _mm_set1_ps(1.0f)));
+                i = _mm_cvttps_epi32(fi);
+                __m128 f = _mm_sub_ps(t, fi);
+                __m128 poly = _mm_set1_ps(1.3333558e-3f);
+                poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(9.6181291e-3f));
+                poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(5.5504109e-2f));
+                poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(2.4022651e-1f));
+                poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(6.9314718e-1f));
+                poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(1.0f));
+                __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+                return _mm_mul_ps(poly, scale);
+            }
+
+            // filter1 for the four pixels p to p + 3 of a row, the taps of the four pixels are next to each other too
+            void filter4(size_t p) const {
+                const ATrousDenoiser &d = *denoiser;
+                __m128 c[3], n[3];
+                for (int i = 0; i < 3; i++){
+                    c[i] = _mm_loadu_ps(&source[i][p]);
+                    n[i] = _mm_loadu_ps(&d.m_normal[i][p]);
+                }
+                __m128 z = _mm_loadu_ps(&d.m_depth[p]);
+                __m128 sigma_z = _mm_mul_ps(_mm_set1_ps(sigma_depth), _mm_max_ps(z, _mm_set1_ps(1e-4f)));
+                __m128 inv_sigma_depth2 = _mm_div_ps(_mm_set1_ps(1.0f), _mm_mul_ps(sigma_z, sigma_z));
+                __m128 inv_sc2 = _mm_set1_ps(inv_sigma_color2), inv_sn2 = _mm_set1_ps(inv_sigma_normal2);
+                __m128 sum[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+                __m128 weight_sum = _mm_setzero_ps();
+                for (int ky = 0; ky < 5; ky++)
+                    for (int kx = 0; kx < 5; kx++){
+                        size_t q = p + (ptrdiff_t(ky - 2) * d.m_stride + (kx - 2)) * ptrdiff_t(step);
+                        __m128 qc[3], color_dist = _mm_setzero_ps(), normal_dist = _mm_setzero_ps();
+                        for (int i = 0; i < 3; i++){
+                            qc[i] = _mm_loadu_ps(&source[i][q]);
+                            __m128 dc = _mm_sub_ps(c[i], qc[i]);
+                            __m128 dn = _mm_sub_ps(n[i], _mm_loadu_ps(&d.m_normal[i][q]));
+                            color_dist = _mm_add_ps(color_dist, _mm_mul_ps(dc, dc));
+                            normal_dist = _mm_add_ps(normal_dist, _mm_mul_ps(dn, dn));
+                        }
+                        __m128 dz = _mm_sub_ps(z, _mm_loadu_ps(&d.m_depth[q]));
+                        __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(color_dist, inv_sc2), _mm_mul_ps(normal_dist, inv_sn2)),
+                                                 _mm_mul_ps(_mm_mul_ps(dz, dz), inv_sigma_depth2));
+                        __m128 weight = _mm_mul_ps(_mm_set1_ps(kernel[kx] * kernel[ky]),
+                                                   exp4(_mm_sub_ps(_mm_setzero_ps(), dist)));
+                        for (int i = 0; i < 3; i++)
+                            sum[i] = _mm_add_ps(sum[i], _mm_mul_ps(weight, qc[i]));
+                        weight_sum = _mm_add_ps(weight_sum, weight);
+                    }
+                for (int i = 0; i < 3; i++)
+                    _mm_storeu_ps(&target[i][p], _mm_div_ps(sum[i], weight_sum));
+            }
+#endif
+        };
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_DENOISER_H
@@ -0,0 +1,243 @@
+//
+// Frame time driven resolution scaling of the ray tracer, with an edge aware upsampler
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_DYNAMIC_RESOLUTION_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_DYNAMIC_RESOLUTION_H
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "rt_renderer.h"
+
+namespace rt{
+
+    // Chooses the resolution to trace at to hold a target frame time. The cost of a frame is taken as proportional
+    // to the number of traced pixels, the cost per pixel (which depends on the view, the reflection depth...) is
+    // measured every frame and smoothed, and the scale follows sqrt(target / cost of the full resolution).
+    // The scale is limited to drop by 20% and grow by 5% per frame, so that frame time spikes are corrected quickly
+    // and the resolution does not oscillate.
+    class ResolutionController{
+    public:
+        // time budget for tracing one frame
+        float target_ms = 12.0f;
+        // limits of the traced resolution, per axis and relative to the output resolution
+        float min_scale = 1.0f / 16.0f, max_scale = 1.0f;
+        // weight of the last frame in the smoothed cost per pixel
+        float smoothing = 0.25f;
+
+        float scale() const { return glm::clamp(m_scale, min_scale, max_scale); }
+
+        // traced resolution for an output of W x H pixels
+        void internalSize(unsigned int W, unsigned int H, unsigned int &w, unsigned int &h) const {
+            w = glm::clamp(unsigned(W * scale() + .5f), 1u, std::max(W, 1u));
+            h = glm::clamp(unsigned(H * scale() + .5f), 1u, std::max(H, 1u));
+        }
+
+        // reports that tracing traced_pixels pixels took ms, output_pixels is the number of pixels of the output
+        void update(float ms, size_t traced_pixels, size_t output_pixels){
+            if (traced_pixels == 0 || output_pixels == 0) return;
+            float cost = std::max(ms, 1e-3f) / traced_pixels;
+            m_cost = m_cost > 0 ? glm::mix(m_cost, cost, smoothing) : cost;
+            float wanted = std::sqrt(target_ms / (m_cost * output_pixels));
+            wanted = glm::clamp(wanted, scale() * 0.8f, scale() * 1.05f);
+            m_scale = glm::clamp(wanted, min_scale, max_scale);
+        }
+
+    private:
+        float m_scale = 0.25f;
+        float m_cost = 0;
+    };
+
+    // Renders frames at the resolution of the frame buffer while tracing only a w x h grid of its pixels, with w x h
+    // chosen by the controller. Grid column i traces output column floor((i + offset) * W / w) (rows likewise), so
+    // the traced pixels are exact, and the pixels between them are reconstructed by upsample().
+    // While the camera, the scene and the settings stay the same, the grid moves by a different offset every frame
+    // (Halton sequence), the traced pixels are kept and not traced again, and the image converges to the full
+    // resolution one. The controller only learns from the frames after a change, when the whole grid is traced.
+    class DynamicResolution{
+    public:
+        ResolutionController controller;
+        // relative difference of hit distance above which two neighbouring samples belong to different surfaces
+        float depth_tolerance = 0.05f;
+
+        // renders fb, returns the number of pixels that were traced
+        size_t render(Renderer &renderer,
+                      const std::vector<vertex> &vts,
+                      const glm::mat4 &m,
+                      const glm::mat4 &v,
+                      const float fov_degrees,
+                      unsigned int depth,
+                      FrameBuffer <uint32_t> &fb){
+            unsigned int W = fb.W, H = fb.H;
+            ImageKey key{m, fov_degrees, depth, W, H, &vts, vts.size()};
+            bool still = key == m_key && v == m_view && m_color && m_color->W == W && m_color->H == H;
+            if (!still){
+                m_key = key;
+                m_view = v;
+                if (!m_color || m_color->W != W || m_color->H != H){
+                    m_color.reset(new FrameBuffer<uint32_t>(W, H));
+                    m_dist.reset(new FrameBuffer<float>(W, H));
+                }
+                m_exact.assign(size_t(W) * H, 0);
+                m_exact_count = 0;
+                m_still_frames = 0;
+            }
+            else
+                m_still_frames++;
+
+            // the grid is centered in its cells while the camera moves, and jumps around them while it is still
+            unsigned int w, h;
+            controller.internalSize(W, H, w, h);
+            glm::vec2 offset = m_still_frames == 0 ? glm::vec2(.5f) : glm::vec2(halton(m_still_frames, 2), halton(m_still_frames, 3));
+            gridPositions(W, w, offset.x, m_columns);
+            gridPositions(H, h, offset.y, m_rows);
+            m_grid_W = w;
+            m_grid_H = h;
+
+            m_pixels.clear();
+            for (unsigned int row : m_rows)
+                for (unsigned int column : m_columns){
+                    uint32_t pixel = column + row * W;
+                    if (!m_exact[pixel]){
+                        m_exact[pixel] = 1;
+                        m_pixels.push_back(pixel);
+                    }
+                }
+            m_exact_count += m_pixels.size();
+
+            auto start = std::chrono::high_resolution_clock::now();
+            renderer.renderPixels(vts, m, v, fov_degrees, depth, m_pixels, *m_color, m_dist.get());
+            float ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            if (m_still_frames == 0)
+                controller.update(ms, m_pixels.size(), size_t(W) * H);
+
+            upsample(renderer, fb);
+            return m_pixels.size();
+        }
+
+        // traced resolution of the last frame
+        unsigned int gridWidth() const { return m_grid_W; }
+        unsigned int gridHeight() const { return m_grid_H; }
+
+        // pixels traced since the last change, the image is complete when it reaches W * H
+        size_t exactPixels() const { return m_exact_count; }
+
+    private:
+        // what the traced pixels depend on, they are discarded when any of these or the view change
+        ImageKey m_key;
+        glm::mat4 m_view = glm::mat4(0);
+
+        // colors and hit distances of the traced pixels, at the output resolution
+        std::unique_ptr<FrameBuffer<uint32_t>> m_color;
+        std::unique_ptr<FrameBuffer<float>> m_dist;
+        // 1 for the pixels traced since the last change
+        std::vector<uint8_t> m_exact;
+        size_t m_exact_count = 0;
+        unsigned int m_still_frames = 0;
+
+        // output column (row) of every grid column (row) of the current frame
+        std::vector<unsigned int> m_columns, m_rows;
+        unsigned int m_grid_W = 0, m_grid_H = 0;
+        // pixels traced in the current frame
+        std::vector<uint32_t> m_pixels;
+
+        // radical inverse of index in base, a low discrepancy sequence in [0, 1)
+        static float halton(unsigned int index, unsigned int base){
+            float result = 0, f = 1.0f / base;
+            for (; index > 0; index /= base, f /= base)
+                result += f * (index % base);
+            return result;
+        }
+
+        // output positions of count samples spread over size pixels, increasing
+        static void gridPositions(unsigned int size, unsigned int count, float offset, std::vector<unsigned int> &positions){
+            positions.resize(count);
+            for (unsigned int i = 0; i < count; i++)
+                positions[i] = std::min(size - 1, unsigned((i + offset) * size / count));
+        }
+
+        // Pixels that were traced are copied, the others interpolate the four grid samples around them. Samples
+        // whose hit distances differ by more than depth_tolerance (relative) are on different surfaces, misses are a
+        // surface of their own. Only the samples of the surface with the largest total bilinear weight are blended,
+        // so that silhouettes stay sharp instead of mixing foreground and background
+        void upsample(Renderer &renderer, FrameBuffer <uint32_t> &fb){
+            unsigned int W = fb.W;
+            // grid sample before and after each output column / row, and the bilinear weight of the one after
+            std::vector<unsigned int> column0, column1, row0, row1;
+            std::vector<float> tx, ty;
+            neighbours(m_columns, fb.W, column0, column1, tx);
+            neighbours(m_rows, fb.H, row0, row1, ty);
+
+            renderer.parallelTiles(fb.W, fb.H, [&](const Tile &tile){
+                for (unsigned int y = tile.y0; y < tile.y1; y++)
+                    for (unsigned int x = tile.x0; x < tile.x1; x++){
+                        uint32_t pixel = x + y * W;
+                        if (m_exact[pixel]){
+                            fb.buffer[pixel] = m_color->buffer[pixel];
+                            continue;
+                        }
+                        const uint32_t samples[4] = {column0[x] + row0[y] * W, column1[x] + row0[y] * W,
+                                                     column0[x] + row1[y] * W, column1[x] + row1[y] * W};
+                        const float weights[4] = {(1 - tx[x]) * (1 - ty[y]), tx[x] * (1 - ty[y]),
+                                                  (1 - tx[x]) * ty[y], tx[x] * ty[y]};
+                        float dists[4];
+                        for (int i = 0; i < 4; i++)
+                            dists[i] = m_dist->buffer[samples[i]];
+
+                        // the surface that covers the pixel is taken to be the one with the largest total weight
+                        int surface = 0;
+                        float surface_weight = -1;
+                        for (int i = 0; i < 4; i++){
+                            float weight = 0;
+                            for (int k = 0; k < 4; k++)
+                                if (sameSurface(dists[i], dists[k])) weight += weights[k];
+                            if (weight > surface_weight){
+                                surface = i;
+                                surface_weight = weight;
+                            }
+                        }
+
+                        glm::vec4 sum(0);
+                        float weight_sum = 0;
+                        for (int i = 0; i < 4; i++){
+                            if (!sameSurface(dists[surface], dists[i])) continue;
+                            sum += weights[i] * Colors::fromRGBA32(m_color->buffer[samples[i]]);
+                            weight_sum += weights[i];
+                        }
+                        fb.buffer[pixel] = weight_sum > 0 ? Colors::toRGBA32(sum / weight_sum) : m_color->buffer[samples[surface]];
+                    }
+            });
+        }
+
+        // true if two samples with these hit distances are on the same surface
+        bool sameSurface(float a, float b) const {
+            if (a == FLT_MAX || b == FLT_MAX) return a == b;
+            return std::abs(a - b) <= depth_tolerance * std::min(a, b);
+        }
+
+        // for every output position, the grid samples at or before (first) and after (second) it, and where it is
+        // between them (0 at first, 1 at second)
+        static void neighbours(const std::vector<unsigned int> &positions, unsigned int size,
+                               std::vector<unsigned int> &first, std::vector<unsigned int> &second, std::vector<float> &t){
+            first.resize(size);
+            second.resize(size);
+            t.resize(size);
+            size_t i = 0;
+            for (unsigned int p = 0; p < size; p++){
+                while (i + 1 < positions.size() && positions[i + 1] <= p)
+                    i++;
+                size_t j = std::min(i + 1, positions.size() - 1);
+                first[p] = positions[i];
+                second[p] = positions[j];
+                t[p] = positions[j] > positions[i] ? glm::clamp(float(int(p) - int(positions[i])) / (positions[j] - positions[i]), 0.0f, 1.0f) : 0.0f;
+            }
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_DYNAMIC_RESOLUTION_H
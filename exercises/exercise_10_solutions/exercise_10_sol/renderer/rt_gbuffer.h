@@ -0,0 +1,37 @@
+//
+// Linear color and auxiliary buffers of a path traced frame, the input of the denoiser
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_GBUFFER_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_GBUFFER_H
+
+#include <vector>
+#include <cfloat>
+#include <glm/glm.hpp>
+
+namespace rt{
+
+    // Per pixel averages over the samples of a pixel, in frame buffer order (c + r * W). color is the radiance
+    // before it is clamped to 8 bits, albedo the diffuse reflectance of the surface hit by the primary rays (1 where
+    // they miss), normal their normal (not renormalized after the average) and depth their hit distance, FLT_MAX
+    // where all of them miss
+    struct GBuffer{
+        unsigned int W = 0, H = 0;
+        std::vector<glm::vec3> color;
+        std::vector<glm::vec3> albedo;
+        std::vector<glm::vec3> normal;
+        std::vector<float> depth;
+
+        void resize(unsigned int width, unsigned int height){
+            W = width;
+            H = height;
+            size_t size = size_t(W) * H;
+            color.resize(size);
+            albedo.resize(size);
+            normal.resize(size);
+            depth.resize(size);
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_GBUFFER_H
@@ -0,0 +1,167 @@
+//
+// Point lights of the ray tracer, and the light BVH that picks the light of a shadow ray when there are many
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_LIGHTS_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_LIGHTS_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+
+namespace rt{
+
+    struct PointLight{
+        glm::vec3 position;
+        glm::vec3 color = glm::vec3(1);
+    };
+
+    // falloff of the light with the distance d, the same for all lights (as in exercise 12): a light reaches a point
+    // with color / (constant + linear * d + quadratic * d^2). The default is no falloff
+    struct LightAttenuation{
+        float constant = 1, linear = 0, quadratic = 0;
+
+        float at(float d) const {
+            return 1.0f / std::max(constant + linear * d + quadratic * d * d, 1e-6f);
+        }
+    };
+
+    // 32 bytes, two nodes per cache line
+    struct LightNode{
+        glm::vec3 bmin;
+        // inner node: index of the left child (right is left + 1), leaf: leaf_flag | index of its light
+        uint32_t left_light;
+        glm::vec3 bmax;
+        // luminance of the colors of all lights under the node
+        float power;
+
+        static const uint32_t leaf_flag = 0x80000000u;
+        bool isLeaf() const { return (left_light & leaf_flag) != 0; }
+        uint32_t light() const { return left_light & ~leaf_flag; }
+    };
+
+    // Binary tree over the lights (one light per leaf, median split along the largest axis), used to pick one light
+    // per shadow ray with a probability close to how much it contributes at the shaded point, instead of tracing a
+    // shadow ray to each light. From the root down, one of the two children is chosen with a probability
+    // proportional to its importance: the power of its lights times a bound of their falloff and of the cosine at the
+    // point over the bounding box of the lights (a light cluster behind the surface gets 0). A pick costs two
+    // importance evaluations per level, O(log n) for n lights.
+    class LightBVH{
+    public:
+        LightBVH() = default;
+        explicit LightBVH(const std::vector<PointLight> &lights){
+            build(lights);
+        }
+
+        void build(const std::vector<PointLight> &lights){
+            nodes.clear();
+            if (lights.empty()) return;
+            std::vector<uint32_t> order(lights.size());
+            for (uint32_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            nodes.reserve(lights.size() * 2);
+            nodes.push_back(LightNode{});
+            subdivide(0, lights, order, 0, uint32_t(order.size()));
+        }
+
+        // Picks a light for the point p with normal n, u is a random number in [0, 1). Returns the index of the
+        // light and the probability that it was picked in pdf, or -1 if no light can reach p. u is rescaled at
+        // every level to pick the child, so the 24 bits of a float are enough for trees of about 20 levels
+        int sample(const glm::vec3 &p, const glm::vec3 &n, const LightAttenuation &attenuation, float u, float &pdf) const {
+            pdf = 0;
+            if (nodes.empty()) return -1;
+            pdf = 1;
+            const LightNode *node = &nodes[0];
+            while (!node->isLeaf()){
+                const LightNode &left = nodes[node->left_light], &right = nodes[node->left_light + 1];
+                float left_importance = importance(left, p, n, attenuation);
+                float right_importance = importance(right, p, n, attenuation);
+                float total = left_importance + right_importance;
+                if (!(total > 0)) {
+                    pdf = 0;
+                    return -1;
+                }
+                float p_left = left_importance / total;
+                if (u < p_left){
+                    u = u / p_left;
+                    pdf *= p_left;
+                    node = &left;
+                }
+                else {
+                    u = (u - p_left) / (1.0f - p_left);
+                    pdf *= 1.0f - p_left;
+                    node = &right;
+                }
+                u = std::min(u, 0.99999994f);
+            }
+            return int(node->light());
+        }
+
+        size_t nodeCount() const { return nodes.size(); }
+
+    private:
+        std::vector<LightNode> nodes;
+
+        void subdivide(uint32_t node_ID, const std::vector<PointLight> &lights, std::vector<uint32_t> &order,
+                       uint32_t begin, uint32_t end){
+            glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+            float power = 0;
+            for (uint32_t i = begin; i < end; i++){
+                const PointLight &light = lights[order[i]];
+                bmin = glm::min(bmin, light.position);
+                bmax = glm::max(bmax, light.position);
+                power += std::max(0.0f, glm::dot(light.color, glm::vec3(0.2126f, 0.7152f, 0.0722f)));
+            }
+            nodes[node_ID].bmin = bmin;
+            nodes[node_ID].bmax = bmax;
+            nodes[node_ID].power = power;
+            if (end - begin == 1){
+                nodes[node_ID].left_light = LightNode::leaf_flag | order[begin];
+                return;
+            }
+
+            glm::vec3 extent = bmax - bmin;
+            int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+            uint32_t mid = begin + (end - begin) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b){
+                return lights[a].position[axis] < lights[b].position[axis];
+            });
+
+            uint32_t left_ID = uint32_t(nodes.size());
+            nodes.push_back(LightNode{});
+            nodes.push_back(LightNode{});
+            nodes[node_ID].left_light = left_ID;
+            subdivide(left_ID, lights, order, begin, mid);
+            subdivide(left_ID + 1, lights, order, mid, end);
+        }
+
+        // power of the lights of the node times the falloff at the distance of its center (at least the radius of
+        // its bounding sphere) and the largest cosine between n and a direction from p into the sphere. For a leaf
+        // it is the power times the falloff and the cosine of its light, 0 if the light is behind the surface
+        static float importance(const LightNode &node, const glm::vec3 &p, const glm::vec3 &n,
+                                const LightAttenuation &attenuation){
+            glm::vec3 center = (node.bmin + node.bmax) * .5f;
+            float radius = glm::length(node.bmax - node.bmin) * .5f;
+            glm::vec3 to_center = center - p;
+            float d = glm::length(to_center);
+            float cos_bound = 1;
+            if (d > radius){
+                float cos_theta = glm::dot(n, to_center) / d;
+                float sin_half = radius / d, cos_half = std::sqrt(std::max(0.0f, 1.0f - sin_half * sin_half));
+                if (cos_theta < cos_half){
+                    // cos(theta - half angle), the direction into the sphere closest to n
+                    float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+                    cos_bound = cos_theta * cos_half + sin_theta * sin_half;
+                    if (cos_bound <= 0) return 0;
+                }
+            }
+            return node.power * cos_bound * attenuation.at(std::max(d, radius));
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_LIGHTS_H
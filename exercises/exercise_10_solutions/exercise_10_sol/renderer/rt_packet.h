@@ -0,0 +1,186 @@
+//
+// Traversal of the BVH with packets of four coherent rays (SSE)
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_PACKET_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_PACKET_H
+
+// SSE2 is part of x86-64, so no extra compiler flags are needed. On other architectures
+// RT_PACKET_SIMD is not defined and the renderer traces every ray on its own
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_PACKET_SIMD 1
+#endif
+
+#ifdef RT_PACKET_SIMD
+
+#include <vector>
+#include <cfloat>
+#include <emmintrin.h>
+#include "rt_types.h"
+#include "rt_bvh.h"
+
+namespace rt{
+
+    // four rays in structure of arrays layout, lane i holds ray i
+    struct RayPacket4{
+        __m128 ox, oy, oz;
+        __m128 dx, dy, dz;
+        __m128 inv_dx, inv_dy, inv_dz;
+
+        explicit RayPacket4(const Ray rays[4]){
+            ox = _mm_setr_ps(rays[0].origin.x, rays[1].origin.x, rays[2].origin.x, rays[3].origin.x);
+            oy = _mm_setr_ps(rays[0].origin.y, rays[1].origin.y, rays[2].origin.y, rays[3].origin.y);
+            oz = _mm_setr_ps(rays[0].origin.z, rays[1].origin.z, rays[2].origin.z, rays[3].origin.z);
+            dx = _mm_setr_ps(rays[0].direction.x, rays[1].direction.x, rays[2].direction.x, rays[3].direction.x);
+            dy = _mm_setr_ps(rays[0].direction.y, rays[1].direction.y, rays[2].direction.y, rays[3].direction.y);
+            dz = _mm_setr_ps(rays[0].direction.z, rays[1].direction.z, rays[2].direction.z, rays[3].direction.z);
+            __m128 one = _mm_set1_ps(1.0f);
+            inv_dx = _mm_div_ps(one, dx);
+            inv_dy = _mm_div_ps(one, dy);
+            inv_dz = _mm_div_ps(one, dz);
+        }
+    };
+
+    // slab test for four rays against one box, returns the mask of lanes that hit the box closer than t_max
+    inline __m128 rayAABBIntersection4(const RayPacket4 &p, const glm::vec3 &bmin, const glm::vec3 &bmax,
+                                       __m128 t_max, __m128 &t_enter){
+        __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.x), p.ox), p.inv_dx);
+        __m128 t2x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.x), p.ox), p.inv_dx);
+        __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.y), p.oy), p.inv_dy);
+        __m128 t2y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.y), p.oy), p.inv_dy);
+        __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.z), p.oz), p.inv_dz);
+        __m128 t2z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.z), p.oz), p.inv_dz);
+        t_enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+        __m128 t_exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+        return _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(t_exit, t_enter), _mm_cmpge_ps(t_exit, _mm_setzero_ps())),
+                          _mm_cmple_ps(t_enter, t_max));
+    }
+
+    // Möller–Trumbore for four rays against the triangle i of the store, which is loaded once and broadcast to all
+    // lanes. The operations are the same, and in the same order, as in rt::rayTriangleIntersection, so the lanes
+    // produce exactly the same t, u and v as the single ray test. Returns the mask of lanes that hit the triangle
+    inline __m128 rayTriangleIntersection4(const RayPacket4 &p, const TriangleStore &triangles, size_t i,
+                                           __m128 &t, __m128 &u, __m128 &v){
+        const __m128 tolerance = _mm_set1_ps(10e-7f);
+        const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+        __m128 e1x = _mm_set1_ps(triangles.e1(0)[i]), e1y = _mm_set1_ps(triangles.e1(1)[i]), e1z = _mm_set1_ps(triangles.e1(2)[i]);
+        __m128 e2x = _mm_set1_ps(triangles.e2(0)[i]), e2y = _mm_set1_ps(triangles.e2(1)[i]), e2z = _mm_set1_ps(triangles.e2(2)[i]);
+
+        // q = cross(direction, e2), a = dot(e1, q)
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(p.dy, e2z), _mm_mul_ps(p.dz, e2y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(p.dz, e2x), _mm_mul_ps(p.dx, e2z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(p.dx, e2y), _mm_mul_ps(p.dy, e2x));
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)), _mm_mul_ps(e1z, qz));
+        // triangle plane and ray are parallel
+        __m128 mask = _mm_cmpnlt_ps(_mm_and_ps(a, abs_mask), tolerance);
+
+        __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+        __m128 sx = _mm_sub_ps(p.ox, _mm_set1_ps(triangles.p1(0)[i]));
+        __m128 sy = _mm_sub_ps(p.oy, _mm_set1_ps(triangles.p1(1)[i]));
+        __m128 sz = _mm_sub_ps(p.oz, _mm_set1_ps(triangles.p1(2)[i]));
+        u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, qx), _mm_mul_ps(sy, qy)), _mm_mul_ps(sz, qz)));
+        mask = _mm_and_ps(mask, _mm_cmpnlt_ps(u, _mm_sub_ps(_mm_setzero_ps(), tolerance)));
+
+        // r = cross(s, e1)
+        __m128 rx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 ry = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 rz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(p.dx, rx), _mm_mul_ps(p.dy, ry)), _mm_mul_ps(p.dz, rz)));
+        mask = _mm_and_ps(mask, _mm_cmpnlt_ps(v, _mm_sub_ps(_mm_setzero_ps(), tolerance)));
+        mask = _mm_and_ps(mask, _mm_cmpngt_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+
+        t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, rx), _mm_mul_ps(e2y, ry)), _mm_mul_ps(e2z, rz)));
+        return _mm_and_ps(mask, _mm_cmpnlt_ps(t, _mm_setzero_ps()));
+    }
+
+    inline __m128 blend(__m128 mask, __m128 if_true, __m128 if_false){
+        return _mm_or_ps(_mm_and_ps(mask, if_true), _mm_andnot_ps(mask, if_false));
+    }
+
+    // closest hit for a packet of four rays, lanes that are not in active_lanes (bit i for ray i) are ignored.
+    // A node is visited if any active ray hits it, so this pays off when the rays are coherent (e.g. primary rays
+    // of neighbouring pixels). The hits are the same as the ones that BVH::closestHit finds for each ray.
+    // Returns the mask of rays that hit something
+    inline int packetClosestHit(const BVH &bvh, const Ray rays[4], int active_lanes, Hit hits[4]){
+        for (int i = 0; i < 4; i++) hits[i] = Hit();
+        if (bvh.nodes.empty() || active_lanes == 0) return 0;
+
+        RayPacket4 packet(rays);
+        __m128 active = _mm_castsi128_ps(_mm_setr_epi32(active_lanes & 1 ? -1 : 0, active_lanes & 2 ? -1 : 0,
+                                                        active_lanes & 4 ? -1 : 0, active_lanes & 8 ? -1 : 0));
+        __m128 best_t = _mm_set1_ps(FLT_MAX), best_u = _mm_setzero_ps(), best_v = _mm_setzero_ps();
+        __m128i best_ID = _mm_set1_epi32(-1);
+
+        const BVHNode *stack[BVH::max_depth * 2];
+        int stack_ptr = 0;
+        stack[stack_ptr++] = &bvh.nodes[0];
+        while (stack_ptr > 0){
+            const BVHNode *node = stack[--stack_ptr];
+            RT_COUNT(node_visits, 1);
+            __m128 t_enter;
+            // nodes are tested when popped, the closest hits may have moved since they were pushed
+            if (_mm_movemask_ps(_mm_and_ps(active, rayAABBIntersection4(packet, node->bmin, node->bmax, best_t, t_enter))) == 0)
+                continue;
+
+            if (node->isLeaf()){
+                RT_COUNT(triangle_tests, node->count);
+                for (uint32_t i = node->left_first, end = node->left_first + node->count; i < end; i++){
+                    int vertex_ID = (int) bvh.tri_IDs[i];
+                    __m128 t, u, v;
+                    __m128 hit = _mm_and_ps(active, rayTriangleIntersection4(packet, bvh.triangles, i, t, u, v));
+                    if (_mm_movemask_ps(hit) == 0) continue;
+                    // same rule as the single ray traversal, the closest hit wins and ties go to the lowest ID
+                    __m128i ID = _mm_set1_epi32(vertex_ID);
+                    __m128 closer = _mm_or_ps(_mm_cmplt_ps(t, best_t),
+                                              _mm_and_ps(_mm_cmpeq_ps(t, best_t),
+                                                         _mm_castsi128_ps(_mm_cmplt_epi32(ID, best_ID))));
+                    __m128 update = _mm_and_ps(hit, closer);
+                    best_t = blend(update, t, best_t);
+                    best_u = blend(update, u, best_u);
+                    best_v = blend(update, v, best_v);
+                    best_ID = _mm_castps_si128(blend(update, _mm_castsi128_ps(ID), _mm_castsi128_ps(best_ID)));
+                }
+                continue;
+            }
+
+            // push the far child first, so that the child closer to the packet is visited first
+            const BVHNode *child1 = &bvh.nodes[node->left_first];
+            const BVHNode *child2 = &bvh.nodes[node->left_first + 1];
+            __m128 enter1, enter2;
+            __m128 hit1 = _mm_and_ps(active, rayAABBIntersection4(packet, child1->bmin, child1->bmax, best_t, enter1));
+            __m128 hit2 = _mm_and_ps(active, rayAABBIntersection4(packet, child2->bmin, child2->bmax, best_t, enter2));
+            float dist1 = FLT_MAX, dist2 = FLT_MAX;
+            alignas(16) float e1[4], e2[4];
+            _mm_store_ps(e1, blend(hit1, enter1, _mm_set1_ps(FLT_MAX)));
+            _mm_store_ps(e2, blend(hit2, enter2, _mm_set1_ps(FLT_MAX)));
+            for (int i = 0; i < 4; i++){
+                dist1 = glm::min(dist1, e1[i]);
+                dist2 = glm::min(dist2, e2[i]);
+            }
+            if (dist1 > dist2) { std::swap(dist1, dist2); std::swap(child1, child2); }
+            if (dist2 != FLT_MAX) stack[stack_ptr++] = child2;
+            if (dist1 != FLT_MAX) stack[stack_ptr++] = child1;
+        }
+
+        alignas(16) float t[4], u[4], v[4];
+        alignas(16) int ID[4];
+        _mm_store_ps(t, best_t);
+        _mm_store_ps(u, best_u);
+        _mm_store_ps(v, best_v);
+        _mm_store_si128((__m128i*) ID, best_ID);
+        int hit_lanes = 0;
+        for (int i = 0; i < 4; i++){
+            if (ID[i] < 0) continue;
+            hits[i].hit_ID = ID[i];
+            hits[i].dist = t[i];
+            hits[i].barycentric = glm::vec3(1.0f - u[i] - v[i], u[i], v[i]);
+            hit_lanes |= 1 << i;
+        }
+        return hit_lanes;
+    }
+}
+
+#endif //RT_PACKET_SIMD
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_PACKET_H
@@ -6,46 +6,455 @@
 #define ITU_GRAPHICS_PROGRAMMING_RT_RENDERER_H
 
 #include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include "rt_types.h"
+#include "rt_bvh.h"
+#include "rt_bvh_cache.h"
+#include "rt_wide_bvh.h"
+#include "rt_streaming.h"
+#include "rt_scheduler.h"
+#include "rt_packet.h"
+#include "rt_wavefront.h"
+#include "rt_scene.h"
+#include "rt_texture.h"
+#include "rt_lights.h"
+#include "rt_gbuffer.h"
+#include "rt_stats.h"
 #include "frame_buffer.h"
 
 namespace rt{
     using namespace Colors;
     using namespace glm;
 
-    class Renderer{
-        // limits the number of reflections, 1 == no reflection
-        const unsigned int max_recursion = 5;
-        // mixture parameter for combining local illumination and reflected color
-        float p_rg = 0.4f;
-
-    public:
-        void render(const std::vector<vertex> &vts,
-                    const glm::mat4 &m,
-                    const glm::mat4 &v,
-                    const float fov_degrees,
-                    unsigned int depth,
-                    FrameBuffer <uint32_t> &fb) {
+    // generates the primary rays (in model space) for the pixels of a W x H frame buffer
+    struct PrimaryRays{
+        mat4 view_to_model;
+        vec4 lower_left_corner;
+        vec4 cam_pos;
+        vec2 pixel_size;
+        // from one pixel to the next one on the image plane, horizontally and vertically, and the normal of the
+        // image plane scaled so that dot(p - cam_pos, plane_normal) == 1 on it, in model space
+        vec3 pixel_dx, pixel_dy, plane_normal;
 
-            float aspect_ratio = fb.H / fb.W;
+        PrimaryRays(const glm::mat4 &m, const glm::mat4 &v, float fov_degrees, unsigned int W, unsigned int H){
+            float aspect_ratio = float(W) / float(H);
             // we use the fov and the tangent function to compute where is the bottom of the projection plane,
             // we assume that the projection place is 1 unit in front of the camera (z == -1)
             float bottom = - tan(abs(radians(fov_degrees)) * 0.5f);
 
             // find the transformation that move points from camera space to model space
-            mat4 view_to_model = inverse(v * m);
+            view_to_model = inverse(v * m);
             // the bottom left corner of the image plane/camera sensor
-            vec4 lower_left_corner = vec4(bottom * aspect_ratio, bottom, -1, 1);
+            lower_left_corner = vec4(bottom * aspect_ratio, bottom, -1, 1);
             // we transform the camera position (also the convergence point of light rays) from camera coordinates to MODEL coordinates
             // notice that we implicitly assume that the camera position is at 0,0,0 in its one coordinate space
-            vec4 cam_pos = view_to_model * vec4(0,0,0,1);
+            cam_pos = view_to_model * vec4(0,0,0,1);
 
             // the distance from the center of one pixel to the next along the horizontal and vertical axes of the screen
             // notice that * and / are applied component wise
-            vec2 pixel_size = abs(vec2(lower_left_corner)) * 2.0f / vec2(fb.H, fb.W);
+            pixel_size = abs(vec2(lower_left_corner)) * 2.0f / vec2(W, H);
+            pixel_dx = view_to_model * vec4(pixel_size.x, 0, 0, 0);
+            pixel_dy = view_to_model * vec4(0, pixel_size.y, 0, 0);
+            // the plane is z == -1 in camera space, its normal is transformed with the transpose of model_to_view
+            mat4 model_to_view = v * m;
+            plane_normal = -vec3(model_to_view[0][2], model_to_view[1][2], model_to_view[2][2]);
+        }
+
+        // ray through the point (c, r) of the image plane, in pixels from the lower left corner
+        Ray at(float c, float r) const {
+            vec4 pixel_pos = lower_left_corner + vec4 (vec2(c, r) * pixel_size,0, 0);
+            pixel_pos = view_to_model * pixel_pos;  // transform from camera coord space to model coord space
+            return Ray(cam_pos, normalize(pixel_pos - cam_pos));
+        }
+
+        // differentials of a ray returned by at(): all rays start at the camera, the direction d / |d| changes
+        // with the point d on the image plane
+        RayDifferential differential(const Ray &ray) const {
+            float inv_len = dot(ray.direction, plane_normal); // 1 / |d|
+            RayDifferential differential;
+            differential.dDdx = (pixel_dx - ray.direction * dot(ray.direction, pixel_dx)) * inv_len;
+            differential.dDdy = (pixel_dy - ray.direction * dot(ray.direction, pixel_dy)) * inv_len;
+            return differential;
+        }
+    };
+
+    class Renderer{
+        // limits the number of reflections, 1 == no reflection
+        const unsigned int max_recursion = 5;
+        // mixture parameter for combining local illumination and reflected color
+        float p_rg = 0.4f;
+        // acceleration structure, built from the vertex buffer passed to render
+        BVH m_bvh;
+        // compressed versions of m_bvh, built when bvh_width asks for them
+        WideBVH<4> m_bvh4;
+        WideBVH<8> m_bvh8;
+        // worker threads, created on the first multithreaded render and kept alive between frames
+        std::unique_ptr<TileScheduler> m_scheduler;
+
+        // running sums of the samples of one pixel, used by renderProgressive
+        struct PixelSamples{
+            color sum = color(0);
+            float lum_sum = 0, lum_sq_sum = 0;
+            unsigned int count = 0;
+
+            void add(const color &col){
+                float lum = dot(vec3(clamp(col, 0.f, 1.f)), vec3(0.2126f, 0.7152f, 0.0722f));
+                sum += col;
+                lum_sum += lum;
+                lum_sq_sum += lum * lum;
+                count++;
+            }
+
+            // true when the standard error of the mean luminance is below the threshold (or out of samples)
+            bool converged(unsigned int min_samples, unsigned int max_samples, float threshold) const {
+                if (count >= max_samples) return true;
+                if (count < glm::max(min_samples, 2u)) return false;
+                float mean = lum_sum / count;
+                float variance = glm::max(0.f, lum_sq_sum / count - mean * mean) * count / (count - 1);
+                return variance / count <= threshold * threshold;
+            }
+        };
+        std::vector<PixelSamples> m_samples;
+
+        // what the accumulated samples depend on, they are discarded when any of these or the view change
+        ImageKey m_progressive_key;
+        mat4 m_progressive_view = mat4(0);
+
+        // deterministic jitter in [0, 1) for the sample'th sample of pixel (c, r), the image does not
+        // depend on which thread traced which tile
+        static vec2 randomPixelOffset(unsigned int c, unsigned int r, unsigned int sample){
+            uint32_t seed = hash32(c + 0x9e3779b9u * hash32(r + 0x85ebca6bu * hash32(sample)));
+            return vec2(toUnitFloat(seed), toUnitFloat(hash32(seed)));
+        }
+
+        // queues and per pixel colors of the wavefront renderer, kept between frames to reuse the memory
+        PathQueue m_paths, m_next_paths;
+        ShadowQueue m_shadows;
+        std::vector<color> m_pixel_colors;
+        // the scene being rendered by render(Scene&, ...), nullptr when rendering a single vertex buffer
+        const Scene *m_scene = nullptr;
+        // the out-of-core mesh being rendered by render(const StreamedMesh&, ...), nullptr otherwise
+        const StreamedMesh *m_streamed = nullptr;
+
+        // per pixel counters of the last frame (or of all samples of renderProgressive), only with RT_STATS
+        std::vector<RayStats> m_pixel_stats;
+
+        // adds the counters collected by the calling thread while running trace to the stats of the pixels, split
+        // evenly between them when several pixels share the work (e.g. a packet). Without RT_STATS it only calls trace
+        template <typename Trace>
+        void countForPixels(const uint32_t *pixels, unsigned int count, const Trace &trace){
+#ifdef RT_STATS
+            // the depth of the thread is the largest one of the paths traced by this call only
+            threadStats().depth = 0;
+            RayStats before = threadStats();
+            trace();
+            RayStats work = threadStats().since(before);
+            for (unsigned int i = 0; i < count; i++)
+                m_pixel_stats[pixels[i]] += work.part(i, count);
+#else
+            (void) pixels; (void) count;
+            trace();
+#endif
+        }
+
+        template <typename Trace>
+        void countForPixel(uint32_t pixel, const Trace &trace){
+            countForPixels(&pixel, 1, trace);
+        }
+
+        // what the shading needs to know about an intersection point
+        struct SurfacePoint{
+            vec3 pos;
+            vec3 normal;
+            color col;
+        };
+
+        // The color is the interpolated vertex color, times the texture of the triangle if it has one. If the ray has
+        // differentials, they select the mip level of the texture, and if reflected is not null it receives the
+        // differentials of the reflected ray
+        SurfacePoint surfaceAt(const Ray & ray, const Hit & hitInfo, const std::vector<vertex> &model,
+                               const RayDifferential *differential = nullptr, RayDifferential *reflected = nullptr) const {
+            // instances are shaded with the vertices of their mesh, and their normals are transformed to world space
+            const Instance *instance = hitInfo.instance_ID >= 0 ? &m_scene->instance(hitInfo.instance_ID) : nullptr;
+            const std::vector<vertex> &vts = instance ? m_scene->mesh(instance->mesh_ID).vertices : model;
+            // the vertices of an out-of-core mesh are copied from their page, which may be unmapped afterwards
+            vertex streamed[3];
+            const vertex *tri = streamed;
+            if (m_streamed)
+                m_streamed->triangle(hitInfo.hit_ID, streamed);
+            else
+                tri = &vts[hitInfo.hit_ID];
+
+            // TODO ex 10.2 replace the current i_normal and i_col computation with their interpolated versions
+            vec3 i_normal = tri[0].norm * hitInfo.barycentric.x + tri[1].norm * hitInfo.barycentric.y + tri[2].norm * hitInfo.barycentric.z;
+            if (instance) i_normal = instance->normal_matrix * i_normal;
+            i_normal = normalize(i_normal);
+            color i_col = tri[0].col * hitInfo.barycentric.x + tri[1].col * hitInfo.barycentric.y + tri[2].col * hitInfo.barycentric.z;
+
+            vec3 i_pos = ray.origin + ray.direction * hitInfo.dist;
+            const Texture *tex = instance ? m_scene->mesh(instance->mesh_ID).texture : m_streamed ? nullptr : texture;
+            if (!tex && !reflected)
+                return SurfacePoint{i_pos, i_normal, i_col};
+
+            vec2 uv = tri[0].uv * hitInfo.barycentric.x + tri[1].uv * hitInfo.barycentric.y + tri[2].uv * hitInfo.barycentric.z;
+            vec2 duv_dx(0), duv_dy(0);
+            if (reflected)
+                *reflected = RayDifferential();
+            if (differential) {
+                // the triangle in the space of the ray
+                vec3 p0 = tri[0].pos, p1 = tri[1].pos, p2 = tri[2].pos;
+                if (instance) {
+                    p0 = instance->transform * tri[0].pos;
+                    p1 = instance->transform * tri[1].pos;
+                    p2 = instance->transform * tri[2].pos;
+                }
+                vec3 e1 = p1 - p0, e2 = p2 - p0, n = cross(e1, e2);
+                float n_dot_d = dot(n, ray.direction), n_length2 = dot(n, n);
+                if (n_dot_d != 0 && n_length2 > 0) {
+                    // the differentials are carried to the plane of the triangle, where they give how the hit point
+                    // moves from one pixel to the next, and how its barycentric coordinates (b1, b2) change with it
+                    auto transfer = [&](const vec3 &dO, const vec3 &dD){
+                        vec3 dP = dO + hitInfo.dist * dD;
+                        return dP - ray.direction * (dot(dP, n) / n_dot_d);
+                    };
+                    vec3 dPdx = transfer(differential->dOdx, differential->dDdx);
+                    vec3 dPdy = transfer(differential->dOdy, differential->dDdy);
+                    vec3 g1 = cross(e2, n) / n_length2, g2 = cross(n, e1) / n_length2;
+                    vec2 db_dx(dot(dPdx, g1), dot(dPdx, g2)), db_dy(dot(dPdy, g1), dot(dPdy, g2));
+                    duv_dx = db_dx.x * (tri[1].uv - tri[0].uv) + db_dx.y * (tri[2].uv - tri[0].uv);
+                    duv_dy = db_dy.x * (tri[1].uv - tri[0].uv) + db_dy.y * (tri[2].uv - tri[0].uv);
+
+                    if (reflected) {
+                        // r = d - 2 (d.n) n, with the derivative of the normalized interpolated normal
+                        vec3 n1 = tri[1].norm - tri[0].norm, n2 = tri[2].norm - tri[0].norm;
+                        vec3 normal = tri[0].norm * hitInfo.barycentric.x + tri[1].norm * hitInfo.barycentric.y + tri[2].norm * hitInfo.barycentric.z;
+                        if (instance) {
+                            n1 = instance->normal_matrix * n1;
+                            n2 = instance->normal_matrix * n2;
+                            normal = instance->normal_matrix * normal;
+                        }
+                        float normal_length = length(normal);
+                        auto reflect = [&](const vec3 &dD, const vec2 &db){
+                            vec3 dn = db.x * n1 + db.y * n2;
+                            vec3 dN = (dn - i_normal * dot(i_normal, dn)) / normal_length;
+                            float d_dot_n = dot(ray.direction, i_normal);
+                            return dD - 2.0f * (d_dot_n * dN + (dot(dD, i_normal) + dot(ray.direction, dN)) * i_normal);
+                        };
+                        reflected->dOdx = dPdx;
+                        reflected->dOdy = dPdy;
+                        reflected->dDdx = reflect(differential->dDdx, db_dx);
+                        reflected->dDdy = reflect(differential->dDdy, db_dy);
+                    }
+                }
+            }
+            if (tex)
+                i_col *= tex->sample(uv, duv_dx, duv_dy);
+            return SurfacePoint{i_pos, i_normal, i_col};
+        }
 
+        // true if a triangle of the scene being rendered has a texture, the rays then carry differentials
+        bool textured() const {
+            return m_scene ? m_scene->textured() : !m_streamed && texture != nullptr && !texture->empty();
+        }
+
+        // TODO ex 10.3 implement the phong reflection model for the point light below
+        const float ambient = 0.1f, diffuse = 0.5f, specular = 0.5f, shininess = 10;
+        // lights in model space (world space for an rt::Scene), by default the one light of exercise 10 at (0, 1.9, 0)
+        std::vector<PointLight> m_lights{PointLight{vec3(0,1.9f,0)}};
+        LightBVH m_light_bvh{m_lights};
+
+        color ambientLight(const SurfacePoint &sp) const {
+            return ambient * sp.col;
+        }
+
+        // diffuse and specular components of a light, only used if the light is visible from sp
+        color directLight(const SurfacePoint &sp, const PointLight &light) const {
+            vec3 light_dir = normalize(light.position - sp.pos);
+            color phong = diffuse * sp.col * max(dot(light_dir, sp.normal), .0f) +
+                          specular * pow(max(dot(light_dir, sp.normal), .0f), shininess);
+            return phong * vec4(light.color * light_attenuation.at(length(light.position - sp.pos)), 1);
+        }
+
+        // ray from sp towards the light, light_dist is the distance to the light
+        static Ray shadowRay(const SurfacePoint &sp, const PointLight &light, float &light_dist) {
+            vec3 light_dir = normalize(light.position - sp.pos);
+            light_dist = length(light.position - sp.pos);
+            return Ray(sp.pos + sp.normal * .001f, light_dir); // sp.normal * .001f is handling numerical precision issues, it prevents self-intersection
+        }
+
+        // number of shadow rays traced from every hit: one per light when there are no more than light_samples
+        // lights, light_samples otherwise
+        unsigned int shadowRaysPerHit() const {
+            return unsigned(std::min<size_t>(m_lights.size(), std::max(light_samples, 1u)));
+        }
+
+        // The sample'th shadow ray of sp (see shadowRaysPerHit) and what it adds to the color of sp if it reaches its
+        // light. With more lights than light_samples, the light is picked by the light BVH and its contribution is
+        // divided by the probability of the pick and by light_samples, so that the average over the picks is the sum
+        // over all lights. Returns false if no light can reach sp
+        bool lightSample(const SurfacePoint &sp, unsigned int sample, Ray &shadow_ray, float &light_dist, color &contribution) const {
+            if (m_lights.size() <= std::max(light_samples, 1u)) {
+                shadow_ray = shadowRay(sp, m_lights[sample], light_dist);
+                contribution = directLight(sp, m_lights[sample]);
+                return true;
+            }
+            float pdf;
+            int light = m_light_bvh.sample(sp.pos, sp.normal, light_attenuation, lightRandom(sp, sample), pdf);
+            if (light < 0) return false;
+            shadow_ray = shadowRay(sp, m_lights[light], light_dist);
+            contribution = directLight(sp, m_lights[light]) * (1.0f / (pdf * light_samples));
+            return true;
+        }
+
+        // random number in [0, 1) for the sample'th light pick at sp. It is a hash of the position, so it does not
+        // depend on the thread or on the order in which hits are shaded, and the wavefront renderer picks the same lights
+        static float lightRandom(const SurfacePoint &sp, unsigned int sample){
+            uint32_t bits[3];
+            std::memcpy(bits, &sp.pos[0], sizeof(float));
+            std::memcpy(bits + 1, &sp.pos[1], sizeof(float));
+            std::memcpy(bits + 2, &sp.pos[2], sizeof(float));
+            return toUnitFloat(hash32(bits[0] ^ hash32(bits[1] ^ hash32(bits[2] ^ hash32(sample + 0x9e3779b9u)))));
+        }
+
+        // sequence of random numbers in [0, 1) of one path, seeded with the pixel and the sample
+        struct PathRandom{
+            uint32_t state;
+            float next(){
+                state = hash32(state + 0x9e3779b9u);
+                return toUnitFloat(state);
+            }
+        };
+
+        // the first surface of a path, written to the GBuffer by renderPathTraced
+        struct PathFirstHit{
+            vec3 albedo = vec3(1);
+            vec3 normal = vec3(0);
+            float depth = FLT_MAX;
+        };
+
+        // One path: at every surface it adds the direct light of the lights (the same shadow rays as shade, without
+        // the ambient term, the indirect light replaces it), and continues in a cosine distributed direction of the
+        // hemisphere facing the ray. Surfaces are diffuse with the albedo of the diffuse term of directLight, so the
+        // weight of a bounce is that albedo. After min_path_bounces, Russian roulette ends the path with probability
+        // 1 - q, q the largest component of the weight (at most .95), and the survivors are divided by q, so the
+        // estimate stays unbiased while dark paths end early. depth limits the surfaces of a path
+        color tracePath(Ray ray, unsigned int depth, const std::vector<vertex> &vts, PathRandom &random,
+                        const RayDifferential *differential, PathFirstHit *first){
+            vec3 radiance(0), weight(1);
+            for (unsigned int bounce = 0; bounce < depth; bounce++){
+                Hit hit;
+                if (!rayModelIntersection(ray, vts, hit)) break; // the background is black
+                SurfacePoint sp = surfaceAt(ray, hit, vts, bounce == 0 ? differential : nullptr);
+                RT_COUNT(hits, 1);
+                RT_PATH_DEPTH(bounce + 1);
+                // two sided: the normal faces the ray, so that the light of both sides and the bounces are kept
+                if (dot(sp.normal, ray.direction) > 0) sp.normal = -sp.normal;
+                vec3 albedo = diffuse * vec3(sp.col);
+                if (bounce == 0 && first){
+                    first->albedo = albedo;
+                    first->normal = sp.normal;
+                    first->depth = hit.dist;
+                }
+
+                unsigned int shadow_rays = shadowRaysPerHit();
+                for (unsigned int s = 0; s < shadow_rays; s++){
+                    float light_dist;
+                    Ray shadow_ray;
+                    color contribution;
+                    if (lightSample(sp, s, shadow_ray, light_dist, contribution) && !occluded(shadow_ray, light_dist, vts))
+                        radiance += weight * vec3(contribution);
+                }
+
+                weight *= albedo;
+                if (bounce + 1 >= min_path_bounces){
+                    float q = glm::min(glm::max(weight.x, glm::max(weight.y, weight.z)), .95f);
+                    if (random.next() >= q) break;
+                    weight /= q;
+                }
+                if (bounce + 1 >= depth) break;
+
+                // cosine distributed direction around the normal (Malley's method), in the frame t, b, n
+                float r = sqrt(random.next()), phi = 2.0f * 3.14159265f * random.next();
+                vec3 n = sp.normal;
+                vec3 t = normalize(abs(n.x) > .5f ? cross(n, vec3(0, 1, 0)) : cross(n, vec3(1, 0, 0)));
+                vec3 b = cross(n, t);
+                vec3 direction = normalize(t * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(glm::max(0.0f, 1.0f - r * r)));
+                ray = Ray(sp.pos + n * .001f, direction);
+                RT_COUNT(reflection_rays, 1);
+            }
+            return color(radiance, 1);
+        }
+
+        static Ray reflectedRay(const Ray &ray, const SurfacePoint &sp){
+            Ray reflected_ray(sp.pos, reflect(ray.direction, sp.normal));
+            reflected_ray.origin -= ray.direction * .001f; // this is a small offset to address numerical precision issues
+            return reflected_ray;
+        }
+
+        unsigned int threadsToUse() const {
+            return thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        // calls job for every tile, on the worker threads unless thread_count == 1
+        void runTiles(const std::vector<Tile> &tiles, const std::function<void(const Tile&)> &job){
+            unsigned int threads = threadsToUse();
+            if (threads == 1) {
+                for (const Tile &tile : tiles)
+                    job(tile);
+                return;
+            }
+            if (!m_scheduler || m_scheduler->threadCount() != threads)
+                m_scheduler.reset(new TileScheduler(threads));
+            m_scheduler->run(tiles, job);
+        }
+
+        // calls job for all tiles of a W x H image, on the worker threads unless thread_count == 1
+        void forEachTile(unsigned int W, unsigned int H, const std::function<void(const Tile&)> &job){
+            if (threadsToUse() == 1)
+                job(Tile{0, 0, W, H});
+            else
+                runTiles(makeTiles(W, H, tile_size), job);
+        }
+
+        // calls job(begin, end) for consecutive ranges that cover [0, count), each range is a tile of one row
+        void forEachRange(size_t count, const std::function<void(size_t, size_t)> &job){
+            const unsigned int chunk = 1024;
+            if (count <= chunk || threadsToUse() == 1) {
+                if (count > 0) job(0, count);
+                return;
+            }
+            runTiles(makeTiles(count, 1, chunk), [&](const Tile &tile){ job(tile.x0, tile.x1); });
+        }
+
+        // builds the wide BVH selected by bvh_width from m_bvh, if it was not built yet
+        void updateWideBVH(){
+            if (bvh_width == 4 && !m_bvh4.builtFrom(m_bvh))
+                m_bvh4.build(m_bvh);
+            if (bvh_width == 8 && !m_bvh8.builtFrom(m_bvh))
+                m_bvh8.build(m_bvh);
+        }
+
+        // traces the primary rays of all pixels of fb, or only of the pixels in region if it is not null, shared by
+        // all versions of render
+        void renderFrame(const std::vector<vertex> &vts,
+                         const PrimaryRays &primary,
+                         unsigned int depth,
+                         FrameBuffer <uint32_t> &fb,
+                         const Tile *region = nullptr){
+#ifdef RT_STATS
+            m_pixel_stats.assign(size_t(fb.W) * fb.H, RayStats());
+#endif
+            if (use_wavefront && !region) {
+                renderWavefront(vts, primary, depth, fb);
+                return;
+            }
 
             // TODO ex 10.1 iterate through all pixels in the buffer (width: [0, fb.W), height:[0, fb.H])
             //  for each pixel,
@@ -56,61 +465,571 @@ namespace rt{
             //  all intersection computations should happen in the same space, no matter what that space is)
             //  - create a ray with the camera origin, and the vector from the camera origin to the pixel you have just found
             //  - call the TraceRay method using that ray, and store the resulting color in the frame buffer (fb)
-            for (int c = 0; c < fb.W; c++){
-                for(int r = 0; r < fb.H; r++){
-                    vec4 pixel_pos = lower_left_corner + vec4 (vec2(c, r) * pixel_size,0, 0);
-                    pixel_pos = view_to_model * pixel_pos;  // transform from camera coord space to model coord space
-                    Ray ray(cam_pos, normalize(pixel_pos - cam_pos));
-                    color col = traceRay(ray, depth, vts);  // trace te ray / compute the color
-                    fb.paintAt(c, r, toRGBA32(col));        // set the color on the frame buffer
+
+            // rays only carry differentials when there are textures to filter with them
+            bool differentials = textured();
+
+            // the color of each pixel does not depend on any other pixel, so tiles can be traced in any order and by
+            // any thread, and the image is the same as the one produced by the serial path
+            auto traceTile = [&](const Tile &tile){
+#ifdef RT_PACKET_SIMD
+                if (use_packets && use_bvh && bvh_width == 2 && !m_scene && !m_streamed) {
+                    for (unsigned int c = tile.x0; c < tile.x1; c += 2){
+                        for(unsigned int r = tile.y0; r < tile.y1; r += 2){
+                            // lanes that fall outside of the tile (odd sizes) repeat a valid ray and are masked out
+                            unsigned int c1 = std::min(c + 1, tile.x1 - 1), r1 = std::min(r + 1, tile.y1 - 1);
+                            const unsigned int px[4] = {c, c1, c, c1}, py[4] = {r, r, r1, r1};
+                            int active = 1 | (c + 1 < tile.x1 ? 2 : 0) | (r + 1 < tile.y1 ? 4 : 0) |
+                                         (c + 1 < tile.x1 && r + 1 < tile.y1 ? 8 : 0);
+                            Ray rays[4] = {primary.at(px[0], py[0]), primary.at(px[1], py[1]),
+                                           primary.at(px[2], py[2]), primary.at(px[3], py[3])};
+                            Hit hits[4];
+                            uint32_t pixels[4];
+                            unsigned int lanes = 0;
+                            for (int i = 0; i < 4; i++)
+                                if (active & (1 << i)) pixels[lanes++] = px[i] + py[i] * fb.W;
+                            countForPixels(pixels, lanes, [&]{ packetClosestHit(m_bvh, rays, active, hits); });
+                            for (int i = 0; i < 4; i++){
+                                if (!(active & (1 << i))) continue;
+                                color col;
+                                countForPixel(px[i] + py[i] * fb.W, [&]{
+                                    RT_COUNT(primary_rays, 1);
+                                    RayDifferential differential = differentials ? primary.differential(rays[i]) : RayDifferential();
+                                    col = hits[i].hit_ID < 0 ? black : shade(rays[i], hits[i], depth, vts, differentials ? &differential : nullptr);
+                                });
+                                fb.paintAt(px[i], py[i], toRGBA32(col));
+                            }
+                        }
+                    }
+                    return;
                 }
+#endif
+                for (unsigned int c = tile.x0; c < tile.x1; c++){
+                    for(unsigned int r = tile.y0; r < tile.y1; r++){
+                        Ray ray = primary.at(c, r);
+                        color col;
+                        countForPixel(c + r * fb.W, [&]{
+                            RT_COUNT(primary_rays, 1);
+                            RayDifferential differential = differentials ? primary.differential(ray) : RayDifferential();
+                            col = traceRay(ray, depth, vts, differentials ? &differential : nullptr);    // trace te ray / compute the color
+                        });
+                        fb.paintAt(c, r, toRGBA32(col));        // set the color on the frame buffer
+                    }
+                }
+            };
+
+            if (!region)
+                forEachTile(fb.W, fb.H, traceTile);
+            else if (threadsToUse() == 1)
+                traceTile(*region);
+            else {
+                std::vector<Tile> tiles = makeTiles(region->x1 - region->x0, region->y1 - region->y0, tile_size);
+                for (Tile &tile : tiles)
+                    tile = Tile{tile.x0 + region->x0, tile.y0 + region->y0, tile.x1 + region->x0, tile.y1 + region->y0};
+                runTiles(tiles, traceTile);
             }
+        }
+
+        // Wavefront version of render: instead of following each ray through all its bounces, every stage is
+        // applied to the whole queue of rays before the next stage starts:
+        //  - generate: primary rays for all pixels
+        //  - extend:   closest hit of every ray in the queue, rays that miss are removed (compaction)
+        //  - shade:    local lighting, the shadow rays and the reflected ray of the next bounce for every hit
+        //  - shadow:   any hit test of all shadow rays
+        //  - connect:  adds the direct light of the shadow rays that reached the light
+        // There is no recursion, so depth is not limited by max_recursion. The colors are the same as render's up
+        // to floating point rounding, the reflections are added from the first bounce to the last instead of
+        // the other way around.
+        void renderWavefront(const std::vector<vertex> &vts,
+                             const PrimaryRays &primary,
+                             unsigned int depth,
+                             FrameBuffer <uint32_t> &fb){
+            size_t pixel_count = size_t(fb.W) * fb.H;
+            m_pixel_colors.assign(pixel_count, color(0));
+
+            bool differentials = textured();
+            m_paths.with_differentials = m_next_paths.with_differentials = differentials;
+
+            // generate, pixels of a 2x2 quad are next to each other in the queue, so that extend can trace them as a packet
+            m_paths.resize(pixel_count);
+            size_t n = 0;
+            for (unsigned int r = 0; r < fb.H; r += 2)
+                for (unsigned int c = 0; c < fb.W; c += 2)
+                    for (unsigned int q = 0; q < 4; q++){
+                        unsigned int x = c + (q & 1), y = r + (q >> 1);
+                        if (x >= fb.W || y >= fb.H) continue;
+                        m_paths.rays[n] = primary.at(x, y);
+                        if (differentials)
+                            m_paths.differentials[n] = primary.differential(m_paths.rays[n]);
+                        m_paths.pixels[n] = x + y * fb.W;
+                        countForPixel(x + y * fb.W, [&]{ RT_COUNT(primary_rays, 1); });
+                        m_paths.weights[n] = 1.0f;
+                        n++;
+                    }
 
+            for (unsigned int bounce = 0; bounce < std::max(depth, 1u) && m_paths.size() > 0; bounce++){
+                // extend
+                bool packets = bounce == 0 && use_packets && use_bvh && bvh_width == 2 && !m_scene && !m_streamed && m_bvh.builtFor(vts);
+                forEachRange((m_paths.size() + 3) / 4, [&](size_t begin, size_t end){
+                    for (size_t i = begin * 4; i < std::min(end * 4, m_paths.size()); i += 4){
+                        size_t count = std::min<size_t>(4, m_paths.size() - i);
+#ifdef RT_PACKET_SIMD
+                        if (packets && count == 4){
+                            countForPixels(&m_paths.pixels[i], 4, [&]{
+                                packetClosestHit(m_bvh, &m_paths.rays[i], 15, &m_paths.hits[i]);
+                            });
+                            continue;
+                        }
+#endif
+                        for (size_t k = i; k < i + count; k++){
+                            m_paths.hits[k] = Hit();
+                            countForPixel(m_paths.pixels[k], [&]{
+                                rayModelIntersection(m_paths.rays[k], vts, m_paths.hits[k]);
+                            });
+                        }
+                    }
+                });
+                (void) packets;
+
+                // rays that miss get the background color, the others are compacted at the front of the queue
+                size_t hits = 0;
+                for (size_t i = 0; i < m_paths.size(); i++){
+                    if (m_paths.hits[i].hit_ID < 0)
+                        m_pixel_colors[m_paths.pixels[i]] += m_paths.weights[i] * black;
+                    else
+                        m_paths.move(i, hits++);
+                }
+                m_paths.resize(hits);
+
+                // shade, a pixel appears at most once in the queue, so its color can be updated without locking
+                bool last_bounce = bounce + 1 >= depth;
+                unsigned int shadow_rays = shadowRaysPerHit();
+                m_shadows.resize(hits * shadow_rays);
+                m_next_paths.resize(last_bounce ? 0 : hits);
+                forEachRange(hits, [&](size_t begin, size_t end){
+                    for (size_t i = begin; i < end; i++){
+                        const Ray &ray = m_paths.rays[i];
+                        float weight = m_paths.weights[i];
+                        SurfacePoint sp = surfaceAt(ray, m_paths.hits[i], vts, differentials ? &m_paths.differentials[i] : nullptr,
+                                                    differentials && !last_bounce ? &m_next_paths.differentials[i] : nullptr);
+                        countForPixel(m_paths.pixels[i], [&]{
+                            RT_COUNT(hits, 1);
+                            RT_PATH_DEPTH(bounce + 1);
+                            if (!last_bounce) RT_COUNT(reflection_rays, 1);
+                        });
+                        m_pixel_colors[m_paths.pixels[i]] += weight * ambientLight(sp);
+
+                        for (unsigned int s = 0; s < shadow_rays; s++){
+                            size_t j = i * shadow_rays + s;
+                            m_shadows.visible[j] = lightSample(sp, s, m_shadows.rays[j], m_shadows.light_dists[j], m_shadows.contributions[j]);
+                            m_shadows.contributions[j] *= weight;
+                        }
+
+                        if (!last_bounce){
+                            m_next_paths.rays[i] = reflectedRay(ray, sp);
+                            m_next_paths.pixels[i] = m_paths.pixels[i];
+                            m_next_paths.weights[i] = weight * p_rg;
+                        }
+                    }
+                });
+
+                // shadow, only the rays that have a light. The ranges are of paths, so that the shadow rays of a
+                // pixel are traced by one thread, which adds them to the stats of the pixel
+                forEachRange(hits, [&](size_t begin, size_t end){
+                    for (size_t i = begin; i < end; i++)
+                        for (size_t j = i * shadow_rays; j < (i + 1) * shadow_rays; j++)
+                            if (m_shadows.visible[j])
+                                countForPixel(m_paths.pixels[i], [&]{
+                                    m_shadows.visible[j] = !occluded(m_shadows.rays[j], m_shadows.light_dists[j], vts);
+                                });
+                });
+
+                // connect
+                for (size_t j = 0; j < m_shadows.size(); j++)
+                    if (m_shadows.visible[j])
+                        m_pixel_colors[m_paths.pixels[j / shadow_rays]] += m_shadows.contributions[j];
+
+                std::swap(m_paths, m_next_paths);
+            }
+
+            forEachRange(pixel_count, [&](size_t begin, size_t end){
+                for (size_t i = begin; i < end; i++)
+                    fb.buffer[i] = toRGBA32(m_pixel_colors[i]);
+            });
+        }
+
+    public:
+        // when false every ray is tested against every triangle (reference path, used for benchmarking)
+        bool use_bvh = true;
+        // number of threads used by render, 0 means one per hardware thread and 1 renders in the calling thread only
+        unsigned int thread_count = 0;
+        // width and height of the tiles distributed between the render threads
+        unsigned int tile_size = 16;
+        // trace the primary rays of 2x2 pixel quads as one SIMD packet (only with the BVH, and where SSE is available),
+        // reflection and shadow rays are incoherent, so they are still traced one by one. Packets traverse the binary BVH
+        bool use_packets = true;
+        // children per BVH node: 2 for the binary BVH, 4 or 8 for a WideBVH with quantized child boxes, which takes
+        // 2 to 4 times less memory and helps when the binary nodes don't fit in the caches (see rt_wide_bvh.h)
+        unsigned int bvh_width = 2;
+        // trace the frame stage by stage over queues of rays instead of recursively pixel by pixel, see renderWavefront
+        bool use_wavefront = false;
+        // texture of the vertex buffer passed to render (all its triangles), multiplied with the vertex colors and
+        // looked up with their uv, nullptr for none. The meshes of an rt::Scene have their own (Scene::setTexture)
+        const Texture *texture = nullptr;
+        // falloff of the lights with distance, see setLights
+        LightAttenuation light_attenuation;
+        // shadow rays per hit: with up to light_samples lights every light gets one, with more, light_samples lights
+        // are picked at random by the light BVH, so the cost of a hit does not grow with the number of lights
+        // (only the O(log n) pick does), at the price of noise that renderProgressive averages out
+        unsigned int light_samples = 1;
+
+        // replaces the lights (by default one white light at (0, 1.9, 0)) and builds their light BVH. The lights
+        // are in model space, or in world space for an rt::Scene
+        void setLights(const std::vector<PointLight> &lights){
+            m_lights = lights;
+            m_light_bvh.build(m_lights);
+            // the samples accumulated by renderProgressive were lit by the old lights
+            m_samples.clear();
+        }
+
+        const std::vector<PointLight> &lights() const { return m_lights; }
+        const LightBVH &lightBVH() const { return m_light_bvh; }
+
+        // (re)builds the acceleration structure (and the wide BVH selected by bvh_width), render does it automatically when it receives a different
+        // vertex buffer, but it should be called explicitly if the vertices are modified in place
+        void buildBVH(const std::vector<vertex> &vts){
+            m_bvh.build(vts);
+            m_bvh4 = WideBVH<4>();
+            m_bvh8 = WideBVH<8>();
+            updateWideBVH();
+        }
+
+        // same, but loads the acceleration structure from bvh_file if the file was written for these vertices,
+        // and writes it there otherwise (see rt_bvh_cache.h). Returns true if it was loaded
+        bool buildBVH(const std::vector<vertex> &vts, const std::string &bvh_file){
+            m_bvh4 = WideBVH<4>();
+            m_bvh8 = WideBVH<8>();
+            bool loaded = loadOrBuildBVH(bvh_file, vts, m_bvh);
+            updateWideBVH();
+            return loaded;
+        }
+
+        const BVH &bvh() const { return m_bvh; }
+        // empty unless bvh_width was 4 (8) when the last frame was rendered
+        const WideBVH<4> &bvh4() const { return m_bvh4; }
+        const WideBVH<8> &bvh8() const { return m_bvh8; }
+
+        // rays, node visits, triangle tests and depth of each pixel of the last frame, in frame buffer order.
+        // Empty unless the renderer is compiled with RT_STATS, see rt_stats.h
+        const std::vector<RayStats> &pixelStats() const { return m_pixel_stats; }
+
+        void render(const std::vector<vertex> &vts,
+                    const glm::mat4 &m,
+                    const glm::mat4 &v,
+                    const float fov_degrees,
+                    unsigned int depth,
+                    FrameBuffer <uint32_t> &fb) {
+
+            if (use_bvh && !m_bvh.builtFor(vts))
+                buildBVH(vts);
+            if (use_bvh)
+                updateWideBVH();
+
+            PrimaryRays primary(m, v, fov_degrees, fb.W, fb.H);
+
+            m_scene = nullptr;
+            m_streamed = nullptr;
+            renderFrame(vts, primary, depth, fb);
+        }
+
+        // Traces only the pixels of region, the other pixels of fb are left as they are. A pixel gets the color it
+        // has in a full frame of the size of fb, so a frame can be split in regions that are rendered separately,
+        // e.g. by different processes (see exercise_10_offline/distributed.h). The wavefront path is not used
+        void renderRegion(const std::vector<vertex> &vts,
+                          const glm::mat4 &m,
+                          const glm::mat4 &v,
+                          const float fov_degrees,
+                          unsigned int depth,
+                          const Tile &region,
+                          FrameBuffer <uint32_t> &fb) {
+            if (use_bvh && !m_bvh.builtFor(vts))
+                buildBVH(vts);
+            if (use_bvh)
+                updateWideBVH();
+
+            PrimaryRays primary(m, v, fov_degrees, fb.W, fb.H);
+
+            m_scene = nullptr;
+            m_streamed = nullptr;
+            renderFrame(vts, primary, depth, fb, &region);
+        }
+
+        // renders a scene of instanced meshes, the view matrix v transforms from world space to camera space.
+        // The top level BVH of the scene is updated (refitted if instances only moved) before rendering
+        void render(Scene &scene,
+                    const glm::mat4 &v,
+                    const float fov_degrees,
+                    unsigned int depth,
+                    FrameBuffer <uint32_t> &fb) {
+            scene.update();
+            PrimaryRays primary(glm::mat4(1), v, fov_degrees, fb.W, fb.H);
+
+            // every query goes to the scene while m_scene is set, the vertex buffer passed around is not used
+            static const std::vector<vertex> no_vertices;
+            m_scene = &scene;
+            m_streamed = nullptr;
+            renderFrame(no_vertices, primary, depth, fb);
+            m_scene = nullptr;
         }
 
+        // renders an out-of-core mesh (see rt_streaming.h) transformed by the model matrix m, its pages are mapped
+        // as the rays reach them
+        void render(const StreamedMesh &mesh,
+                    const glm::mat4 &m,
+                    const glm::mat4 &v,
+                    const float fov_degrees,
+                    unsigned int depth,
+                    FrameBuffer <uint32_t> &fb) {
+            PrimaryRays primary(m, v, fov_degrees, fb.W, fb.H);
+
+            static const std::vector<vertex> no_vertices;
+            m_scene = nullptr;
+            m_streamed = &mesh;
+            renderFrame(no_vertices, primary, depth, fb);
+            m_streamed = nullptr;
+        }
+
+        // Progressive rendering: while the scene, camera and settings stay the same, every call adds one jittered
+        // sample to each pixel and fb shows the average of all samples so far. Pixels stop taking samples once the
+        // standard error of their luminance is below convergence_threshold (after min_samples) or when they reach
+        // max_samples. The first sample of each pixel has no jitter, so the first frame matches render().
+        // Returns the number of pixels that were sampled in this call, 0 means that the image has converged.
+        unsigned int renderProgressive(const std::vector<vertex> &vts,
+                                       const glm::mat4 &m,
+                                       const glm::mat4 &v,
+                                       const float fov_degrees,
+                                       unsigned int depth,
+                                       FrameBuffer <uint32_t> &fb) {
+            if (use_bvh && !m_bvh.builtFor(vts))
+                buildBVH(vts);
+            if (use_bvh)
+                updateWideBVH();
 
+            ImageKey key{m, fov_degrees, depth, fb.W, fb.H, &vts, vts.size()};
+            if (key != m_progressive_key || v != m_progressive_view || m_samples.size() != fb.W * fb.H){
+                // something changed, the samples accumulated so far are not valid anymore
+                m_progressive_key = key;
+                m_progressive_view = v;
+                m_samples.assign(fb.W * fb.H, PixelSamples());
+#ifdef RT_STATS
+                m_pixel_stats.assign(size_t(fb.W) * fb.H, RayStats());
+#endif
+            }
+
+            PrimaryRays primary(m, v, fov_degrees, fb.W, fb.H);
+            std::atomic<unsigned int> sampled(0);
+            m_scene = nullptr;
+            m_streamed = nullptr;
+            bool differentials = textured();
+
+            auto sampleTile = [&](const Tile &tile){
+                unsigned int tile_sampled = 0;
+                for (unsigned int c = tile.x0; c < tile.x1; c++){
+                    for(unsigned int r = tile.y0; r < tile.y1; r++){
+                        PixelSamples &px = m_samples[c + r * fb.W];
+                        if (!px.converged(min_samples, max_samples, convergence_threshold)){
+                            vec2 jitter = px.count == 0 ? vec2(0) : randomPixelOffset(c, r, px.count);
+                            color col;
+                            countForPixel(c + r * fb.W, [&]{
+                                RT_COUNT(primary_rays, 1);
+                                Ray ray = primary.at(c + jitter.x, r + jitter.y);
+                                RayDifferential differential = differentials ? primary.differential(ray) : RayDifferential();
+                                col = traceRay(ray, depth, vts, differentials ? &differential : nullptr);
+                            });
+                            px.add(col);
+                            tile_sampled++;
+                        }
+                        fb.paintAt(c, r, toRGBA32(px.sum / float(px.count)));
+                    }
+                }
+                sampled += tile_sampled;
+            };
+
+            forEachTile(fb.W, fb.H, sampleTile);
+            return sampled;
+        }
+
+        // Traces only the listed pixels of fb (indices c + r * fb.W) and leaves the others as they are. The rays are
+        // the ones render traces, so a pixel gets the color it would have in a full frame. If hit_dist is not null,
+        // the distance from the camera to the primary hit of each traced pixel is written to it (FLT_MAX if the ray
+        // misses). Used to render a part of the pixels per frame, see rt_dynamic_resolution.h
+        void renderPixels(const std::vector<vertex> &vts,
+                          const glm::mat4 &m,
+                          const glm::mat4 &v,
+                          const float fov_degrees,
+                          unsigned int depth,
+                          const std::vector<uint32_t> &pixels,
+                          FrameBuffer <uint32_t> &fb,
+                          FrameBuffer <float> *hit_dist = nullptr) {
+            if (use_bvh && !m_bvh.builtFor(vts))
+                buildBVH(vts);
+            if (use_bvh)
+                updateWideBVH();
+
+            PrimaryRays primary(m, v, fov_degrees, fb.W, fb.H);
+            m_scene = nullptr;
+            m_streamed = nullptr;
+#ifdef RT_STATS
+            m_pixel_stats.assign(size_t(fb.W) * fb.H, RayStats());
+#endif
+            bool differentials = textured();
+            // the pixels are scattered over the image, so they are traced one by one (no packets)
+            forEachRange(pixels.size(), [&](size_t begin, size_t end){
+                for (size_t i = begin; i < end; i++){
+                    uint32_t pixel = pixels[i];
+                    Ray ray = primary.at(pixel % fb.W, pixel / fb.W);
+                    Hit hit;
+                    color col;
+                    countForPixel(pixel, [&]{
+                        RT_COUNT(primary_rays, 1);
+                        RayDifferential differential = differentials ? primary.differential(ray) : RayDifferential();
+                        col = rayModelIntersection(ray, vts, hit) ? shade(ray, hit, depth, vts, differentials ? &differential : nullptr) : black;
+                    });
+                    fb.buffer[pixel] = toRGBA32(col);
+                    if (hit_dist) hit_dist->buffer[pixel] = hit.dist;
+                }
+            });
+        }
+
+        // Path traced version of render, for global illumination: every pixel averages samples paths (see tracePath)
+        // through jittered points of the pixel, depth is the max number of surfaces of a path. fb receives the noisy
+        // image, and gbuffer, if not null, the linear colors and the auxiliary buffers of the denoiser (see
+        // rt_denoiser.h). The random numbers depend on the pixel, the sample and seed (e.g. the frame number) only
+        void renderPathTraced(const std::vector<vertex> &vts,
+                              const glm::mat4 &m,
+                              const glm::mat4 &v,
+                              const float fov_degrees,
+                              unsigned int depth,
+                              unsigned int samples,
+                              FrameBuffer <uint32_t> &fb,
+                              GBuffer *gbuffer = nullptr,
+                              uint32_t seed = 0) {
+            if (use_bvh && !m_bvh.builtFor(vts))
+                buildBVH(vts);
+            if (use_bvh)
+                updateWideBVH();
+
+            PrimaryRays primary(m, v, fov_degrees, fb.W, fb.H);
+            m_scene = nullptr;
+            m_streamed = nullptr;
+#ifdef RT_STATS
+            m_pixel_stats.assign(size_t(fb.W) * fb.H, RayStats());
+#endif
+            if (gbuffer) gbuffer->resize(fb.W, fb.H);
+            samples = std::max(samples, 1u);
+            bool differentials = textured();
+
+            forEachTile(fb.W, fb.H, [&](const Tile &tile){
+                for (unsigned int r = tile.y0; r < tile.y1; r++)
+                    for (unsigned int c = tile.x0; c < tile.x1; c++){
+                        uint32_t pixel = c + r * fb.W;
+                        vec3 sum(0), albedo(0), normal(0);
+                        float depth_sum = 0;
+                        unsigned int hits = 0;
+                        countForPixel(pixel, [&]{
+                            for (unsigned int sample = 0; sample < samples; sample++){
+                                RT_COUNT(primary_rays, 1);
+                                PathRandom random{hash32(pixel ^ hash32(sample + 0x85ebca6bu * hash32(seed)))};
+                                vec2 jitter = randomPixelOffset(c, r, sample + seed * samples);
+                                Ray ray = primary.at(c + jitter.x, r + jitter.y);
+                                RayDifferential differential = differentials ? primary.differential(ray) : RayDifferential();
+                                PathFirstHit first;
+                                sum += vec3(tracePath(ray, depth, vts, random, differentials ? &differential : nullptr, &first));
+                                albedo += first.albedo;
+                                normal += first.normal;
+                                if (first.depth < FLT_MAX){
+                                    depth_sum += first.depth;
+                                    hits++;
+                                }
+                            }
+                        });
+                        vec3 col = sum / float(samples);
+                        fb.buffer[pixel] = toRGBA32(color(col, 1));
+                        if (gbuffer){
+                            gbuffer->color[pixel] = col;
+                            gbuffer->albedo[pixel] = albedo / float(samples);
+                            gbuffer->normal[pixel] = normal / float(samples);
+                            gbuffer->depth[pixel] = hits > 0 ? depth_sum / hits : FLT_MAX;
+                        }
+                    }
+            });
+        }
+
+        // calls job for the tiles of a W x H image on the render threads, for the passes over an image that go with
+        // a frame, e.g. the upsampling of rt_dynamic_resolution.h
+        void parallelTiles(unsigned int W, unsigned int H, const std::function<void(const Tile&)> &job){
+            forEachTile(W, H, job);
+        }
+
+        // surfaces of a path before Russian roulette can end it, see tracePath
+        unsigned int min_path_bounces = 3;
+
+        // progressive rendering parameters, see renderProgressive
+        unsigned int min_samples = 4;
+        unsigned int max_samples = 256;
+        float convergence_threshold = .5f / 255.f;
+
+
+        // the differential of the ray, if not null, selects the mip levels of the textures it hits (see textured()).
+        // surface is the number of the surface the ray can hit along its path, 1 for primary rays (statistics only)
         color traceRay(const Ray & ray,
                        unsigned int depth,
-                       const std::vector<vertex> &vts){
-            // this is here to ensure we don't end up with a long recursion that can freeze the program (or cause a stack overflow)
-            depth = depth > max_recursion ? max_recursion : depth;
-
-            color col = black; // used to output a color
+                       const std::vector<vertex> &vts,
+                       const RayDifferential *differential = nullptr,
+                       unsigned int surface = 1){
             Hit hitInfo; // used to store the hit information
-            if (!rayModelIntersection(ray, vts, hitInfo)) return col; // no hit, return black
-
+            if (!rayModelIntersection(ray, vts, hitInfo)) return black; // no hit, return black
 
-            // TODO ex 10.2 replace the current i_normal and i_col computation with their interpolated versions
-            vec3 i_normal = vts[hitInfo.hit_ID].norm * hitInfo.barycentric.x + vts[hitInfo.hit_ID+1].norm * hitInfo.barycentric.y + vts[hitInfo.hit_ID+2].norm * hitInfo.barycentric.z;
-            i_normal = normalize(i_normal);
-            color i_col = vts[hitInfo.hit_ID].col * hitInfo.barycentric.x + vts[hitInfo.hit_ID+1].col * hitInfo.barycentric.y + vts[hitInfo.hit_ID+2].col * hitInfo.barycentric.z;
+            return shade(ray, hitInfo, depth, vts, differential, surface);
+        }
 
-            vec3 i_pos = ray.origin + ray.direction * hitInfo.dist;
+        // color at the intersection hitInfo of the ray, including shadows and reflections
+        color shade(const Ray & ray,
+                    const Hit & hitInfo,
+                    unsigned int depth,
+                    const std::vector<vertex> &vts,
+                    const RayDifferential *differential = nullptr,
+                    unsigned int surface = 1){
+            // this is here to ensure we don't end up with a long recursion that can freeze the program (or cause a stack overflow)
+            depth = depth > max_recursion ? max_recursion : depth;
 
-            // TODO ex 10.3 implement the phong reflection model for the point light below
-            float ambient = 0.1f, diffuse = 0.5f, specular = 0.5f, shininess = 10;
-            vec3 light_pos(0,1.9f,0); // light position in model space
-            vec3 light_dir = normalize(light_pos - i_pos);
+            // the reflected ray gets differentials if this one has them
+            RayDifferential reflected;
+            bool reflect_differential = differential && depth > 1;
+            SurfacePoint sp = surfaceAt(ray, hitInfo, vts, differential, reflect_differential ? &reflected : nullptr);
+            RT_COUNT(hits, 1);
+            RT_PATH_DEPTH(surface);
 
-            col = ambient * i_col;
+            color col = ambientLight(sp); // used to output a color
 
             // TODO ex 10.4 check if the light source is visible from i_pos, we only use the diffuse and specular components if that is the case
-            Ray shadow_ray(i_pos + i_normal * .001f, light_dir); // i_normal * .001f is handling numerical precision issues, it prevents self-intersection
-            float light_dist = length(light_pos - i_pos);
-            Hit shadow_hit;
-            // check if there is geometry in the direction of the light, and if the closest geometry is closer than the light source
-            if (rayModelIntersection(shadow_ray, vts, shadow_hit) && light_dist < shadow_hit.dist) {
-                // the light is visible from i_pos (there is no occlusion), so we compute direct lighting
-                col += diffuse * i_col * max(dot(light_dir, i_normal), .0f) +
-                       specular * pow(max(dot(light_dir, i_normal), .0f), shininess);
+            unsigned int shadow_rays = shadowRaysPerHit();
+            for (unsigned int s = 0; s < shadow_rays; s++) {
+                float light_dist;
+                Ray shadow_ray;
+                color contribution;
+                // check if there is any geometry in the direction of the light that is closer than the light source
+                if (lightSample(sp, s, shadow_ray, light_dist, contribution) && !occluded(shadow_ray, light_dist, vts)) {
+                    // the light is visible from i_pos (there is no occlusion), so we compute direct lighting
+                    col += contribution;
+                }
             }
 
             // the recursion/reflection happens here!
             if (depth > 1) {
-                Ray reflected_ray(i_pos, reflect(ray.direction, i_normal));
-                reflected_ray.origin -= ray.direction * .001f; // this is a small offset to address numerical precision issues
                 // integrate the current color with the reflection color by a p_rg factor
-                col += p_rg * traceRay(reflected_ray, depth - 1, vts);
+                RT_COUNT(reflection_rays, 1);
+                col += p_rg * traceRay(reflectedRay(ray, sp), depth - 1, vts, reflect_differential ? &reflected : nullptr, surface + 1);
             }
 
             return col;
@@ -118,9 +1037,63 @@ namespace rt{
 
         // returns false if no intersection
         // intersection results are returned in the "hit" reference variable
-        static bool rayModelIntersection(const Ray & ray,
-                                         const std::vector<vertex> &vts,
-                                         Hit &hit){
+        bool rayModelIntersection(const Ray & ray,
+                                  const std::vector<vertex> &vts,
+                                  Hit &hit) const {
+            if (m_scene)
+                return m_scene->closestHit(ray, hit);
+            if (m_streamed)
+                return m_streamed->closestHit(ray, hit);
+            if (!use_bvh || !m_bvh.builtFor(vts))
+                return rayModelIntersectionLinear(ray, vts, hit);
+
+            if (bvh_width == 4 && m_bvh4.builtFrom(m_bvh))
+                return m_bvh4.closestHit(ray, hit);
+            if (bvh_width == 8 && m_bvh8.builtFrom(m_bvh))
+                return m_bvh8.closestHit(ray, hit);
+            return m_bvh.closestHit(ray, hit);
+        }
+
+        // returns true if the ray hits any triangle closer than t_max, it stops at the first hit that it finds
+        // (any hit query), so it is cheaper than rayModelIntersection and should be used for visibility tests
+        bool occluded(const Ray & ray,
+                      float t_max,
+                      const std::vector<vertex> &vts) const {
+            RT_COUNT(shadow_rays, 1);
+            if (m_scene)
+                return m_scene->occluded(ray, t_max);
+            if (m_streamed)
+                return m_streamed->occluded(ray, t_max);
+            if (!use_bvh || !m_bvh.builtFor(vts))
+                return occludedLinear(ray, t_max, vts);
+
+            if (bvh_width == 4 && m_bvh4.builtFrom(m_bvh))
+                return m_bvh4.occluded(ray, t_max);
+            if (bvh_width == 8 && m_bvh8.builtFrom(m_bvh))
+                return m_bvh8.occluded(ray, t_max);
+            return m_bvh.occluded(ray, t_max);
+        }
+
+        // same as occluded, but tests the ray against the triangles in the model one by one
+        static bool occludedLinear(const Ray & ray,
+                                   float t_max,
+                                   const std::vector<vertex> &vts){
+            for (size_t i = 0; i + 2 < vts.size(); i+=3)
+            {
+                RT_COUNT(triangle_tests, 1);
+                float t, u, v;
+                vec3 p1 = vts[i].pos;
+                if (rt::rayTriangleIntersection(ray, p1, vec3(vts[i+1].pos) - p1, vec3(vts[i+2].pos) - p1, t, u, v) && t < t_max)
+                    return true;
+            }
+            return false;
+        }
+
+        // same as rayModelIntersection, but tests the ray against all triangles in the model
+        static bool rayModelIntersectionLinear(const Ray & ray,
+                                               const std::vector<vertex> &vts,
+                                               Hit &hit){
+            RT_COUNT(triangle_tests, vts.size() / 3);
             for (int i = 0; i < vts.size(); i+=3)
             {
                 float dist_temp;
@@ -144,36 +1117,8 @@ namespace rt{
                                             const vertex & p3,
                                             float & t, vec3 & barycentric)
         {
-            vec3 e1 = p2.pos - p1.pos;
-            vec3 e2 = p3.pos - p1.pos;
-            vec3 q = cross(ray.direction, e2);
-            float a = dot(e1, q);
-
-            float tolerance = 10e-7f;
-            // for numerical stability, a = 0 means that triangle plane and ray are parallel
-            if (abs(a) < tolerance) return false;
-
-            float f = 1.0f / a;
-            vec3 s = ray.origin - vec3(p1.pos);
-            float u = f * dot(s, q);
-
-            // if u < 0, intersection with plane is not within the triangle
-            if (u < -tolerance) return false;
-
-            vec3 r = cross(s, e1);
-            float v = f * dot(ray.direction, r);
-
-            // if v < 0 or u+v > 1, intersection with plane is not within the triangle
-            if (v < -tolerance || u + v > 1) return false;
-
-            t = f * dot(e2, r);
-
-            if (t < 0)
-                return false;
-
-            barycentric = vec3(1.0f - u - v, u, v);
-
-            return true;
+            // the test itself is in rt_triangles.h, it is shared with the BVH traversal that uses precomputed edges
+            return rt::rayTriangleIntersection(ray, p1.pos, p2.pos - p1.pos, p3.pos - p1.pos, t, barycentric);
         }
     };
 }
@@ -0,0 +1,256 @@
+//
+// Two level acceleration structure: one BVH per mesh (bottom level) and one BVH over the instances of the
+// meshes (top level), so that a mesh used several times is stored once and moving objects don't require a rebuild
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_SCENE_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_SCENE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cassert>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+#include "rt_bvh.h"
+#include "rt_bvh_cache.h"
+#include "rt_texture.h"
+
+namespace rt{
+
+    // vertices of a mesh in its own (object) space, and the BVH built over them
+    struct Mesh{
+        std::vector<vertex> vertices;
+        BVH bvh;
+        // multiplies the vertex colors, not owned by the scene
+        const Texture *texture = nullptr;
+    };
+
+    // a mesh placed in the scene
+    struct Instance{
+        uint32_t mesh_ID;
+        glm::mat4 transform;      // object to world space
+        glm::mat4 inverse;        // world to object space, used to move the rays into the space of the mesh
+        glm::mat3 normal_matrix;  // transforms the normals of the mesh to world space
+        AABB bounds;              // world space bounds
+    };
+
+    class Scene{
+    public:
+        // adds a mesh (3 consecutive vertices per triangle) and builds its BVH, returns its ID. With a bvh_file
+        // the BVH is loaded from that file, and the file is (re)written if it is missing or stale, see rt_bvh_cache.h
+        uint32_t addMesh(std::vector<vertex> vertices, const std::string &bvh_file = ""){
+            m_meshes.push_back(Mesh{std::move(vertices), BVH(), nullptr});
+            Mesh &mesh = m_meshes.back();
+            if (bvh_file.empty())
+                mesh.bvh.build(mesh.vertices);
+            else
+                loadOrBuildBVH(bvh_file, mesh.vertices, mesh.bvh);
+            return m_meshes.size() - 1;
+        }
+
+        // texture of a mesh, looked up with the uv of its vertices, nullptr for none. The texture must stay alive as
+        // long as the scene is rendered
+        void setTexture(uint32_t mesh_ID, const Texture *texture){
+            m_meshes[mesh_ID].texture = texture && !texture->empty() ? texture : nullptr;
+        }
+
+        // true if a mesh has a texture
+        bool textured() const {
+            for (const Mesh &mesh : m_meshes)
+                if (mesh.texture) return true;
+            return false;
+        }
+
+        // places the mesh in the scene, returns the ID of the instance
+        uint32_t addInstance(uint32_t mesh_ID, const glm::mat4 &transform){
+            assert(mesh_ID < m_meshes.size());
+            m_instances.push_back(Instance{mesh_ID, glm::mat4(1), glm::mat4(1), glm::mat3(1), AABB()});
+            updateInstance(m_instances.size() - 1, transform);
+            m_rebuild = true;
+            return m_instances.size() - 1;
+        }
+
+        // moves an instance, the top level BVH is refitted on the next update()
+        void setTransform(uint32_t instance_ID, const glm::mat4 &transform){
+            updateInstance(instance_ID, transform);
+            m_refit = true;
+        }
+
+        // the vertices of a mesh can be modified in place (same number of vertices), refitMesh must be called after that
+        std::vector<vertex> &vertices(uint32_t mesh_ID) { return m_meshes[mesh_ID].vertices; }
+
+        // refits the BVH of a mesh whose vertices were modified, and the bounds of all its instances
+        void refitMesh(uint32_t mesh_ID){
+            Mesh &mesh = m_meshes[mesh_ID];
+            mesh.bvh.refit(mesh.vertices);
+            for (uint32_t i = 0; i < m_instances.size(); i++)
+                if (m_instances[i].mesh_ID == mesh_ID)
+                    updateInstance(i, m_instances[i].transform);
+            m_refit = true;
+        }
+
+        // makes the top level BVH match the instances: full build if instances were added, refit if they only moved
+        void update(){
+            if (m_rebuild)
+                buildTopLevel();
+            else if (m_refit)
+                refitNodes(m_nodes, [&](const BVHNode &leaf){
+                    AABB b;
+                    for (uint32_t i = leaf.left_first; i < leaf.left_first + leaf.count; i++)
+                        b.grow(m_instances[m_instance_IDs[i]].bounds);
+                    return b;
+                });
+            m_rebuild = m_refit = false;
+        }
+
+        // true if update() has to be called before tracing rays
+        bool needsUpdate() const { return m_rebuild || m_refit; }
+
+        const Mesh &mesh(uint32_t mesh_ID) const { return m_meshes[mesh_ID]; }
+        const Instance &instance(uint32_t instance_ID) const { return m_instances[instance_ID]; }
+        size_t meshCount() const { return m_meshes.size(); }
+        size_t instanceCount() const { return m_instances.size(); }
+        const std::vector<BVHNode> &topLevelNodes() const { return m_nodes; }
+
+        // triangles that are stored, and triangles in the scene (each instance counts its mesh again)
+        size_t storedTriangleCount() const {
+            size_t count = 0;
+            for (const Mesh &mesh : m_meshes) count += mesh.vertices.size() / 3;
+            return count;
+        }
+        size_t sceneTriangleCount() const {
+            size_t count = 0;
+            for (const Instance &instance : m_instances) count += m_meshes[instance.mesh_ID].vertices.size() / 3;
+            return count;
+        }
+
+        // closest hit in world space, hit.instance_ID is the instance that was hit and hit.hit_ID the first
+        // vertex of the triangle in the vertices of its mesh
+        bool closestHit(const Ray &ray, Hit &hit) const {
+            assert(!needsUpdate());
+            if (m_nodes.empty()) return false;
+
+            glm::vec3 inv_dir = 1.0f / ray.direction;
+            if (rayAABBIntersection(ray.origin, inv_dir, m_nodes[0].bmin, m_nodes[0].bmax, hit.dist) == FLT_MAX)
+                return hit.hit_ID >= 0;
+
+            const BVHNode *stack[BVH::max_depth];
+            int stack_ptr = 0;
+            const BVHNode *node = &m_nodes[0];
+            while (true){
+                RT_COUNT(node_visits, 1);
+                if (node->isLeaf()){
+                    for (uint32_t i = node->left_first, end = node->left_first + node->count; i < end; i++){
+                        uint32_t instance_ID = m_instance_IDs[i];
+                        const Instance &instance = m_instances[instance_ID];
+                        // the direction is not normalized, so distances in object space are the same as in world space
+                        Hit instance_hit;
+                        instance_hit.dist = hit.dist;
+                        if (m_meshes[instance.mesh_ID].bvh.closestHit(toObjectSpace(ray, instance), instance_hit)){
+                            hit = instance_hit;
+                            hit.instance_ID = (int) instance_ID;
+                        }
+                    }
+                    if (stack_ptr == 0) break;
+                    node = stack[--stack_ptr];
+                    continue;
+                }
+
+                const BVHNode *child1 = &m_nodes[node->left_first];
+                const BVHNode *child2 = &m_nodes[node->left_first + 1];
+                float dist1 = rayAABBIntersection(ray.origin, inv_dir, child1->bmin, child1->bmax, hit.dist);
+                float dist2 = rayAABBIntersection(ray.origin, inv_dir, child2->bmin, child2->bmax, hit.dist);
+                if (dist1 > dist2) { std::swap(dist1, dist2); std::swap(child1, child2); }
+
+                if (dist1 == FLT_MAX){
+                    if (stack_ptr == 0) break;
+                    node = stack[--stack_ptr];
+                }
+                else {
+                    node = child1;
+                    if (dist2 != FLT_MAX) stack[stack_ptr++] = child2;
+                }
+            }
+            return hit.hit_ID >= 0;
+        }
+
+        // any hit query in world space
+        bool occluded(const Ray &ray, float t_max) const {
+            assert(!needsUpdate());
+            if (m_nodes.empty()) return false;
+
+            glm::vec3 inv_dir = 1.0f / ray.direction;
+            const BVHNode *stack[BVH::max_depth];
+            int stack_ptr = 0;
+            stack[stack_ptr++] = &m_nodes[0];
+            while (stack_ptr > 0){
+                const BVHNode *node = stack[--stack_ptr];
+                RT_COUNT(node_visits, 1);
+                if (rayAABBIntersection(ray.origin, inv_dir, node->bmin, node->bmax, t_max) == FLT_MAX)
+                    continue;
+                if (node->isLeaf()){
+                    for (uint32_t i = node->left_first, end = node->left_first + node->count; i < end; i++){
+                        const Instance &instance = m_instances[m_instance_IDs[i]];
+                        if (m_meshes[instance.mesh_ID].bvh.occluded(toObjectSpace(ray, instance), t_max))
+                            return true;
+                    }
+                    continue;
+                }
+                stack[stack_ptr++] = &m_nodes[node->left_first + 1];
+                stack[stack_ptr++] = &m_nodes[node->left_first];
+            }
+            return false;
+        }
+
+    private:
+        std::vector<Mesh> m_meshes;
+        std::vector<Instance> m_instances;
+        // top level BVH, leaves reference ranges of m_instance_IDs
+        std::vector<BVHNode> m_nodes;
+        std::vector<uint32_t> m_instance_IDs;
+        bool m_rebuild = false, m_refit = false;
+
+        static Ray toObjectSpace(const Ray &ray, const Instance &instance){
+            return Ray(glm::vec3(instance.inverse * glm::vec4(ray.origin, 1)),
+                       glm::vec3(instance.inverse * glm::vec4(ray.direction, 0)));
+        }
+
+        void updateInstance(uint32_t instance_ID, const glm::mat4 &transform){
+            Instance &instance = m_instances[instance_ID];
+            instance.transform = transform;
+            instance.inverse = glm::inverse(transform);
+            instance.normal_matrix = glm::transpose(glm::mat3(instance.inverse));
+
+            // world bounds of the 8 corners of the mesh bounds
+            instance.bounds = AABB();
+            const Storage<BVHNode> &mesh_nodes = m_meshes[instance.mesh_ID].bvh.nodes;
+            if (mesh_nodes.empty()) return;
+            for (int corner = 0; corner < 8; corner++){
+                glm::vec3 p((corner & 1) ? mesh_nodes[0].bmax.x : mesh_nodes[0].bmin.x,
+                            (corner & 2) ? mesh_nodes[0].bmax.y : mesh_nodes[0].bmin.y,
+                            (corner & 4) ? mesh_nodes[0].bmax.z : mesh_nodes[0].bmin.z);
+                instance.bounds.grow(glm::vec3(transform * glm::vec4(p, 1)));
+            }
+        }
+
+        void buildTopLevel(){
+            // instances of empty meshes can't be hit, they are left out of the tree
+            std::vector<AABB> bounds;
+            std::vector<uint32_t> IDs;
+            for (uint32_t i = 0; i < m_instances.size(); i++)
+                if (!m_meshes[m_instances[i].mesh_ID].bvh.nodes.empty()){
+                    bounds.push_back(m_instances[i].bounds);
+                    IDs.push_back(i);
+                }
+
+            std::vector<uint32_t> order;
+            SAHBuilder(bounds, 1, BVH::max_depth).build(m_nodes, order);
+            m_instance_IDs.resize(order.size());
+            for (size_t i = 0; i < order.size(); i++)
+                m_instance_IDs[i] = IDs[order[i]];
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_SCENE_H
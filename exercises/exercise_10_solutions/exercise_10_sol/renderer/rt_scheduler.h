@@ -0,0 +1,157 @@
+//
+// Persistent thread pool that distributes the tiles of a frame between worker threads
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_SCHEDULER_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+
+namespace rt{
+
+    // rectangular region of the frame buffer, [x0, x1) x [y0, y1)
+    struct Tile{
+        unsigned int x0, y0, x1, y1;
+    };
+
+    // splits a W x H image in tiles of (at most) tile_size x tile_size pixels
+    inline std::vector<Tile> makeTiles(unsigned int W, unsigned int H, unsigned int tile_size){
+        std::vector<Tile> tiles;
+        for (unsigned int y = 0; y < H; y += tile_size)
+            for (unsigned int x = 0; x < W; x += tile_size)
+                tiles.push_back(Tile{x, y, std::min(x + tile_size, W), std::min(y + tile_size, H)});
+        return tiles;
+    }
+
+    // Each worker owns a deque of tiles, it takes work from the front of its own deque and, once that is empty,
+    // steals from the back of the deques of the other workers. Tiles are initially handed out in contiguous
+    // blocks, so that a worker that got cheap tiles (e.g. background) ends up helping with the expensive ones.
+    // The thread calling run() is worker 0, so a scheduler with thread_count == 1 does not start any thread.
+    class TileScheduler{
+    public:
+        explicit TileScheduler(unsigned int thread_count){
+            thread_count = std::max(1u, thread_count);
+            m_queues.resize(thread_count);
+            for (auto &queue : m_queues)
+                queue.reset(new WorkerQueue);
+            for (unsigned int i = 1; i < thread_count; i++)
+                m_threads.emplace_back(&TileScheduler::workerLoop, this, i);
+        }
+
+        ~TileScheduler(){
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            for (auto &thread : m_threads)
+                thread.join();
+        }
+
+        TileScheduler(const TileScheduler&) = delete;
+        void operator=(const TileScheduler&) = delete;
+
+        unsigned int threadCount() const { return m_queues.size(); }
+
+        // calls job once for every tile, returns when all tiles are done
+        void run(const std::vector<Tile> &tiles, const std::function<void(const Tile&)> &job){
+            if (tiles.empty()) return;
+
+            m_job = &job;
+            m_remaining = tiles.size();
+            unsigned int workers = m_queues.size();
+            for (unsigned int w = 0; w < workers; w++){
+                std::lock_guard<std::mutex> lock(m_queues[w]->mutex);
+                size_t begin = tiles.size() * w / workers, end = tiles.size() * (w + 1) / workers;
+                m_queues[w]->tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_generation++;
+            }
+            m_wake.notify_all();
+
+            processTiles(0);
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this]{ return m_remaining == 0; });
+        }
+
+    private:
+        struct WorkerQueue{
+            std::mutex mutex;
+            std::deque<Tile> tiles;
+        };
+
+        std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+        std::vector<std::thread> m_threads;
+        const std::function<void(const Tile&)> *m_job = nullptr;
+        std::atomic<size_t> m_remaining{0};
+
+        // used to wake up the workers when a new frame starts, and the caller of run() when it ends
+        std::mutex m_mutex;
+        std::condition_variable m_wake, m_done;
+        unsigned long m_generation = 0;
+        bool m_stop = false;
+
+        bool popTile(unsigned int worker, Tile &tile){
+            // own work first, from the front
+            {
+                WorkerQueue &own = *m_queues[worker];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.tiles.empty()){
+                    tile = own.tiles.front();
+                    own.tiles.pop_front();
+                    return true;
+                }
+            }
+            // then steal from the back of the other queues
+            for (unsigned int i = 1, n = m_queues.size(); i < n; i++){
+                WorkerQueue &victim = *m_queues[(worker + i) % n];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tiles.empty()){
+                    tile = victim.tiles.back();
+                    victim.tiles.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void processTiles(unsigned int worker){
+            Tile tile{};
+            while (popTile(worker, tile)){
+                (*m_job)(tile);
+                if (--m_remaining == 0){
+                    // lock, so that the notification can't happen between the check and the wait in run()
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_done.notify_all();
+                }
+            }
+        }
+
+        void workerLoop(unsigned int worker){
+            unsigned long seen_generation = 0;
+            while (true){
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [&]{ return m_stop || m_generation != seen_generation; });
+                    if (m_stop) return;
+                    seen_generation = m_generation;
+                }
+                processTiles(worker);
+            }
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_SCHEDULER_H
@@ -0,0 +1,169 @@
+//
+// Optional counters of the work done by the ray tracer (rays, BVH node visits, triangle tests)
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_STATS_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_STATS_H
+
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "frame_buffer.h"
+
+// The counters are only collected when RT_STATS is defined (e.g. -DRT_STATS), otherwise RT_COUNT expands to
+// nothing and the renderer does not store any per pixel data, so the instrumentation costs nothing
+#ifdef RT_STATS
+#define RT_COUNT(counter, n) (rt::threadStats().counter += (n))
+// records that a path hit its n-th surface, the depth of a pixel is the largest n of its paths
+#define RT_PATH_DEPTH(n) (rt::threadStats().depth = std::max<uint64_t>(rt::threadStats().depth, (n)))
+#else
+#define RT_COUNT(counter, n) ((void) 0)
+#define RT_PATH_DEPTH(n) ((void) 0)
+#endif
+
+namespace rt{
+
+    struct RayStats{
+        uint64_t primary_rays = 0;
+        uint64_t shadow_rays = 0;
+        uint64_t reflection_rays = 0;
+        uint64_t node_visits = 0;     // BVH nodes visited during traversal, both levels of a Scene
+        uint64_t triangle_tests = 0;  // ray/triangle intersection tests, a packet test counts once
+        uint64_t hits = 0;            // intersections that were shaded
+        uint64_t depth = 0;           // max number of surfaces hit by a path (see RT_PATH_DEPTH), 0 if all missed
+
+        RayStats &operator+=(const RayStats &o){
+            primary_rays += o.primary_rays;
+            shadow_rays += o.shadow_rays;
+            reflection_rays += o.reflection_rays;
+            node_visits += o.node_visits;
+            triangle_tests += o.triangle_tests;
+            hits += o.hits;
+            depth = std::max(depth, o.depth);
+            return *this;
+        }
+
+        // counters added since before (the depth is not a counter and is not subtracted)
+        RayStats since(const RayStats &before) const {
+            RayStats d = *this;
+            d.primary_rays -= before.primary_rays;
+            d.shadow_rays -= before.shadow_rays;
+            d.reflection_rays -= before.reflection_rays;
+            d.node_visits -= before.node_visits;
+            d.triangle_tests -= before.triangle_tests;
+            d.hits -= before.hits;
+            return d;
+        }
+
+        // part index of the counters split in parts, the remainders go to part 0
+        RayStats part(unsigned int index, unsigned int parts) const {
+            auto split = [&](uint64_t v){ return v / parts + (index == 0 ? v % parts : 0); };
+            RayStats p;
+            p.primary_rays = split(primary_rays);
+            p.shadow_rays = split(shadow_rays);
+            p.reflection_rays = split(reflection_rays);
+            p.node_visits = split(node_visits);
+            p.triangle_tests = split(triangle_tests);
+            p.hits = split(hits);
+            p.depth = depth;
+            return p;
+        }
+
+        uint64_t rays() const { return primary_rays + shadow_rays + reflection_rays; }
+    };
+
+    // counters of the calling thread, the traversal functions add to them when RT_STATS is defined
+    inline RayStats &threadStats(){
+        static thread_local RayStats stats;
+        return stats;
+    }
+
+    // values that can be shown as a heatmap
+    enum class StatField { rays, shadow_rays, reflection_rays, node_visits, triangle_tests, depth };
+
+    inline const char *statName(StatField field){
+        switch (field){
+            case StatField::rays: return "rays";
+            case StatField::shadow_rays: return "shadow_rays";
+            case StatField::reflection_rays: return "reflection_rays";
+            case StatField::node_visits: return "node_visits";
+            case StatField::triangle_tests: return "triangle_tests";
+            case StatField::depth: return "depth";
+        }
+        return "";
+    }
+
+    inline uint64_t statValue(const RayStats &stats, StatField field){
+        switch (field){
+            case StatField::rays: return stats.rays();
+            case StatField::shadow_rays: return stats.shadow_rays;
+            case StatField::reflection_rays: return stats.reflection_rays;
+            case StatField::node_visits: return stats.node_visits;
+            case StatField::triangle_tests: return stats.triangle_tests;
+            case StatField::depth: return stats.depth;
+        }
+        return 0;
+    }
+
+    // paints the value of each pixel relative to the max value, from dark blue (0) to green, yellow and red (max).
+    // pixel_stats is in frame buffer order. Returns the max value
+    inline uint64_t paintHeatmap(const std::vector<RayStats> &pixel_stats, StatField field, FrameBuffer<uint32_t> &fb){
+        uint64_t max_value = 0;
+        for (const RayStats &stats : pixel_stats)
+            max_value = std::max(max_value, statValue(stats, field));
+
+        const glm::vec3 ramp[5] = {glm::vec3(0, 0, .2f), glm::vec3(0, .3f, 1), glm::vec3(0, 1, .3f),
+                                   glm::vec3(1, 1, 0), glm::vec3(1, 0, 0)};
+        for (size_t i = 0; i < pixel_stats.size() && i < size_t(fb.W) * fb.H; i++){
+            float x = max_value == 0 ? 0 : float(statValue(pixel_stats[i], field)) / float(max_value) * 4.0f;
+            int segment = std::min(3, int(x));
+            glm::vec3 c = glm::mix(ramp[segment], ramp[segment + 1], x - segment);
+            fb.buffer[i] = uint32_t(255 * c.r) + (uint32_t(255 * c.g) << 8) + (uint32_t(255 * c.b) << 16) + (255u << 24);
+        }
+        return max_value;
+    }
+
+    // summary of a frame as JSON: totals, and mean/max per pixel of each field
+    inline void writeStatsJSON(std::ostream &out, const std::vector<RayStats> &pixel_stats, unsigned int W, unsigned int H){
+        RayStats total;
+        for (const RayStats &stats : pixel_stats) total += stats;
+        double pixels = std::max<size_t>(1, pixel_stats.size());
+        double rays = std::max<uint64_t>(1, total.rays());
+
+        out << "{\n"
+            << "  \"width\": " << W << ",\n"
+            << "  \"height\": " << H << ",\n"
+            << "  \"total\": {\"primary_rays\": " << total.primary_rays
+            << ", \"shadow_rays\": " << total.shadow_rays
+            << ", \"reflection_rays\": " << total.reflection_rays
+            << ", \"node_visits\": " << total.node_visits
+            << ", \"triangle_tests\": " << total.triangle_tests
+            << ", \"max_depth\": " << total.depth << "},\n"
+            << "  \"per_ray\": {\"node_visits\": " << total.node_visits / rays
+            << ", \"triangle_tests\": " << total.triangle_tests / rays << "},\n"
+            << "  \"per_pixel\": {";
+        const StatField fields[] = {StatField::rays, StatField::shadow_rays, StatField::reflection_rays,
+                                    StatField::node_visits, StatField::triangle_tests, StatField::depth};
+        for (StatField field : fields){
+            uint64_t sum = 0, max_value = 0;
+            for (const RayStats &stats : pixel_stats){
+                sum += statValue(stats, field);
+                max_value = std::max(max_value, statValue(stats, field));
+            }
+            out << (field == fields[0] ? "\n" : ",\n") << "    \"" << statName(field) << "\": {\"mean\": "
+                << sum / pixels << ", \"max\": " << max_value << "}";
+        }
+
+        // how many pixels reached each depth, 0 are the pixels whose primary ray missed everything
+        std::vector<uint64_t> depth_histogram(total.depth + 1, 0);
+        for (const RayStats &stats : pixel_stats) depth_histogram[stats.depth]++;
+        out << "\n  },\n  \"depth_histogram\": [";
+        for (size_t d = 0; d < depth_histogram.size(); d++)
+            out << (d ? ", " : "") << depth_histogram[d];
+        out << "]\n}\n";
+    }
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_STATS_H
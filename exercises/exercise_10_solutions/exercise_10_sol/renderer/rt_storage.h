@@ -0,0 +1,85 @@
+//
+// Array storage of the acceleration structures, either owned or mapped from a file
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_STORAGE_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_STORAGE_H
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+namespace rt{
+
+    // Array that either owns its elements (a std::vector) or refers to elements owned by something else, e.g. a
+    // file that BVHCache mapped in memory. Element access is the same in both cases, so the traversal does not
+    // know where the data comes from. Mapped elements are writable (the mapping is copy-on-write), which lets a
+    // loaded BVH be refitted. Copies always own their elements, moves keep referring to the same memory.
+    template <typename T>
+    class Storage{
+    public:
+        Storage() = default;
+
+        Storage(const Storage &o){ *this = o; }
+
+        Storage(Storage &&o) noexcept { *this = std::move(o); }
+
+        Storage &operator=(const Storage &o){
+            if (this != &o)
+                assign(std::vector<T>(o.begin(), o.end()));
+            return *this;
+        }
+
+        Storage &operator=(Storage &&o) noexcept {
+            if (this != &o){
+                // moving a vector keeps its buffer, so m_data stays valid
+                m_owned = std::move(o.m_owned);
+                m_mapping = std::move(o.m_mapping);
+                m_data = o.m_data;
+                m_size = o.m_size;
+                o.m_data = nullptr;
+                o.m_size = 0;
+            }
+            return *this;
+        }
+
+        // takes the elements
+        void assign(std::vector<T> &&elements){
+            m_owned = std::move(elements);
+            m_mapping.reset();
+            m_data = m_owned.data();
+            m_size = m_owned.size();
+        }
+
+        // refers to size elements at data, mapping keeps the memory alive as long as the storage uses it
+        void view(T *data, size_t size, std::shared_ptr<void> mapping){
+            m_owned.clear();
+            m_owned.shrink_to_fit();
+            m_mapping = std::move(mapping);
+            m_data = data;
+            m_size = size;
+        }
+
+        // true if the elements are not owned by the storage
+        bool mapped() const { return m_mapping != nullptr; }
+
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        T *data() { return m_data; }
+        const T *data() const { return m_data; }
+        T &operator[](size_t i) { return m_data[i]; }
+        const T &operator[](size_t i) const { return m_data[i]; }
+        T *begin() { return m_data; }
+        T *end() { return m_data + m_size; }
+        const T *begin() const { return m_data; }
+        const T *end() const { return m_data + m_size; }
+
+    private:
+        std::vector<T> m_owned;
+        std::shared_ptr<void> m_mapping;
+        T *m_data = nullptr;
+        size_t m_size = 0;
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_STORAGE_H
@@ -0,0 +1,500 @@
+//
+// Out-of-core meshes: the triangles and the BVH live in a file, split in pages that are mapped in memory when rays
+// reach them and unmapped again when the page cache exceeds its budget
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_STREAMING_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_STREAMING_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+#include "rt_bvh.h"
+#include "rt_bvh_cache.h"
+#include "rt_stats.h"
+
+namespace rt{
+
+    // File layout, in the byte order of the machine that wrote it:
+    //   StreamedFileHeader | top level nodes (BVHNode x top_node_count) | page table (StreamedPage x page_count)
+    //   | page 0 | page 1 | ...
+    // The BVH of the whole mesh is cut into subtrees of at most page_triangles triangles. Each subtree, with its
+    // triangles and their vertices, is a page, so a page holds triangles that are close to each other. The nodes
+    // above the cut form the top level tree, whose leaves reference one page each. The header, the top level tree
+    // and the page table are small and always in memory, the pages are mapped on demand.
+    struct StreamedFileHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t node_size;         // sizeof(BVHNode)
+        uint64_t file_size;
+        uint64_t tri_count;
+        uint64_t page_count;
+        uint64_t top_node_count;
+        uint64_t top_nodes_offset;
+        uint64_t page_table_offset;
+    };
+
+    // page table entry. The triangles of the whole mesh are numbered in file order, page p holds the triangles
+    // [first_triangle, first_triangle + tri_count), and hit.hit_ID is 3 times that number
+    struct StreamedPage{
+        uint64_t offset;            // multiple of MappedFile::offset_alignment, so that the page can be mapped alone
+        uint64_t size;
+        uint32_t first_triangle;
+        uint32_t tri_count;
+        uint32_t node_count;
+        uint32_t padding;
+    };
+
+    // sections of a page, offsets from the start of the page:
+    //   nodes (BVHNode x node_count) | hit IDs (uint32_t x tri_count) | triangles (TriangleStore) | vertices (3 per triangle)
+    // the nodes of a page reference its triangles with local indices
+    struct StreamedPageLayout{
+        uint64_t nodes, hit_IDs, triangles, vertices, size;
+
+        StreamedPageLayout(uint64_t node_count, uint64_t tri_count){
+            auto align = [](uint64_t offset){ return (offset + 63) / 64 * 64; };
+            nodes = 0;
+            hit_IDs = align(node_count * sizeof(BVHNode));
+            triangles = align(hit_IDs + tri_count * sizeof(uint32_t));
+            vertices = align(triangles + 9 * ((tri_count + 7) / 8 * 8) * sizeof(float));
+            size = vertices + 3 * tri_count * sizeof(vertex);
+        }
+    };
+
+    const char streamed_file_magic[8] = {'R', 'T', 'S', 'T', 'R', 'E', 'A', 'M'};
+    const uint32_t streamed_file_version = 1;
+
+    // Converts a mesh (3 consecutive vertices per triangle) to the file format above. The conversion itself needs
+    // the mesh and its BVH in memory, it is done once, rendering the file does not. page_triangles trades the
+    // granularity of the cache against the number of pages: smaller pages waste less of the budget on triangles
+    // that no ray hits, larger pages mean fewer mappings
+    inline bool writeStreamedMesh(const std::string &path, const std::vector<vertex> &vts, uint32_t page_triangles = 4096){
+        // hit IDs are ints
+        if (vts.size() / 3 >= uint64_t(INT32_MAX) / 3 || page_triangles == 0) return false;
+        BVH bvh;
+        bvh.build(vts);
+        const Storage<BVHNode> &nodes = bvh.nodes;
+
+        // the triangles of a subtree are a contiguous range of tri_IDs, children are stored after their parents
+        std::vector<uint32_t> range_first(nodes.size()), range_count(nodes.size());
+        for (size_t n = nodes.size(); n-- > 0;){
+            if (nodes[n].isLeaf()){
+                range_first[n] = nodes[n].left_first;
+                range_count[n] = nodes[n].count;
+            }
+            else {
+                range_first[n] = range_first[nodes[n].left_first];
+                range_count[n] = range_count[nodes[n].left_first] + range_count[nodes[n].left_first + 1];
+            }
+        }
+        auto isPage = [&](uint32_t n){ return nodes[n].isLeaf() || range_count[n] <= page_triangles; };
+
+        // copies the subtree under root with its own numbering, cut(n) decides where the copy stops, and
+        // leaf(n, copy) fills the copy of a node where it stopped (or of a leaf)
+        auto copySubtree = [&](uint32_t root, const std::function<bool(uint32_t)> &cut,
+                               const std::function<void(uint32_t, BVHNode &)> &leaf){
+            std::vector<BVHNode> copy(1);
+            std::vector<std::pair<uint32_t, uint32_t>> stack = {{root, 0}};
+            while (!stack.empty()){
+                uint32_t n = stack.back().first, c = stack.back().second;
+                stack.pop_back();
+                copy[c].bmin = nodes[n].bmin;
+                copy[c].bmax = nodes[n].bmax;
+                if (cut(n)){
+                    leaf(n, copy[c]);
+                    continue;
+                }
+                uint32_t children = copy.size();
+                copy.resize(children + 2);
+                copy[c].left_first = children;
+                copy[c].count = 0;
+                // right first, so that the left subtree is copied (and its pages numbered) first
+                stack.push_back({nodes[n].left_first + 1, children + 1});
+                stack.push_back({nodes[n].left_first, children});
+            }
+            return copy;
+        };
+
+        std::vector<uint32_t> page_roots;
+        std::vector<BVHNode> top_nodes;
+        if (!nodes.empty())
+            top_nodes = copySubtree(0, isPage, [&](uint32_t n, BVHNode &copy){
+                copy.left_first = page_roots.size();
+                copy.count = 1;
+                page_roots.push_back(n);
+            });
+
+        StreamedFileHeader header = {};
+        std::memcpy(header.magic, streamed_file_magic, sizeof(streamed_file_magic));
+        header.version = streamed_file_version;
+        header.node_size = sizeof(BVHNode);
+        header.tri_count = vts.size() / 3;
+        header.page_count = page_roots.size();
+        header.top_node_count = top_nodes.size();
+        header.top_nodes_offset = (sizeof(header) + 63) / 64 * 64;
+        header.page_table_offset = header.top_nodes_offset + top_nodes.size() * sizeof(BVHNode);
+
+        auto alignPage = [](uint64_t offset){
+            return (offset + MappedFile::offset_alignment - 1) / MappedFile::offset_alignment * MappedFile::offset_alignment;
+        };
+        std::vector<StreamedPage> pages(page_roots.size());
+        uint64_t offset = alignPage(header.page_table_offset + pages.size() * sizeof(StreamedPage));
+        std::vector<std::vector<BVHNode>> page_nodes(pages.size());
+        for (size_t p = 0; p < pages.size(); p++){
+            uint32_t root = page_roots[p];
+            page_nodes[p] = copySubtree(root, [&](uint32_t n){ return nodes[n].isLeaf(); }, [&](uint32_t n, BVHNode &copy){
+                copy.left_first = nodes[n].left_first - range_first[root];
+                copy.count = nodes[n].count;
+            });
+            pages[p] = StreamedPage{offset, StreamedPageLayout(page_nodes[p].size(), range_count[root]).size,
+                                    range_first[root], range_count[root], (uint32_t) page_nodes[p].size(), 0};
+            offset = alignPage(offset + pages[p].size);
+        }
+        header.file_size = pages.empty() ? header.page_table_offset : pages.back().offset + pages.back().size;
+
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream file(temp_path, std::ios::binary);
+            if (!file) return false;
+            auto section = [&](uint64_t at, const void *data, uint64_t bytes){
+                static const char zeros[MappedFile::offset_alignment] = {};
+                file.write(zeros, std::streamsize(at - uint64_t(file.tellp())));
+                file.write(static_cast<const char*>(data), std::streamsize(bytes));
+            };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            section(header.top_nodes_offset, top_nodes.data(), top_nodes.size() * sizeof(BVHNode));
+            section(header.page_table_offset, pages.data(), pages.size() * sizeof(StreamedPage));
+
+            for (size_t p = 0; p < pages.size(); p++){
+                const StreamedPage &page = pages[p];
+                StreamedPageLayout layout(page.node_count, page.tri_count);
+                std::vector<uint32_t> order(page.tri_count), hit_IDs(page.tri_count);
+                std::vector<vertex> page_vertices;
+                page_vertices.reserve(3 * page.tri_count);
+                for (uint32_t i = 0; i < page.tri_count; i++){
+                    order[i] = bvh.tri_IDs[page.first_triangle + i];
+                    hit_IDs[i] = 3 * (page.first_triangle + i);
+                    page_vertices.insert(page_vertices.end(), vts.begin() + order[i], vts.begin() + order[i] + 3);
+                }
+                Storage<uint32_t> order_storage;
+                order_storage.assign(std::move(order));
+                TriangleStore triangles;
+                triangles.build(vts, order_storage);
+
+                section(page.offset + layout.nodes, page_nodes[p].data(), page_nodes[p].size() * sizeof(BVHNode));
+                section(page.offset + layout.hit_IDs, hit_IDs.data(), hit_IDs.size() * sizeof(uint32_t));
+                section(page.offset + layout.triangles, triangles.data(), triangles.dataSize() * sizeof(float));
+                section(page.offset + layout.vertices, page_vertices.data(), page_vertices.size() * sizeof(vertex));
+            }
+            if (!file) { file.close(); std::remove(temp_path.c_str()); return false; }
+        }
+        std::remove(path.c_str());
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0){
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // A mesh written by writeStreamedMesh, traced without loading it: the pages that rays reach are mapped, and the
+    // least recently used pages are unmapped when the mapped pages take more than the cache budget. A page stays
+    // mapped while a ray traverses it, so with T render threads the mapped size can exceed the budget by at most
+    // T pages. The queries are thread safe
+    class StreamedMesh{
+    public:
+        // counters of the page cache
+        struct CacheStats{
+            uint64_t loads = 0;          // pages mapped, including pages that were mapped again after an eviction
+            uint64_t evictions = 0;
+            uint64_t resident_bytes = 0;
+            uint64_t peak_resident_bytes = 0;
+        };
+
+        // reads the header, the top level tree and the page table, returns false if the file is missing or invalid
+        bool open(const std::string &path, uint64_t cache_budget_bytes){
+            std::lock_guard<std::mutex> lock(m_mutex);
+            close();
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file) return false;
+            uint64_t file_size = uint64_t(file.tellg());
+            file.seekg(0);
+            if (file_size < sizeof(StreamedFileHeader) || !file.read(reinterpret_cast<char*>(&m_header), sizeof(m_header)))
+                return false;
+            if (std::memcmp(m_header.magic, streamed_file_magic, sizeof(streamed_file_magic)) != 0 ||
+                m_header.version != streamed_file_version || m_header.node_size != sizeof(BVHNode) ||
+                m_header.file_size != file_size ||
+                m_header.top_nodes_offset + m_header.top_node_count * sizeof(BVHNode) > file_size ||
+                m_header.page_table_offset + m_header.page_count * sizeof(StreamedPage) > file_size)
+                return false;
+
+            m_top_nodes.resize(m_header.top_node_count);
+            m_pages.resize(m_header.page_count);
+            file.seekg(std::streamoff(m_header.top_nodes_offset));
+            file.read(reinterpret_cast<char*>(m_top_nodes.data()), std::streamsize(m_top_nodes.size() * sizeof(BVHNode)));
+            file.seekg(std::streamoff(m_header.page_table_offset));
+            file.read(reinterpret_cast<char*>(m_pages.data()), std::streamsize(m_pages.size() * sizeof(StreamedPage)));
+            if (!file || !validNodes(m_top_nodes.data(), m_top_nodes.size(), m_pages.size()))
+                return false;
+
+            // the pages must cover the triangles in order, and be inside the file
+            uint64_t next_triangle = 0;
+            for (const StreamedPage &page : m_pages){
+                if (page.first_triangle != next_triangle || page.offset % MappedFile::offset_alignment != 0 ||
+                    page.size != StreamedPageLayout(page.node_count, page.tri_count).size ||
+                    page.offset > file_size || page.size > file_size - page.offset)
+                    return false;
+                next_triangle += page.tri_count;
+            }
+            if (next_triangle != m_header.tri_count) return false;
+
+            m_path = path;
+            m_budget = cache_budget_bytes;
+            m_resident.reset(new Resident[m_pages.size()]);
+            return true;
+        }
+
+        // pages are evicted until the mapped pages fit in the budget
+        void setCacheBudget(uint64_t bytes){
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_budget = bytes;
+            evict(UINT32_MAX);
+        }
+
+        size_t triangleCount() const { return m_header.tri_count; }
+        size_t pageCount() const { return m_pages.size(); }
+        // memory that is always used: the top level tree and the page table
+        size_t residentIndexBytes() const {
+            return m_top_nodes.size() * sizeof(BVHNode) + m_pages.size() * sizeof(StreamedPage);
+        }
+
+        CacheStats cacheStats() const {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+
+        // closest hit, hit.hit_ID is 3 times the number of the triangle in file order (see triangle())
+        bool closestHit(const Ray &ray, Hit &hit) const {
+            if (m_top_nodes.empty()) return false;
+
+            glm::vec3 inv_dir = 1.0f / ray.direction;
+            if (rayAABBIntersection(ray.origin, inv_dir, m_top_nodes[0].bmin, m_top_nodes[0].bmax, hit.dist) == FLT_MAX)
+                return hit.hit_ID >= 0;
+
+            // the entry distance is kept with every pushed node, a node that is behind the closest hit found since
+            // it was pushed is skipped without mapping its page
+            struct Entry{
+                const BVHNode *node;
+                float dist;
+            };
+            Entry stack[BVH::max_depth];
+            int stack_ptr = 0;
+            auto pop = [&](const BVHNode *&next){
+                while (stack_ptr > 0){
+                    const Entry &entry = stack[--stack_ptr];
+                    if (entry.dist < hit.dist){
+                        next = entry.node;
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            const BVHNode *node = &m_top_nodes[0];
+            while (true){
+                RT_COUNT(node_visits, 1);
+                if (node->isLeaf()){
+                    // the page is unpinned at the end of this block, before the next one is mapped
+                    std::shared_ptr<const Page> page = acquire(node->left_first);
+                    if (page) page->bvh.closestHit(ray, hit);
+                    if (!pop(node)) break;
+                    continue;
+                }
+
+                const BVHNode *child1 = &m_top_nodes[node->left_first];
+                const BVHNode *child2 = &m_top_nodes[node->left_first + 1];
+                float dist1 = rayAABBIntersection(ray.origin, inv_dir, child1->bmin, child1->bmax, hit.dist);
+                float dist2 = rayAABBIntersection(ray.origin, inv_dir, child2->bmin, child2->bmax, hit.dist);
+                if (dist1 > dist2) { std::swap(dist1, dist2); std::swap(child1, child2); }
+
+                if (dist1 == FLT_MAX){
+                    if (!pop(node)) break;
+                }
+                else {
+                    node = child1;
+                    if (dist2 != FLT_MAX) stack[stack_ptr++] = Entry{child2, dist2};
+                }
+            }
+            return hit.hit_ID >= 0;
+        }
+
+        // any hit query
+        bool occluded(const Ray &ray, float t_max) const {
+            if (m_top_nodes.empty()) return false;
+
+            glm::vec3 inv_dir = 1.0f / ray.direction;
+            const BVHNode *stack[BVH::max_depth];
+            int stack_ptr = 0;
+            stack[stack_ptr++] = &m_top_nodes[0];
+            while (stack_ptr > 0){
+                const BVHNode *node = stack[--stack_ptr];
+                RT_COUNT(node_visits, 1);
+                if (rayAABBIntersection(ray.origin, inv_dir, node->bmin, node->bmax, t_max) == FLT_MAX)
+                    continue;
+                if (node->isLeaf()){
+                    std::shared_ptr<const Page> page = acquire(node->left_first);
+                    if (page && page->bvh.occluded(ray, t_max))
+                        return true;
+                    continue;
+                }
+                stack[stack_ptr++] = &m_top_nodes[node->left_first + 1];
+                stack[stack_ptr++] = &m_top_nodes[node->left_first];
+            }
+            return false;
+        }
+
+        // copies the vertices of the triangle that was hit, mapping its page if it was evicted in the meantime
+        void triangle(int hit_ID, vertex tri[3]) const {
+            uint32_t number = uint32_t(hit_ID) / 3;
+            auto after = std::upper_bound(m_pages.begin(), m_pages.end(), number,
+                                          [](uint32_t n, const StreamedPage &page){ return n < page.first_triangle; });
+            uint32_t page_ID = uint32_t(after - m_pages.begin()) - 1;
+            std::shared_ptr<const Page> page = acquire(page_ID);
+            if (!page) {
+                tri[0] = tri[1] = tri[2] = vertex{};
+                return;
+            }
+            const vertex *v = page->vertices + 3 * (number - m_pages[page_ID].first_triangle);
+            tri[0] = v[0];
+            tri[1] = v[1];
+            tri[2] = v[2];
+        }
+
+    private:
+        // a mapped page. Its BVH uses the page memory in place (see Storage), with the hit IDs as tri_IDs
+        struct Page{
+            BVH bvh;
+            const vertex *vertices = nullptr;
+        };
+
+        // the cache entry of a page, page is null while the page is not mapped. page is read without locking
+        // (std::atomic_load) and only changed with m_mutex locked. last_use is a value of m_clock, the page with the
+        // smallest one is the least recently used
+        struct Resident{
+            std::shared_ptr<const Page> page;
+            std::atomic<uint64_t> last_use{0};
+        };
+
+        std::string m_path;
+        StreamedFileHeader m_header = {};
+        std::vector<BVHNode> m_top_nodes;
+        std::vector<StreamedPage> m_pages;
+
+        mutable std::mutex m_mutex;
+        std::unique_ptr<Resident[]> m_resident;
+        mutable std::atomic<uint64_t> m_clock{0};
+        // mapped pages, in no particular order
+        mutable std::vector<uint32_t> m_mapped;
+        mutable CacheStats m_stats;
+        uint64_t m_budget = 0;
+
+        // forgets the current file, pages that are still pinned by a query stay mapped until it ends
+        void close(){
+            m_path.clear();
+            m_header = StreamedFileHeader{};
+            m_top_nodes.clear();
+            m_pages.clear();
+            m_resident.reset();
+            m_mapped.clear();
+            m_stats = CacheStats();
+        }
+
+        // the page, mapped if needed. Holding the returned pointer keeps the page mapped (pinned). nullptr if the
+        // page can't be mapped, it is then treated as empty.
+        // A page that is mapped is returned without locking. Otherwise it is mapped and validated without locking
+        // either, so that the threads whose pages are mapped don't wait for the disk, and only added to the cache
+        // with m_mutex locked. If another thread mapped it in the meantime, its mapping is used
+        std::shared_ptr<const Page> acquire(uint32_t page_ID) const {
+            Resident &resident = m_resident[page_ID];
+            resident.last_use.store(m_clock++, std::memory_order_relaxed);
+            std::shared_ptr<const Page> page = std::atomic_load(&resident.page);
+            if (page) return page;
+
+            std::shared_ptr<const Page> mapped = map(m_pages[page_ID]);
+            if (!mapped) return nullptr;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            page = std::atomic_load(&resident.page);
+            if (page) return page;
+            std::atomic_store(&resident.page, mapped);
+            m_mapped.push_back(page_ID);
+            m_stats.loads++;
+            m_stats.resident_bytes += m_pages[page_ID].size;
+            evict(page_ID);
+            m_stats.peak_resident_bytes = std::max(m_stats.peak_resident_bytes, m_stats.resident_bytes);
+            return mapped;
+        }
+
+        // maps a page and checks that its nodes and hit IDs stay inside of it, nullptr if it can't be mapped or
+        // is invalid
+        std::shared_ptr<const Page> map(const StreamedPage &entry) const {
+            std::shared_ptr<MappedFile> file = MappedFile::open(m_path, entry.offset, entry.size);
+            if (!file) return nullptr;
+            StreamedPageLayout layout(entry.node_count, entry.tri_count);
+            BVHNode *nodes = reinterpret_cast<BVHNode*>(file->data() + layout.nodes);
+            if (!validNodes(nodes, entry.node_count, entry.tri_count)) return nullptr;
+            // the hit IDs are 3 times the numbers of the triangles of the page, triangle() uses them as indices
+            // of its vertices
+            uint32_t *hit_IDs = reinterpret_cast<uint32_t*>(file->data() + layout.hit_IDs);
+            uint64_t first_ID = 3 * uint64_t(entry.first_triangle), end_ID = first_ID + 3 * uint64_t(entry.tri_count);
+            for (uint32_t i = 0; i < entry.tri_count; i++)
+                if (hit_IDs[i] < first_ID || hit_IDs[i] >= end_ID || hit_IDs[i] % 3 != 0 || hit_IDs[i] > uint32_t(INT32_MAX))
+                    return nullptr;
+
+            std::shared_ptr<Page> page = std::make_shared<Page>();
+            page->bvh.nodes.view(nodes, entry.node_count, file);
+            page->bvh.tri_IDs.view(hit_IDs, entry.tri_count, file);
+            page->bvh.triangles.view(reinterpret_cast<float*>(file->data() + layout.triangles), entry.tri_count, file);
+            page->vertices = reinterpret_cast<const vertex*>(file->data() + layout.vertices);
+            return page;
+        }
+
+        // unmaps the least recently used pages that are not pinned until the mapped pages fit in the budget,
+        // keep is the page that is being acquired. Called with m_mutex locked
+        void evict(uint32_t keep) const {
+            if (m_stats.resident_bytes <= m_budget) return;
+            std::sort(m_mapped.begin(), m_mapped.end(), [&](uint32_t a, uint32_t b){
+                return m_resident[a].last_use.load(std::memory_order_relaxed) <
+                       m_resident[b].last_use.load(std::memory_order_relaxed);
+            });
+            size_t kept = 0;
+            for (size_t i = 0; i < m_mapped.size(); i++){
+                uint32_t page_ID = m_mapped[i];
+                Resident &resident = m_resident[page_ID];
+                // a page that a query holds (more references than the cache and the copy here) stays mapped. A
+                // query that gets the page while it is unmapped here keeps its own reference, the page is unmapped
+                // once that query ends
+                if (m_stats.resident_bytes <= m_budget || page_ID == keep ||
+                    std::atomic_load(&resident.page).use_count() > 2){
+                    m_mapped[kept++] = page_ID;
+                    continue;
+                }
+                std::atomic_store(&resident.page, std::shared_ptr<const Page>());
+                m_stats.resident_bytes -= m_pages[page_ID].size;
+                m_stats.evictions++;
+            }
+            m_mapped.resize(kept);
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_STREAMING_H
@@ -0,0 +1,152 @@
+//
+// Mip-mapped textures for the ray tracer, stored in blocks of 4x4 texels
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_TEXTURE_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_TEXTURE_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+
+namespace rt{
+
+    // A texture with all its mip levels. The RGBA8 texels of every level are stored in blocks of 4x4 texels, 64
+    // bytes aligned to a cache line, the blocks in row order and the texels of a block in Morton (Z) order. The 2x2 texels
+    // of a bilinear lookup are in the same block 9 times out of 16 and in two neighbouring blocks most of the other
+    // times, and the lookups of neighbouring rays hit the same lines, while a row order image has the rows of the
+    // lookup a whole image row apart. Texture coordinates wrap around (repeat), v = 0 is row 0.
+    class Texture{
+    public:
+        Texture() = default;
+
+        // W x H texels, 4 bytes (RGBA) each, row 0 first
+        Texture(unsigned int W, unsigned int H, const uint8_t *rgba){
+            build(W, H, rgba);
+        }
+
+        void build(unsigned int W, unsigned int H, const uint8_t *rgba){
+            m_levels.clear();
+            m_blocks.clear();
+            if (W == 0 || H == 0) return;
+
+            // level 0 in row order, every level is the 2x2 box filter of the one above it
+            std::vector<uint32_t> level(size_t(W) * H);
+            for (size_t i = 0; i < level.size(); i++)
+                level[i] = uint32_t(rgba[4 * i]) | uint32_t(rgba[4 * i + 1]) << 8 |
+                           uint32_t(rgba[4 * i + 2]) << 16 | uint32_t(rgba[4 * i + 3]) << 24;
+            while (true){
+                addLevel(W, H, level);
+                if (W == 1 && H == 1) break;
+                unsigned int w = std::max(1u, W / 2), h = std::max(1u, H / 2);
+                std::vector<uint32_t> next(size_t(w) * h);
+                for (unsigned int y = 0; y < h; y++)
+                    for (unsigned int x = 0; x < w; x++){
+                        unsigned int x0 = std::min(2 * x, W - 1), x1 = std::min(2 * x + 1, W - 1);
+                        unsigned int y0 = std::min(2 * y, H - 1), y1 = std::min(2 * y + 1, H - 1);
+                        uint32_t sum[4] = {2, 2, 2, 2}; // rounds to nearest
+                        for (uint32_t texel : {level[x0 + y0 * W], level[x1 + y0 * W], level[x0 + y1 * W], level[x1 + y1 * W]})
+                            for (int c = 0; c < 4; c++)
+                                sum[c] += (texel >> (8 * c)) & 0xff;
+                        next[x + y * w] = sum[0] / 4 | (sum[1] / 4) << 8 | (sum[2] / 4) << 16 | (sum[3] / 4) << 24;
+                    }
+                level.swap(next);
+                W = w;
+                H = h;
+            }
+        }
+
+        bool empty() const { return m_levels.empty(); }
+        unsigned int width() const { return m_levels.empty() ? 0 : m_levels[0].W; }
+        unsigned int height() const { return m_levels.empty() ? 0 : m_levels[0].H; }
+        unsigned int levelCount() const { return unsigned(m_levels.size()); }
+        size_t bytes() const { return m_blocks.size() * sizeof(Block); }
+
+        // Trilinear lookup at uv, the mip level is chosen so that the texels are about the size of the footprint,
+        // given by how much uv changes from one pixel to the next (duv_dx, duv_dy, see RayDifferential). A zero
+        // footprint samples level 0 bilinearly
+        Colors::color sample(glm::vec2 uv, glm::vec2 duv_dx, glm::vec2 duv_dy) const {
+            if (m_levels.empty()) return Colors::white;
+            glm::vec2 size(m_levels[0].W, m_levels[0].H);
+            float footprint = std::max(glm::dot(duv_dx * size, duv_dx * size), glm::dot(duv_dy * size, duv_dy * size));
+            // log2 of the footprint in texels of level 0 (the square root is taken inside the log)
+            float lod = footprint > 1.0f ? .5f * std::log2(footprint) : 0.0f;
+            lod = std::min(lod, float(m_levels.size() - 1));
+            unsigned int level = unsigned(lod);
+            float t = lod - level;
+            float sum[4] = {0, 0, 0, 0};
+            if (t > 1.0f / 256.0f) {
+                bilinear(m_levels[level], uv, 1.0f - t, sum);
+                bilinear(m_levels[level + 1], uv, t, sum);
+            }
+            else
+                bilinear(m_levels[level], uv, 1.0f, sum);
+            return Colors::color(sum[0], sum[1], sum[2], sum[3]) * (1.0f / 255.0f);
+        }
+
+        // texel (x, y) of a level, for tests and tools
+        uint32_t texel(unsigned int level, unsigned int x, unsigned int y) const {
+            return texels()[m_levels[level].offset + blockIndex(m_levels[level], x, y)];
+        }
+
+    private:
+        struct Level{
+            unsigned int W, H;
+            unsigned int blocks_x;  // blocks per row of blocks
+            size_t offset;          // of the first texel of the level in texels()
+        };
+        std::vector<Level> m_levels;
+        struct alignas(64) Block{
+            uint32_t texels[16];
+        };
+        // the blocks of all levels, one level after the other
+        std::vector<Block> m_blocks;
+
+        const uint32_t *texels() const { return reinterpret_cast<const uint32_t*>(m_blocks.data()); }
+
+        // position of texel (x, y) in its level: its block, then the texel in Morton order (x0 y0 x1 y1)
+        static size_t blockIndex(const Level &level, unsigned int x, unsigned int y){
+            unsigned int morton = (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+            return (size_t(y >> 2) * level.blocks_x + (x >> 2)) * 16 + morton;
+        }
+
+        void addLevel(unsigned int W, unsigned int H, const std::vector<uint32_t> &texels){
+            Level level{W, H, (W + 3) / 4, m_blocks.size() * 16};
+            m_blocks.resize(m_blocks.size() + size_t(level.blocks_x) * ((H + 3) / 4), Block{});
+            uint32_t *blocks = reinterpret_cast<uint32_t*>(m_blocks.data());
+            for (unsigned int y = 0; y < H; y++)
+                for (unsigned int x = 0; x < W; x++)
+                    blocks[level.offset + blockIndex(level, x, y)] = texels[x + size_t(y) * W];
+            m_levels.push_back(level);
+        }
+
+        // adds weight times the bilinear lookup at uv in one level to sum (RGBA, 0 to 255), texel centers are at
+        // (i + .5) / size
+        void bilinear(const Level &level, glm::vec2 uv, float weight, float sum[4]) const {
+            float x = uv.x * level.W - .5f, y = uv.y * level.H - .5f;
+            float fx = std::floor(x), fy = std::floor(y);
+            float tx = x - fx, ty = y - fy;
+            unsigned int x0 = wrap(fx, level.W), y0 = wrap(fy, level.H);
+            unsigned int x1 = x0 + 1 < level.W ? x0 + 1 : 0, y1 = y0 + 1 < level.H ? y0 + 1 : 0;
+            const uint32_t *texels = this->texels() + level.offset;
+            const uint32_t corners[4] = {texels[blockIndex(level, x0, y0)], texels[blockIndex(level, x1, y0)],
+                                         texels[blockIndex(level, x0, y1)], texels[blockIndex(level, x1, y1)]};
+            const float weights[4] = {(1 - tx) * (1 - ty) * weight, tx * (1 - ty) * weight,
+                                      (1 - tx) * ty * weight, tx * ty * weight};
+            for (int i = 0; i < 4; i++)
+                for (int c = 0; c < 4; c++)
+                    sum[c] += weights[i] * float((corners[i] >> (8 * c)) & 0xff);
+        }
+
+        // integer coordinate wrapped to [0, size), coordinates far outside of the texture lose precision anyway
+        static unsigned int wrap(float coordinate, unsigned int size){
+            int i = int(std::max(-1e9f, std::min(coordinate, 1e9f))) % int(size);
+            return unsigned(i < 0 ? i + int(size) : i);
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_TEXTURE_H
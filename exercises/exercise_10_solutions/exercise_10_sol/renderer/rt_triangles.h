@@ -0,0 +1,142 @@
+//
+// Compact triangle storage used by the intersection tests
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_TRIANGLES_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_TRIANGLES_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+#include "rt_storage.h"
+
+namespace rt{
+
+    // Möller–Trumbore ray/triangle intersection, the triangle is given by its first vertex p1 and the edges
+    // e1 = p2 - p1 and e2 = p3 - p1. Returns false if no intersection, otherwise the distance t along the ray and
+    // the u, v coordinates of the hit point with respect to e1 and e2
+    inline bool rayTriangleIntersection(const Ray & ray,
+                                        const glm::vec3 & p1,
+                                        const glm::vec3 & e1,
+                                        const glm::vec3 & e2,
+                                        float & t, float & u, float & v)
+    {
+        using namespace glm;
+        vec3 q = cross(ray.direction, e2);
+        float a = dot(e1, q);
+
+        float tolerance = 10e-7f;
+        // for numerical stability, a = 0 means that triangle plane and ray are parallel
+        if (abs(a) < tolerance) return false;
+
+        float f = 1.0f / a;
+        vec3 s = ray.origin - p1;
+        u = f * dot(s, q);
+
+        // if u < 0, intersection with plane is not within the triangle
+        if (u < -tolerance) return false;
+
+        vec3 r = cross(s, e1);
+        v = f * dot(ray.direction, r);
+
+        // if v < 0 or u+v > 1, intersection with plane is not within the triangle
+        if (v < -tolerance || u + v > 1) return false;
+
+        t = f * dot(e2, r);
+
+        return t >= 0;
+    }
+
+    // same as above, returning the barycentric coordinates of the hit point
+    inline bool rayTriangleIntersection(const Ray & ray,
+                                        const glm::vec3 & p1,
+                                        const glm::vec3 & e1,
+                                        const glm::vec3 & e2,
+                                        float & t, glm::vec3 & barycentric)
+    {
+        float u, v;
+        if (!rayTriangleIntersection(ray, p1, e1, e2, t, u, v))
+            return false;
+
+        barycentric = glm::vec3(1.0f - u - v, u, v);
+
+        return true;
+    }
+
+    // Intersection only copy of the triangles: first vertex and the two edges of each triangle, stored as a
+    // structure of arrays. That is 36 bytes per triangle, instead of the 3 x 56 bytes of the vertices, and the
+    // edges are not recomputed at every test. Normals, colors and uvs stay in the vertex buffer and are only
+    // read after a hit. Every array is 32 bytes aligned and padded to a multiple of 8 triangles, so that they
+    // can be read with 8-wide SIMD loads.
+    class TriangleStore{
+    public:
+        // stores the triangles that start at the vertices order[0], order[1], ... in this order,
+        // the BVH passes its leaf order so that the triangles of a leaf are contiguous in memory
+        void build(const std::vector<vertex> &vts, const Storage<uint32_t> &order){
+            m_size = order.size();
+            m_padded_size = (m_size + 7) / 8 * 8;
+            // one allocation for the 9 arrays, blocks of 8 floats keep each of them 32 bytes aligned
+            m_data.assign(std::vector<Block8>(9 * m_padded_size / 8, Block8{}));
+
+            for (size_t i = 0; i < m_size; i++){
+                const vertex &v1 = vts[order[i]], &v2 = vts[order[i] + 1], &v3 = vts[order[i] + 2];
+                for (int axis = 0; axis < 3; axis++){
+                    array(axis)[i] = v1.pos[axis];
+                    array(3 + axis)[i] = v2.pos[axis] - v1.pos[axis];
+                    array(6 + axis)[i] = v3.pos[axis] - v1.pos[axis];
+                }
+            }
+        }
+
+        // x, y or z array of the first vertex and of the edges
+        const float *p1(int axis) const { return array(axis); }
+        const float *e1(int axis) const { return array(3 + axis); }
+        const float *e2(int axis) const { return array(6 + axis); }
+
+        size_t size() const { return m_size; }
+        // size of the arrays, including padding
+        size_t paddedSize() const { return m_padded_size; }
+
+        // the 9 arrays as one block of dataSize() floats, the format in which BVHCache stores them in a file
+        const float *data() const { return reinterpret_cast<const float*>(m_data.data()); }
+        size_t dataSize() const { return 9 * m_padded_size; }
+
+        // uses the arrays of size triangles stored at data (dataSize() floats, 32 bytes aligned) instead of
+        // building them, mapping keeps the memory alive
+        void view(float *data, size_t size, std::shared_ptr<void> mapping){
+            m_size = size;
+            m_padded_size = (m_size + 7) / 8 * 8;
+            m_data.view(reinterpret_cast<Block8*>(data), 9 * m_padded_size / 8, std::move(mapping));
+        }
+
+        glm::vec3 vertex1(size_t i) const { return glm::vec3(p1(0)[i], p1(1)[i], p1(2)[i]); }
+        glm::vec3 edge1(size_t i) const { return glm::vec3(e1(0)[i], e1(1)[i], e1(2)[i]); }
+        glm::vec3 edge2(size_t i) const { return glm::vec3(e2(0)[i], e2(1)[i], e2(2)[i]); }
+
+        // test the ray against the triangle at position i
+        bool intersect(const Ray &ray, size_t i, float &t, glm::vec3 &barycentric) const {
+            return rayTriangleIntersection(ray, vertex1(i), edge1(i), edge2(i), t, barycentric);
+        }
+
+        // true if the ray hits the triangle at position i closer than t_max
+        bool occludes(const Ray &ray, size_t i, float t_max) const {
+            float t, u, v;
+            return rayTriangleIntersection(ray, vertex1(i), edge1(i), edge2(i), t, u, v) && t < t_max;
+        }
+
+    private:
+        struct alignas(32) Block8{
+            float f[8];
+        };
+        Storage<Block8> m_data;
+        size_t m_size = 0, m_padded_size = 0;
+
+        // the 9 arrays are stored one after the other, each one starting at a block boundary
+        float *array(int k) { return m_data[k * m_padded_size / 8].f; }
+        const float *array(int k) const { return m_data[k * m_padded_size / 8].f; }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_TRIANGLES_H
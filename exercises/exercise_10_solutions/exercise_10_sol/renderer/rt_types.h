@@ -5,6 +5,9 @@
 #ifndef ITU_GRAPHICS_PROGRAMMING_RT_TYPES_H
 #define ITU_GRAPHICS_PROGRAMMING_RT_TYPES_H
 
+#include <cstdint>
+#include <cstddef>
+#include <vector>
 #include "glm/glm.hpp"
 
 namespace rt{
@@ -28,18 +31,46 @@ namespace rt{
             return (uint32_t(255 *  c_clamp.r)) + (uint32_t(255 * c_clamp.g) << 8) +
                    (uint32_t(255 * c_clamp.b) << 16) + (uint32_t(255 * c_clamp.a) << 24);
         }
+
+        // inverse of toRGBA32 (up to the rounding to 8 bits)
+        inline color fromRGBA32(std::uint32_t c) {
+            return color(c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff, c >> 24) * (1.0f / 255.0f);
+        }
+    }
+
+    // integer hash (lowbias32), used to generate deterministic random numbers
+    inline uint32_t hash32(uint32_t x){
+        x ^= x >> 16; x *= 0x7feb352du;
+        x ^= x >> 15; x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    // maps the 24 high bits of x to a float in [0, 1)
+    inline float toUnitFloat(uint32_t x){
+        return float(x >> 8) * (1.0f / 16777216.0f);
     }
 
     struct Ray{
+        Ray() = default;
         Ray(glm::vec3 orig, glm::vec3 dir): origin(orig), direction(dir){};
         glm::vec3 origin;
         glm::vec3 direction;
     };
 
+    // How the origin and the direction of a ray change from one pixel to the next, horizontally (dx) and vertically
+    // (dy) (Igehy, "Tracing ray differentials", 1999). Primary rays start with the ones of the camera, they are
+    // carried to the hit point and through reflections, where they give the footprint of the pixel on the surface
+    struct RayDifferential{
+        glm::vec3 dOdx = glm::vec3(0), dOdy = glm::vec3(0);
+        glm::vec3 dDdx = glm::vec3(0), dDdy = glm::vec3(0);
+    };
+
     struct Hit{
         int hit_ID = -1; // negative values for no hit, other values for the index of the first vertex in a triangle
         glm::vec3 barycentric; // the barycentric coordinates of the triangle that was hit (if any)
         float dist = FLT_MAX;  // used to store the intersection distance
+        int instance_ID = -1;  // the instance that was hit when tracing an rt::Scene, -1 otherwise
     };
 
     struct vertex {
@@ -64,6 +95,23 @@ namespace rt{
             return vertex{v1.pos + v2.pos, v1.norm + v2.norm, v1.col + v2.col, v1.uv + v2.uv};
         }
     };
+
+    // What the pixels that a renderer keeps between frames (progressive samples, dynamic resolution, checkerboard)
+    // depend on besides the view, they are discarded when it changes. The vertex buffer is compared by address and
+    // size, not by content. Each of them compares the view, or its own settings, on top of it
+    struct ImageKey{
+        glm::mat4 m = glm::mat4(0);
+        float fov_degrees = 0;
+        unsigned int depth = 0, W = 0, H = 0;
+        const std::vector<vertex> *vts = nullptr;
+        size_t vts_size = 0;
+
+        bool operator==(const ImageKey &o) const {
+            return m == o.m && fov_degrees == o.fov_degrees && depth == o.depth && W == o.W && H == o.H &&
+                   vts == o.vts && vts_size == o.vts_size;
+        }
+        bool operator!=(const ImageKey &o) const { return !(*this == o); }
+    };
 }
 
 #endif //ITU_GRAPHICS_PROGRAMMING_RT_TYPES_H
@@ -0,0 +1,67 @@
+//
+// Ray queues of the wavefront renderer
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_WAVEFRONT_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_WAVEFRONT_H
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+
+namespace rt{
+
+    // The paths that are still being traced, one entry per pixel, stored as a structure of arrays so that every
+    // stage only touches the arrays it needs. A path is the primary ray of a pixel followed by its reflections.
+    struct PathQueue{
+        std::vector<Ray> rays;
+        std::vector<Hit> hits;
+        std::vector<uint32_t> pixels;   // index of the pixel in the frame buffer
+        std::vector<float> weights;     // how much the path contributes to the pixel color (p_rg ^ bounce)
+        // differentials of the rays, only kept if with_differentials is set (for textured scenes)
+        std::vector<RayDifferential> differentials;
+        bool with_differentials = false;
+
+        size_t size() const { return rays.size(); }
+
+        void resize(size_t size){
+            rays.resize(size);
+            hits.resize(size);
+            pixels.resize(size);
+            weights.resize(size);
+            differentials.resize(with_differentials ? size : 0);
+        }
+
+        // moves entry from to position to, used to compact the queue in place
+        void move(size_t from, size_t to){
+            rays[to] = rays[from];
+            hits[to] = hits[from];
+            pixels[to] = pixels[from];
+            weights[to] = weights[from];
+            if (with_differentials)
+                differentials[to] = differentials[from];
+        }
+    };
+
+    // Shadow rays towards the lights, n per entry of the PathQueue that is being shaded: entry j belongs to path j / n.
+    // contribution is the light that the pixel receives if the ray reaches its light, visible is 0 for the entries
+    // that have no light and set by the any hit test for the others
+    struct ShadowQueue{
+        std::vector<Ray> rays;
+        std::vector<float> light_dists;
+        std::vector<Colors::color> contributions;
+        std::vector<uint8_t> visible;
+
+        size_t size() const { return rays.size(); }
+
+        void resize(size_t size){
+            rays.resize(size);
+            light_dists.resize(size);
+            contributions.resize(size);
+            visible.resize(size);
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_WAVEFRONT_H
@@ -0,0 +1,349 @@
+//
+// Wide BVH with quantized child boxes: a compressed node layout for scenes whose binary BVH does not fit in cache
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_RT_WIDE_BVH_H
+#define ITU_GRAPHICS_PROGRAMMING_RT_WIDE_BVH_H
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "rt_types.h"
+#include "rt_bvh.h"
+#include "rt_packet.h"
+#include "rt_stats.h"
+
+namespace rt{
+
+    // Node with up to N children (N = 4 or 8). The box of child i is origin + q * 2^exponent, with q between
+    // qmin[axis][i] and qmax[axis][i], so a child costs 6 bytes of bounds instead of the 24 bytes of floats of a
+    // BVHNode. The quantized boxes are rounded outwards, they always contain the exact boxes.
+    // A BVH4 node is 64 bytes (one cache line) for 4 children, a BVH8 node 112 bytes for 8, the binary BVH needs
+    // 32 bytes per child
+    template <int N>
+    struct alignas(16) WideNode{
+        glm::vec3 origin;          // min corner of the node box
+        int8_t exponent[3];        // scale of the quantized coordinates along each axis, a power of two
+        uint8_t child_count;       // the children are in the first slots, the other slots are unused
+        uint32_t child[N];         // inner child: index of its node, leaf child: first triangle in BVH::tri_IDs
+        uint8_t tri_count[N];      // triangles of a leaf child, 0 for inner children
+        uint8_t qmin[3][N];        // one array per axis, so that the boxes of 4 children are read with one load
+        uint8_t qmax[3][N];
+
+        bool isLeaf(int i) const { return tri_count[i] > 0; }
+    };
+
+    // Wide BVH over the triangles of a binary BVH, made by collapsing the binary tree: each node takes the
+    // children of the largest binary nodes until it has N of them. The leaves are the same as the leaves of the
+    // binary BVH, so the triangles (tri_IDs and the TriangleStore) are shared with it and not copied; the BVH must
+    // not be destroyed or rebuilt while the wide BVH is used. On x86 the boxes of 4 children are tested at once
+    // with SSE, BVH8 nodes take two of these tests
+    template <int N>
+    class WideBVH{
+        static_assert(N == 4 || N == 8, "wide BVH nodes have 4 or 8 children");
+    public:
+        // a binary leaf with more triangles than this (only possible when the SAH could not split it) is spread
+        // over several wide leaves
+        static const uint32_t max_leaf_triangles = 255;
+
+        void build(const BVH &bvh){
+            m_bvh = &bvh;
+            m_nodes.clear();
+            if (bvh.nodes.empty()) return;
+            // the wide tree has about 1 / (N - 1) times the nodes of the binary tree
+            m_nodes.reserve(bvh.nodes.size() / (N - 1) + 1);
+
+            Entry root = entry(0);
+            if (root.count > 0 && root.count <= max_leaf_triangles)
+                buildNode({root});
+            else
+                buildNode(expand(root));
+        }
+
+        // true if the wide BVH was built from bvh
+        bool builtFrom(const BVH &bvh) const { return m_bvh == &bvh; }
+
+        const std::vector<WideNode<N>> &nodes() const { return m_nodes; }
+
+        // memory used by the nodes
+        size_t nodeBytes() const { return m_nodes.size() * sizeof(WideNode<N>); }
+
+        // same result as BVH::closestHit. The closest child is visited first, the others are pushed with their
+        // entry distance and skipped when popped if a closer hit was found in the meantime
+        bool closestHit(const Ray &ray, Hit &hit) const {
+            if (m_nodes.empty()) return false;
+
+            RayBoxes boxes(ray);
+            StackEntry stack[stack_size];
+            int stack_ptr = 0;
+            stack[stack_ptr++] = StackEntry{0, 0, 0};
+            while (stack_ptr > 0){
+                StackEntry top = stack[--stack_ptr];
+                if (top.dist > hit.dist) continue;
+
+                if (top.count > 0){
+                    RT_COUNT(triangle_tests, top.count);
+                    for (uint32_t i = top.index, end = top.index + top.count; i < end; i++){
+                        int vertex_ID = (int) m_bvh->tri_IDs[i];
+                        float dist_temp;
+                        glm::vec3 barycentric_temp;
+                        // ties are resolved in favour of the lowest ID, so the result does not depend on the order
+                        if (m_bvh->triangles.intersect(ray, i, dist_temp, barycentric_temp) &&
+                            (dist_temp < hit.dist || (dist_temp == hit.dist && vertex_ID < hit.hit_ID))){
+                            hit.hit_ID = vertex_ID;
+                            hit.dist = dist_temp;
+                            hit.barycentric = barycentric_temp;
+                        }
+                    }
+                    continue;
+                }
+
+                RT_COUNT(node_visits, 1);
+                const WideNode<N> &node = m_nodes[top.index];
+                float dist[N];
+                childDistances(node, boxes, hit.dist, dist);
+
+                // sort the children that were hit from far to near, so that the nearest is on top of the stack
+                int order[N], hit_count = 0;
+                for (int i = 0; i < node.child_count; i++){
+                    if (dist[i] == FLT_MAX) continue;
+                    int k = hit_count++;
+                    for (; k > 0 && dist[order[k - 1]] < dist[i]; k--)
+                        order[k] = order[k - 1];
+                    order[k] = i;
+                }
+                assert(stack_ptr + hit_count <= stack_size);
+                for (int k = 0; k < hit_count; k++){
+                    int i = order[k];
+                    stack[stack_ptr++] = StackEntry{node.child[i], node.tri_count[i], dist[i]};
+                }
+            }
+            return hit.hit_ID >= 0;
+        }
+
+        // any hit query, same as BVH::occluded
+        bool occluded(const Ray &ray, float t_max) const {
+            if (m_nodes.empty()) return false;
+
+            RayBoxes boxes(ray);
+            uint32_t stack[stack_size];
+            int stack_ptr = 0;
+            stack[stack_ptr++] = 0;
+            while (stack_ptr > 0){
+                RT_COUNT(node_visits, 1);
+                const WideNode<N> &node = m_nodes[stack[--stack_ptr]];
+                float dist[N];
+                childDistances(node, boxes, t_max, dist);
+                for (int i = 0; i < node.child_count; i++){
+                    if (dist[i] == FLT_MAX) continue;
+                    if (!node.isLeaf(i)){
+                        assert(stack_ptr < stack_size);
+                        stack[stack_ptr++] = node.child[i];
+                        continue;
+                    }
+                    for (uint32_t t = node.child[i], end = node.child[i] + node.tri_count[i]; t < end; t++){
+                        RT_COUNT(triangle_tests, 1);
+                        if (m_bvh->triangles.occludes(ray, t, t_max))
+                            return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+    private:
+        // every level of the tree pushes at most N entries. The wide tree is not deeper than the binary tree,
+        // except for the few levels added under binary leaves that have more than max_leaf_triangles triangles
+        static const int stack_size = (BVH::max_depth + 8) * N;
+
+        const BVH *m_bvh = nullptr;
+        std::vector<WideNode<N>> m_nodes;
+
+        // a node or a leaf waiting on the traversal stack
+        struct StackEntry{
+            uint32_t index;   // node, or first triangle of a leaf
+            uint32_t count;   // triangles of the leaf, 0 for a node
+            float dist;       // distance at which the ray enters its box
+        };
+
+        // ray data used by the box tests, computed once per ray
+        struct RayBoxes{
+            glm::vec3 origin, inv_dir;
+#ifdef RT_PACKET_SIMD
+            __m128 o[3], inv[3];
+#endif
+            explicit RayBoxes(const Ray &ray): origin(ray.origin), inv_dir(1.0f / ray.direction){
+#ifdef RT_PACKET_SIMD
+                for (int axis = 0; axis < 3; axis++){
+                    o[axis] = _mm_set1_ps(origin[axis]);
+                    inv[axis] = _mm_set1_ps(inv_dir[axis]);
+                }
+#endif
+            }
+        };
+
+        // entry distance of the ray into the box of each child, FLT_MAX if the box is missed or farther than t_max.
+        // Same test as rt::rayAABBIntersection, on the dequantized boxes
+        static void childDistances(const WideNode<N> &node, const RayBoxes &ray, float t_max, float dist[N]){
+#ifdef RT_PACKET_SIMD
+            __m128 origin[3], scale[3];
+            for (int axis = 0; axis < 3; axis++){
+                origin[axis] = _mm_set1_ps(node.origin[axis]);
+                scale[axis] = _mm_set1_ps(std::ldexp(1.0f, node.exponent[axis]));
+            }
+            const __m128 t_max4 = _mm_set1_ps(t_max), zero = _mm_setzero_ps();
+            for (int group = 0; group < N; group += 4){
+                __m128 t_enter = _mm_set1_ps(-FLT_MAX), t_exit = _mm_set1_ps(FLT_MAX);
+                for (int axis = 0; axis < 3; axis++){
+                    __m128 bmin = _mm_add_ps(origin[axis], _mm_mul_ps(load4(&node.qmin[axis][group]), scale[axis]));
+                    __m128 bmax = _mm_add_ps(origin[axis], _mm_mul_ps(load4(&node.qmax[axis][group]), scale[axis]));
+                    __m128 t1 = _mm_mul_ps(_mm_sub_ps(bmin, ray.o[axis]), ray.inv[axis]);
+                    __m128 t2 = _mm_mul_ps(_mm_sub_ps(bmax, ray.o[axis]), ray.inv[axis]);
+                    t_enter = _mm_max_ps(t_enter, _mm_min_ps(t1, t2));
+                    t_exit = _mm_min_ps(t_exit, _mm_max_ps(t1, t2));
+                }
+                __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(t_exit, t_enter), _mm_cmpge_ps(t_exit, zero)),
+                                        _mm_cmple_ps(t_enter, t_max4));
+                _mm_storeu_ps(dist + group, blend(hit, t_enter, _mm_set1_ps(FLT_MAX)));
+            }
+#else
+            for (int i = 0; i < node.child_count; i++){
+                glm::vec3 bmin, bmax;
+                for (int axis = 0; axis < 3; axis++){
+                    float scale = std::ldexp(1.0f, node.exponent[axis]);
+                    bmin[axis] = node.origin[axis] + float(node.qmin[axis][i]) * scale;
+                    bmax[axis] = node.origin[axis] + float(node.qmax[axis][i]) * scale;
+                }
+                dist[i] = rayAABBIntersection(ray.origin, ray.inv_dir, bmin, bmax, t_max);
+            }
+#endif
+        }
+
+#ifdef RT_PACKET_SIMD
+        // 4 bytes to 4 floats
+        static __m128 load4(const uint8_t *q){
+            int32_t bytes;
+            std::memcpy(&bytes, q, sizeof(bytes));
+            __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), _mm_setzero_si128());
+            return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+        }
+#endif
+
+        // child of a node under construction: a binary inner node (count == 0) or a range of triangles
+        struct Entry{
+            AABB box;
+            uint32_t node;    // binary node, for inner entries
+            uint32_t first;   // first triangle of a range
+            uint32_t count;   // triangles in the range, 0 for inner entries
+        };
+
+        Entry entry(uint32_t binary_ID) const {
+            const BVHNode &node = m_bvh->nodes[binary_ID];
+            return Entry{AABB{node.bmin, node.bmax}, binary_ID, node.isLeaf() ? node.left_first : 0, node.count};
+        }
+
+        // the children that replace an entry that can't be a leaf of the wide tree
+        std::vector<Entry> expand(const Entry &e) const {
+            std::vector<Entry> children;
+            if (e.count > 0){
+                // range that is too large for one leaf, split in N contiguous parts
+                uint32_t part = (e.count + N - 1) / N;
+                for (uint32_t first = e.first; first < e.first + e.count; first += part){
+                    Entry c{AABB(), 0, first, std::min(part, e.first + e.count - first)};
+                    for (uint32_t i = c.first; i < c.first + c.count; i++){
+                        c.box.grow(m_bvh->triangles.vertex1(i));
+                        c.box.grow(m_bvh->triangles.vertex1(i) + m_bvh->triangles.edge1(i));
+                        c.box.grow(m_bvh->triangles.vertex1(i) + m_bvh->triangles.edge2(i));
+                    }
+                    children.push_back(c);
+                }
+                return children;
+            }
+
+            const BVHNode &node = m_bvh->nodes[e.node];
+            children = {entry(node.left_first), entry(node.left_first + 1)};
+            // open the inner child with the largest surface, it is the one most likely to be hit
+            while (children.size() < N){
+                int largest = -1;
+                for (int i = 0; i < (int) children.size(); i++)
+                    if (children[i].count == 0 && (largest < 0 || children[i].box.halfArea() > children[largest].box.halfArea()))
+                        largest = i;
+                if (largest < 0) break;
+                const BVHNode &open = m_bvh->nodes[children[largest].node];
+                children[largest] = entry(open.left_first);
+                children.push_back(entry(open.left_first + 1));
+            }
+            return children;
+        }
+
+        // adds the node with these children, and recursively the nodes of its inner children. Returns its index
+        uint32_t buildNode(const std::vector<Entry> &children){
+            uint32_t node_ID = m_nodes.size();
+            m_nodes.emplace_back();
+            quantize(m_nodes[node_ID], children);
+
+            for (size_t i = 0; i < children.size(); i++){
+                const Entry &c = children[i];
+                if (c.count > 0 && c.count <= max_leaf_triangles){
+                    m_nodes[node_ID].child[i] = c.first;
+                    m_nodes[node_ID].tri_count[i] = (uint8_t) c.count;
+                }
+                else {
+                    // m_nodes grows during the recursion, so the node is accessed by index
+                    uint32_t child_ID = buildNode(expand(c));
+                    m_nodes[node_ID].child[i] = child_ID;
+                    m_nodes[node_ID].tri_count[i] = 0;
+                }
+            }
+            return node_ID;
+        }
+
+        // fills the box of the node and the quantized boxes of the children, rounded outwards. The scale along an
+        // axis is the smallest power of two for which 255 steps cover the node box, so q * scale is exact and the
+        // box computed during the traversal is exactly the box computed here
+        static void quantize(WideNode<N> &node, const std::vector<Entry> &children){
+            assert(!children.empty() && children.size() <= N);
+            AABB box;
+            for (const Entry &c : children) box.grow(c.box);
+
+            node.origin = box.bmin;
+            node.child_count = (uint8_t) children.size();
+            for (int axis = 0; axis < 3; axis++){
+                float extent = box.bmax[axis] - box.bmin[axis];
+                int exponent = extent > 0 ? (int) std::ceil(std::log2(extent / 255.0f)) : -126;
+                exponent = glm::clamp(exponent, -126, 127);
+                while (exponent < 127 && node.origin[axis] + 255.0f * std::ldexp(1.0f, exponent) < box.bmax[axis])
+                    exponent++;
+                node.exponent[axis] = (int8_t) exponent;
+                float scale = std::ldexp(1.0f, exponent);
+
+                for (int i = 0; i < N; i++){
+                    if (i >= (int) children.size()){
+                        // unused slot, the traversal ignores it
+                        node.qmin[axis][i] = node.qmax[axis][i] = 0;
+                        continue;
+                    }
+                    const AABB &b = children[i].box;
+                    int lo = glm::clamp((int) std::floor((b.bmin[axis] - node.origin[axis]) / scale), 0, 255);
+                    int hi = glm::clamp((int) std::ceil((b.bmax[axis] - node.origin[axis]) / scale), 0, 255);
+                    // the divisions may round the wrong way, the test below uses the same operations as the traversal
+                    while (lo > 0 && node.origin[axis] + float(lo) * scale > b.bmin[axis]) lo--;
+                    while (hi < 255 && node.origin[axis] + float(hi) * scale < b.bmax[axis]) hi++;
+                    node.qmin[axis][i] = (uint8_t) lo;
+                    node.qmax[axis][i] = (uint8_t) hi;
+                }
+            }
+            for (int i = (int) children.size(); i < N; i++){
+                node.child[i] = 0;
+                node.tri_count[i] = 0;
+            }
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_RT_WIDE_BVH_H
@@ -0,0 +1,278 @@
+//
+// Bakes ambient occlusion of the meshes of a model, per vertex or in a texture, with the BVH of the ray tracer
+// of exercise_10_sol
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_AO_BAKER_H
+#define ITU_GRAPHICS_PROGRAMMING_AO_BAKER_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <functional>
+#include <glm/glm.hpp>
+#include "rt_bvh.h"
+#include "rt_wide_bvh.h"
+#include "rt_scheduler.h"
+
+namespace ao{
+
+    // the vertex data of one mesh of the model, indexed triangles like the Mesh of exercise 11
+    struct BakeMesh{
+        std::string name;
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> normals;
+        std::vector<glm::vec2> uvs; // empty if the mesh has no texture coordinates
+        std::vector<unsigned int> indices;
+    };
+
+    // Ambient occlusion is the fraction of the hemisphere around the normal from which a point is visible,
+    // weighted by the cosine to the normal. The rays are cosine distributed, so that fraction is the fraction of
+    // rays that do not hit anything closer than the max distance. Only whether something is hit matters, so the
+    // rays use the any hit traversal (occluded), which stops at the first triangle it finds.
+    // All meshes of the model go in the same BVH, so that they occlude each other. The result is 1 where nothing
+    // occludes the point and 0 where it is fully occluded, the value that texture_ambient1 multiplies the light with.
+    class AOBaker{
+    public:
+        // rays per vertex or texel
+        unsigned int samples = 64;
+        // occluders further away than this are ignored, 0 for half the diagonal of the bounds of the model
+        float max_distance = 0.0f;
+        // children per BVH node, 4 and 8 use the wide BVH of exercise_10_sol (rt::WideBVH)
+        unsigned int bvh_width = 4;
+        // 0 for one thread per core
+        unsigned int thread_count = 0;
+
+        AOBaker() = default;
+        // the BVH refers to m_vts
+        AOBaker(const AOBaker&) = delete;
+        void operator=(const AOBaker&) = delete;
+
+        // builds the BVH of all the triangles of meshes
+        void build(const std::vector<BakeMesh> &meshes){
+            m_vts.clear();
+            glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+            for (const BakeMesh &mesh : meshes){
+                for (unsigned int index : mesh.indices){
+                    glm::vec3 p = mesh.positions[index];
+                    rt::vertex v;
+                    v.pos = glm::vec4(p, 1.0f);
+                    v.norm = glm::vec4(mesh.normals[index], 0.0f);
+                    v.col = rt::Colors::white;
+                    v.uv = mesh.uvs.empty() ? glm::vec2(0.0f) : mesh.uvs[index];
+                    m_vts.push_back(v);
+                    bmin = glm::min(bmin, p);
+                    bmax = glm::max(bmax, p);
+                }
+            }
+            float diagonal = m_vts.empty() ? 1.0f : glm::length(bmax - bmin);
+            m_distance = max_distance > 0.0f ? max_distance : 0.5f * diagonal;
+            // ray origins are moved off the surface by a small fraction of the model size to avoid self intersections
+            m_bias = std::max(1e-4f * diagonal, 1e-6f);
+
+            m_bvh.build(m_vts);
+            if (bvh_width == 4) m_bvh4.build(m_bvh);
+            if (bvh_width == 8) m_bvh8.build(m_bvh);
+        }
+
+        size_t triangleCount() const { return m_vts.size() / 3; }
+
+        // rays traced since the baker was created
+        uint64_t rayCount() const { return m_rays; }
+
+        // ambient occlusion of every vertex of mesh
+        std::vector<float> bakeVertices(const BakeMesh &mesh){
+            std::vector<float> ao(mesh.positions.size(), 1.0f);
+            // the vertices are split in runs of 256, each run is a 1 pixel high tile
+            forEachTile(rt::makeTiles(mesh.positions.size(), 1, 256), [&](const rt::Tile &tile){
+                for (unsigned int i = tile.x0; i < tile.x1; i++){
+                    glm::vec3 n = safeNormalize(mesh.normals[i]);
+                    ao[i] = occlusionAt(mesh.positions[i], n, n, rt::hash32(i));
+                }
+                m_rays += uint64_t(tile.x1 - tile.x0) * samples;
+            });
+            return ao;
+        }
+
+        // Ambient occlusion texture shared by meshes (e.g. all the meshes that use the same texture_ambient1),
+        // W x H texels, row 0 is v = 0 (the top of the image, the model of exercise 11 is loaded with
+        // aiProcess_FlipUVs). The triangles are rasterized in uv space, each texel whose center is covered gets the
+        // occlusion of the surface point at its center. The uv islands are then grown by dilation texels so that
+        // bilinear filtering and mip-mapping do not blend with the empty texels around them, which are left at 1
+        std::vector<float> bakeTexture(const std::vector<const BakeMesh*> &meshes, unsigned int W, unsigned int H,
+                                       unsigned int dilation){
+            std::vector<TexelSample> texels(W * H);
+            for (size_t m = 0; m < meshes.size(); m++)
+                rasterizeUVs(*meshes[m], int(m), W, H, texels);
+            std::vector<float> ao(W * H, 1.0f);
+
+            forEachTile(rt::makeTiles(W, H, 16), [&](const rt::Tile &tile){
+                uint64_t rays = 0;
+                for (unsigned int y = tile.y0; y < tile.y1; y++)
+                    for (unsigned int x = tile.x0; x < tile.x1; x++){
+                        const TexelSample &texel = texels[x + y * W];
+                        if (texel.triangle < 0) continue;
+                        const BakeMesh &mesh = *meshes[texel.mesh];
+                        const unsigned int *tri = &mesh.indices[texel.triangle * 3];
+                        glm::vec3 b = texel.barycentric;
+                        glm::vec3 p0 = mesh.positions[tri[0]], p1 = mesh.positions[tri[1]], p2 = mesh.positions[tri[2]];
+                        glm::vec3 p = b.x * p0 + b.y * p1 + b.z * p2;
+                        glm::vec3 n = safeNormalize(b.x * mesh.normals[tri[0]] + b.y * mesh.normals[tri[1]] +
+                                                    b.z * mesh.normals[tri[2]]);
+                        // the geometric normal, on the side of the shading normal
+                        glm::vec3 n_geo = safeNormalize(glm::cross(p1 - p0, p2 - p0));
+                        if (glm::dot(n_geo, n) < 0.0f) n_geo = -n_geo;
+                        ao[x + y * W] = occlusionAt(p, n_geo, n, rt::hash32(x + y * W));
+                        rays += samples;
+                    }
+                m_rays += rays;
+            });
+
+            std::vector<bool> covered(W * H);
+            for (size_t i = 0; i < texels.size(); i++)
+                covered[i] = texels[i].triangle >= 0;
+            dilate(ao, covered, W, H, dilation);
+            return ao;
+        }
+
+    private:
+        // the mesh and triangle (index of its first index in the index buffer / 3) that cover a texel center, and
+        // the barycentric coordinates of the center in that triangle
+        struct TexelSample{
+            int mesh = -1;
+            int triangle = -1;
+            glm::vec3 barycentric;
+        };
+
+        std::vector<rt::vertex> m_vts;
+        rt::BVH m_bvh;
+        rt::WideBVH<4> m_bvh4;
+        rt::WideBVH<8> m_bvh8;
+        float m_distance = 1.0f, m_bias = 1e-4f;
+        std::atomic<uint64_t> m_rays{0};
+        std::unique_ptr<rt::TileScheduler> m_scheduler;
+
+        static glm::vec3 safeNormalize(glm::vec3 v){
+            float length = glm::length(v);
+            return length > 0.0f ? v / length : glm::vec3(0, 1, 0);
+        }
+
+        bool occluded(const rt::Ray &ray, float t_max) const {
+            if (bvh_width == 4) return m_bvh4.occluded(ray, t_max);
+            if (bvh_width == 8) return m_bvh8.occluded(ray, t_max);
+            return m_bvh.occluded(ray, t_max);
+        }
+
+        // fraction of the cosine weighted rays around n that leave p without hitting anything closer than m_distance.
+        // The directions are a 2D low discrepancy sequence (R2) mapped to the hemisphere, randomly offset per
+        // point (seed), which gives much less noise than independent random directions for the same ray count
+        float occlusionAt(glm::vec3 p, glm::vec3 n_geo, glm::vec3 n, uint32_t seed) const {
+            glm::vec3 t, b;
+            orthonormalBasis(n, t, b);
+            glm::vec3 origin = p + n_geo * m_bias;
+            float offset_u = rt::toUnitFloat(rt::hash32(seed)), offset_v = rt::toUnitFloat(rt::hash32(seed ^ 0x9e3779b9u));
+
+            unsigned int visible = 0;
+            for (unsigned int i = 0; i < samples; i++){
+                float u = offset_u + i * 0.7548776662f, v = offset_v + i * 0.5698402910f;
+                u -= std::floor(u);
+                v -= std::floor(v);
+                // cosine weighted hemisphere (a uniform point on the disk projected up to the hemisphere)
+                float r = std::sqrt(u), phi = 6.28318530718f * v;
+                glm::vec3 dir = t * (r * std::cos(phi)) + b * (r * std::sin(phi)) + n * std::sqrt(std::max(0.0f, 1.0f - u));
+                // with interpolated normals some directions point under the triangle, they are mirrored above it
+                float below = glm::dot(dir, n_geo);
+                if (below < 0.0f) dir -= 2.0f * below * n_geo;
+                if (!occluded(rt::Ray(origin, dir), m_distance))
+                    visible++;
+            }
+            return samples > 0 ? float(visible) / float(samples) : 1.0f;
+        }
+
+        // tangent and bitangent of unit vector n ("Building an Orthonormal Basis, Revisited", Duff et al. 2017)
+        static void orthonormalBasis(glm::vec3 n, glm::vec3 &t, glm::vec3 &b){
+            float sign = std::copysign(1.0f, n.z);
+            float a = -1.0f / (sign + n.z);
+            float c = n.x * n.y * a;
+            t = glm::vec3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+            b = glm::vec3(c, sign + n.y * n.y * a, -n.y);
+        }
+
+        // stores the triangle and barycentric coordinates at the center of the texels covered by mesh, the
+        // triangles that come later win where uv islands overlap
+        static void rasterizeUVs(const BakeMesh &mesh, int mesh_ID, unsigned int W, unsigned int H,
+                                 std::vector<TexelSample> &texels){
+            if (mesh.uvs.empty()) return;
+
+            glm::vec2 size(W, H);
+            auto edge = [](glm::vec2 a, glm::vec2 b, glm::vec2 p){
+                return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+            };
+            for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3){
+                glm::vec2 a = mesh.uvs[mesh.indices[i]] * size;
+                glm::vec2 b = mesh.uvs[mesh.indices[i + 1]] * size;
+                glm::vec2 c = mesh.uvs[mesh.indices[i + 2]] * size;
+                float area = edge(a, b, c);
+                if (std::abs(area) < 1e-12f) continue;
+
+                // texel centers are at x + 0.5, the uvs are expected in [0, 1] (no tiling)
+                glm::vec2 lo = glm::min(a, glm::min(b, c)), hi = glm::max(a, glm::max(b, c));
+                int x0 = std::max(0, int(std::ceil(lo.x - 0.5f))), x1 = std::min(int(W) - 1, int(std::floor(hi.x - 0.5f)));
+                int y0 = std::max(0, int(std::ceil(lo.y - 0.5f))), y1 = std::min(int(H) - 1, int(std::floor(hi.y - 0.5f)));
+                for (int y = y0; y <= y1; y++)
+                    for (int x = x0; x <= x1; x++){
+                        glm::vec2 p(x + 0.5f, y + 0.5f);
+                        glm::vec3 w(edge(b, c, p), edge(c, a, p), edge(a, b, p));
+                        w /= area;
+                        if (w.x < 0.0f || w.y < 0.0f || w.z < 0.0f) continue;
+                        texels[x + y * W] = TexelSample{mesh_ID, int(i / 3), w};
+                    }
+            }
+        }
+
+        // each pass gives the empty texels next to covered ones the average of their covered neighbours
+        static void dilate(std::vector<float> &ao, std::vector<bool> &covered, unsigned int W, unsigned int H,
+                           unsigned int passes){
+            for (unsigned int pass = 0; pass < passes; pass++){
+                std::vector<bool> next = covered;
+                for (unsigned int y = 0; y < H; y++)
+                    for (unsigned int x = 0; x < W; x++){
+                        if (covered[x + y * W]) continue;
+                        float sum = 0.0f;
+                        unsigned int count = 0;
+                        for (int dy = -1; dy <= 1; dy++)
+                            for (int dx = -1; dx <= 1; dx++){
+                                int nx = int(x) + dx, ny = int(y) + dy;
+                                if (nx < 0 || ny < 0 || nx >= int(W) || ny >= int(H) || !covered[nx + ny * W]) continue;
+                                sum += ao[nx + ny * W];
+                                count++;
+                            }
+                        if (count > 0){
+                            ao[x + y * W] = sum / count;
+                            next[x + y * W] = true;
+                        }
+                    }
+                covered.swap(next);
+            }
+        }
+
+        void forEachTile(const std::vector<rt::Tile> &tiles, const std::function<void(const rt::Tile&)> &job){
+            unsigned int threads = thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency());
+            if (threads == 1) {
+                for (const rt::Tile &tile : tiles)
+                    job(tile);
+                return;
+            }
+            if (!m_scheduler || m_scheduler->threadCount() != threads)
+                m_scheduler.reset(new rt::TileScheduler(threads));
+            m_scheduler->run(tiles, job);
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_AO_BAKER_H
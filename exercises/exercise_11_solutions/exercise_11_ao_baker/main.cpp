@@ -0,0 +1,187 @@
+// Offline ambient occlusion baker for the models of exercise 11. It loads the meshes of a model like the Model class,
+// builds the BVH of the ray tracer of exercise_10_sol over all of them, and casts cosine weighted rays around every
+// texel (or vertex) on all cores. The textures can replace the texture_ambient1 maps that the shaders of exercise 11
+// sample, e.g. after the model was edited or for a model that has none.
+//
+// usage: exercise_11_ao_baker <model file> [options]
+//   --out <prefix>             prefix of the output files (default ao). The meshes that use the same AO texture are
+//                              baked together in <prefix>_<texture name>.png, the meshes without one in
+//                              <prefix>_mesh<i>.png
+//   --per-vertex               writes the AO of every vertex to <prefix>.txt instead of textures
+//   --size <n>                 texture resolution (default 1024)
+//   --samples <n>              rays per texel or vertex (default 64)
+//   --distance <d>             occluders further away are ignored, 0 for half the size of the model (default 0)
+//   --dilate <n>               texels that the uv islands are grown by, to avoid seams (default 4)
+//   --threads <n>              bake threads, 0 for one per core (default 0)
+//   --bvh-width 2|4|8          children per BVH node, 4 and 8 use the wide BVH with quantized boxes (default 4)
+
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include "ao_baker.h"
+#include "model_loader.h"
+#include "image_writer.h"
+
+using namespace std;
+
+struct Options{
+    string model;
+    string out = "ao";
+    bool per_vertex = false;
+    unsigned int size = 1024;
+    unsigned int samples = 64;
+    float distance = 0.0f;
+    unsigned int dilate = 4;
+    unsigned int threads = 0;
+    unsigned int bvh_width = 4;
+};
+
+void printUsage(){
+    cout << "usage: exercise_11_ao_baker <model file> [--out prefix] [--per-vertex] [--size n] [--samples n]" << endl
+         << "                            [--distance d] [--dilate n] [--threads n] [--bvh-width 2|4|8]" << endl;
+}
+
+bool parseOptions(int argc, char **argv, Options &options){
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "--per-vertex") options.per_vertex = true;
+        else if (arg == "--help" || arg == "-h") return false;
+        else if (arg.compare(0, 2, "--") != 0) {
+            if (!options.model.empty()){
+                cerr << "unknown option " << arg << endl;
+                return false;
+            }
+            options.model = arg;
+        }
+        // the other options take a value
+        else if (i + 1 >= argc) {
+            cerr << "missing value for " << arg << endl;
+            return false;
+        }
+        else if (arg == "--out") options.out = argv[++i];
+        else if (arg == "--size") options.size = max(1ul, stoul(argv[++i]));
+        else if (arg == "--samples") options.samples = max(1ul, stoul(argv[++i]));
+        else if (arg == "--distance") options.distance = stof(argv[++i]);
+        else if (arg == "--dilate") options.dilate = stoul(argv[++i]);
+        else if (arg == "--threads") options.threads = stoul(argv[++i]);
+        else if (arg == "--bvh-width") {
+            options.bvh_width = stoul(argv[++i]);
+            if (options.bvh_width != 2 && options.bvh_width != 4 && options.bvh_width != 8){
+                cerr << "invalid BVH width " << argv[i] << ", expected 2, 4 or 8" << endl;
+                return false;
+            }
+        }
+        else {
+            cerr << "unknown option " << arg << endl;
+            return false;
+        }
+    }
+    if (options.model.empty()){
+        cerr << "missing model file" << endl;
+        return false;
+    }
+    return true;
+}
+
+double millisecondsSince(chrono::high_resolution_clock::time_point start){
+    return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+// file name of a texture path without directory and extension, used to name the baked texture that replaces it
+string textureName(const string &path){
+    size_t begin = path.find_last_of("/\\");
+    begin = begin == string::npos ? 0 : begin + 1;
+    size_t end = path.find_last_of('.');
+    return path.substr(begin, end == string::npos || end < begin ? string::npos : end - begin);
+}
+
+// grey PNG of the AO, row 0 of ao is the top of the image
+bool writeAOTexture(const string &path, const vector<float> &ao, unsigned int size){
+    FrameBuffer<uint32_t> fb(size, size);
+    for (unsigned int y = 0; y < size; y++)
+        for (unsigned int x = 0; x < size; x++){
+            float value = ao[x + y * size];
+            fb.paintAt(x, size - 1 - y, rt::Colors::toRGBA32(glm::vec4(value, value, value, 1.0f)));
+        }
+    return writePNG(path, fb);
+}
+
+int main(int argc, char **argv){
+    Options options;
+    if (!parseOptions(argc, argv, options)){
+        printUsage();
+        return 1;
+    }
+
+    // load the model and build the BVH
+    // --------------------------------
+    auto start = chrono::high_resolution_clock::now();
+    vector<ao::BakeMesh> meshes;
+    vector<string> ambient_textures;
+    if (!ao::loadModelMeshes(options.model, meshes, ambient_textures))
+        return 1;
+    double load_ms = millisecondsSince(start);
+
+    start = chrono::high_resolution_clock::now();
+    ao::AOBaker baker;
+    baker.samples = options.samples;
+    baker.max_distance = options.distance;
+    baker.bvh_width = options.bvh_width;
+    baker.thread_count = options.threads;
+    baker.build(meshes);
+    double build_ms = millisecondsSince(start);
+
+    // bake
+    // ----
+    start = chrono::high_resolution_clock::now();
+    if (options.per_vertex) {
+        // one line per mesh with its name and vertex count, then the AO of its vertices, one per line
+        ofstream file(options.out + ".txt");
+        for (size_t i = 0; i < meshes.size(); i++){
+            vector<float> ao = baker.bakeVertices(meshes[i]);
+            file << "mesh " << i << " " << (meshes[i].name.empty() ? "-" : meshes[i].name) << " " << ao.size() << "\n";
+            for (float value : ao)
+                file << value << "\n";
+        }
+        if (!file) {
+            cerr << "can't write " << options.out << ".txt" << endl;
+            return 1;
+        }
+        cout << "written to " << options.out << ".txt" << endl;
+    }
+    else {
+        // the meshes that share an AO texture share its uv space, so they are baked in the same image
+        map<string, vector<const ao::BakeMesh*>> textures;
+        for (size_t i = 0; i < meshes.size(); i++){
+            if (meshes[i].uvs.empty()) {
+                cerr << "mesh " << i << " (" << meshes[i].name << ") has no texture coordinates, skipped" << endl;
+                continue;
+            }
+            string name = ambient_textures[i].empty() ? "mesh" + to_string(i) : textureName(ambient_textures[i]);
+            textures[name].push_back(&meshes[i]);
+        }
+        for (auto &texture : textures){
+            vector<float> ao = baker.bakeTexture(texture.second, options.size, options.size, options.dilate);
+            string path = options.out + "_" + texture.first + ".png";
+            if (!writeAOTexture(path, ao, options.size)) {
+                cerr << "can't write " << path << endl;
+                return 1;
+            }
+            cout << "written to " << path << " (" << texture.second.size() << " meshes)" << endl;
+        }
+    }
+    double bake_ms = millisecondsSince(start);
+
+    cout << fixed << setprecision(1)
+         << "meshes:     " << meshes.size() << ", " << baker.triangleCount() << " triangles" << endl
+         << "load:       " << load_ms << " ms" << endl
+         << "bvh build:  " << build_ms << " ms" << endl
+         << "bake:       " << bake_ms << " ms, " << baker.rayCount() << " rays, "
+         << setprecision(2) << baker.rayCount() / (bake_ms * 1000.0) << " Mrays/s" << endl;
+    return 0;
+}
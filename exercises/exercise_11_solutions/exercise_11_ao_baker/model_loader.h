@@ -0,0 +1,72 @@
+//
+// Loads the meshes of a model with assimp, like the Model class of exercise 11 but without OpenGL
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_AO_MODEL_LOADER_H
+#define ITU_GRAPHICS_PROGRAMMING_AO_MODEL_LOADER_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+#include "ao_baker.h"
+
+namespace ao{
+
+    // the meshes are read in the order Model::processNode visits them, so mesh i of the baker is meshes[i] of the
+    // Model. Like Model, the node transforms are ignored: the AO is baked for the model as exercise 11 draws it.
+    // ambient_textures gets the AO texture that each mesh uses now (aiTextureType_AMBIENT), empty if it has none
+    inline bool loadModelMeshes(const std::string &path, std::vector<BakeMesh> &meshes,
+                                std::vector<std::string> &ambient_textures){
+        Assimp::Importer importer;
+        // triangulated with flipped uvs like Model::loadModel, so that the uvs match. Unlike Model, the normals are
+        // generated if the file has none (the baker needs them) and no tangent space is computed
+        const aiScene *scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs |
+                                                       aiProcess_GenSmoothNormals);
+        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode){
+            std::cerr << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
+            return false;
+        }
+
+        std::vector<const aiNode*> stack = {scene->mRootNode};
+        while (!stack.empty()){
+            const aiNode *node = stack.back();
+            stack.pop_back();
+            for (unsigned int i = 0; i < node->mNumMeshes; i++){
+                const aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
+                BakeMesh baked;
+                baked.name = mesh->mName.C_Str();
+                for (unsigned int v = 0; v < mesh->mNumVertices; v++){
+                    baked.positions.emplace_back(mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z);
+                    // aiProcess_GenSmoothNormals only gives normals to meshes with triangles, point and line
+                    // meshes have none (and no triangles to bake)
+                    if (mesh->mNormals)
+                        baked.normals.emplace_back(mesh->mNormals[v].x, mesh->mNormals[v].y, mesh->mNormals[v].z);
+                    else
+                        baked.normals.emplace_back(0.0f);
+                    if (mesh->mTextureCoords[0])
+                        baked.uvs.emplace_back(mesh->mTextureCoords[0][v].x, mesh->mTextureCoords[0][v].y);
+                }
+                // points and lines are left as they are by aiProcess_Triangulate, they can't occlude anything
+                for (unsigned int f = 0; f < mesh->mNumFaces; f++)
+                    if (mesh->mFaces[f].mNumIndices == 3)
+                        baked.indices.insert(baked.indices.end(), mesh->mFaces[f].mIndices, mesh->mFaces[f].mIndices + 3);
+                meshes.push_back(std::move(baked));
+
+                aiString texture;
+                const aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+                bool has_ambient = material->GetTextureCount(aiTextureType_AMBIENT) > 0 &&
+                                   material->GetTexture(aiTextureType_AMBIENT, 0, &texture) == AI_SUCCESS;
+                ambient_textures.push_back(has_ambient ? texture.C_Str() : "");
+            }
+            // children are pushed in reverse, so they are visited in order, depth first like Model::processNode
+            for (unsigned int i = node->mNumChildren; i-- > 0;)
+                stack.push_back(node->mChildren[i]);
+        }
+        return true;
+    }
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_AO_MODEL_LOADER_H
@@ -89,6 +89,10 @@ int main()
         };
         vtsCube.push_back(v);
     }
+    // indexed version of the cube, each shared vertex is transformed once per frame
+    std::vector<srl::vertex> cubeVertices;
+    std::vector<unsigned int> cubeIndices;
+    srl::indexVertices(vtsCube, cubeVertices, cubeIndices);
 
 
     // camera
@@ -137,6 +141,9 @@ int main()
     std::cout << "1 - use point renderer" << std::endl;
     std::cout << "2 - use line renderer" << std::endl;
     std::cout << "3 - use triangle renderer" << std::endl;
+    std::cout << "4 - toggle the binned, multithreaded triangle renderer" << std::endl;
+    std::cout << "5 - toggle streaming (early depth test, no fragment list) in the triangle renderer" << std::endl;
+    std::cout << "6 - toggle the hierarchical z-buffer of the streaming triangle renderer" << std::endl;
 
     while (!glfwWindowShouldClose(window))
     {
@@ -150,7 +157,7 @@ int main()
         customBuffer.clearBuffer(srl::Colors::toRGBA32(srl::Colors::black));
         customZBuffer.clearBuffer(1.0f);
 
-        srlRenderer->render(vtsCube, trackballRotation() * storedRotation, viewProj, customBuffer, customZBuffer);
+        srlRenderer->render(cubeVertices, cubeIndices, trackballRotation() * storedRotation, viewProj, customBuffer, customZBuffer);
 
         // show our rendered image
         // -----------------------
@@ -268,6 +275,18 @@ void key_input_callback(GLFWwindow* window, int button, int other,int action, in
     if (button == GLFW_KEY_3 && action == GLFW_PRESS){
         srlRenderer = &tRenderer;
     }
+    if (button == GLFW_KEY_4 && action == GLFW_PRESS){
+        tRenderer.m_binned = !tRenderer.m_binned;
+        std::cout << "binned triangle renderer " << (tRenderer.m_binned ? "on" : "off") << std::endl;
+    }
+    if (button == GLFW_KEY_5 && action == GLFW_PRESS){
+        tRenderer.m_streaming = !tRenderer.m_streaming;
+        std::cout << "streaming triangle renderer " << (tRenderer.m_streaming ? "on" : "off") << std::endl;
+    }
+    if (button == GLFW_KEY_6 && action == GLFW_PRESS){
+        tRenderer.m_hierarchicalZ = !tRenderer.m_hierarchicalZ;
+        std::cout << "hierarchical z-buffer " << (tRenderer.m_hierarchicalZ ? "on" : "off") << std::endl;
+    }
 }
 
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
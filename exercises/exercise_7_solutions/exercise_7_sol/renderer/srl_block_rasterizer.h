@@ -0,0 +1,226 @@
+//
+// Half-space triangle rasterizer that works on 8x8 pixel blocks and returns coverage masks
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_SRL_BLOCK_RASTERIZER_H
+#define ITU_GRAPHICS_PROGRAMMING_SRL_BLOCK_RASTERIZER_H
+
+#include <cstdint>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+// SSE2 is part of x86-64, so no extra compiler flags are needed. On other architectures
+// SRL_BLOCK_SIMD is not defined and the partially covered blocks are tested one pixel at a time
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SRL_BLOCK_SIMD 1
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace srl {
+
+    // Rasterizes a triangle with its three edge functions instead of walking its edges (triangle_rasterizer).
+    // The screen is split in blocks of 8x8 pixels, the blocks of the bounding box are tested against the three edges
+    // at their corners: blocks outside of an edge are skipped, blocks inside of all edges are covered completely and
+    // only the blocks crossed by an edge are tested pixel by pixel, a row of 8 pixels at a time with SSE.
+    // The result of a block is a 64 bits mask, bit x + 8 * y covers the pixel (blockX + x, blockY + y).
+    //
+    // The vertices are integer pixel positions and a pixel is covered with the same rule as triangle_rasterizer:
+    // rows from the lowest vertex up to the highest one (excluded), in a row from the left edge up to the right
+    // edge (excluded). So a pixel on a left edge, or on a horizontal bottom edge, belongs to the triangle, and a
+    // pixel on a right or top edge belongs to its neighbour, the triangles of a mesh cover every pixel once.
+    // The edge functions are exact in 32 bits integers for window coordinates up to +-16384 (clipping ensures that)
+    class BlockRasterizer {
+    public:
+        static const int blockSize = 8;
+
+        BlockRasterizer(glm::ivec2 v1, glm::ivec2 v2, glm::ivec2 v3) {
+            // the rule is the same for both winding orders, we make the triangle counterclockwise (y up)
+            int area = (v2.x - v1.x) * (v3.y - v1.y) - (v2.y - v1.y) * (v3.x - v1.x);
+            if (area < 0)
+                std::swap(v2, v3);
+            m_empty = area == 0;
+
+            const glm::ivec2 vts[3] = {v1, v2, v3};
+            for (int i = 0; i < 3; i++) {
+                const glm::ivec2 &a = vts[i], &b = vts[(i + 1) % 3];
+                // E(p) = cross(b - a, p - a), positive on the left of the edge, which is the inside
+                Edge &e = m_edges[i];
+                e.stepX = a.y - b.y;
+                e.stepY = b.x - a.x;
+                // pixels on the edge are inside for left edges (inside towards +x) and horizontal bottom edges
+                // (inside towards +y). The function is shifted so that a pixel is inside when it is >= 0
+                bool inclusive = e.stepX > 0 || (e.stepX == 0 && e.stepY > 0);
+                e.origin = -(e.stepX * a.x + e.stepY * a.y) - (inclusive ? 0 : 1);
+            }
+
+            m_min = glm::min(v1, glm::min(v2, v3));
+            m_max = glm::max(v1, glm::max(v2, v3));
+        }
+
+        // true for triangles with no area, they cover no pixels
+        bool empty() const { return m_empty; }
+
+        // smallest and largest pixel that can be covered
+        glm::ivec2 boundsMin() const { return m_min; }
+        glm::ivec2 boundsMax() const { return m_max; }
+
+        // calls emit(blockX, blockY, mask) for every block with covered pixels inside the rectangle [x0, x1) x [y0, y1),
+        // block row after block row. Blocks are aligned to multiples of 8, the rectangle does not need to be
+        template <typename Emit>
+        void rasterize(int x0, int y0, int x1, int y1, Emit &&emit) const {
+            if (m_empty)
+                return;
+            x0 = std::max(x0, m_min.x);
+            y0 = std::max(y0, m_min.y);
+            x1 = std::min(x1, m_max.x + 1);
+            y1 = std::min(y1, m_max.y + 1);
+            if (x0 >= x1 || y0 >= y1)
+                return;
+
+            int bx0 = x0 & ~(blockSize - 1), by0 = y0 & ~(blockSize - 1);
+            // offsets from the corner of a block to its corners with the largest and the smallest edge function
+            int maxOffset[3], minOffset[3];
+            for (int i = 0; i < 3; i++) {
+                const Edge &e = m_edges[i];
+                maxOffset[i] = std::max(e.stepX, 0) * (blockSize - 1) + std::max(e.stepY, 0) * (blockSize - 1);
+                minOffset[i] = std::min(e.stepX, 0) * (blockSize - 1) + std::min(e.stepY, 0) * (blockSize - 1);
+            }
+
+            for (int by = by0; by < y1; by += blockSize) {
+                uint64_t rowMask = rowsMask(y0 - by, y1 - by);
+                int rowValues[3];
+                for (int i = 0; i < 3; i++)
+                    rowValues[i] = m_edges[i].at(bx0, by);
+
+                for (int bx = bx0; bx < x1; bx += blockSize) {
+                    int values[3] = {rowValues[0], rowValues[1], rowValues[2]};
+                    for (int i = 0; i < 3; i++)
+                        rowValues[i] += m_edges[i].stepX * blockSize;
+
+                    // the block is outside of an edge
+                    if (values[0] + maxOffset[0] < 0 || values[1] + maxOffset[1] < 0 || values[2] + maxOffset[2] < 0)
+                        continue;
+
+                    // the pixels of the block inside the rectangle, a byte per row
+                    uint64_t clip = rowMask & (rangeMask(x0 - bx, x1 - bx) * 0x0101010101010101ull);
+                    uint64_t mask;
+                    if (values[0] + minOffset[0] >= 0 && values[1] + minOffset[1] >= 0 && values[2] + minOffset[2] >= 0)
+                        mask = ~uint64_t(0);
+                    else
+                        mask = blockCoverage(values);
+                    mask &= clip;
+                    if (mask)
+                        emit(bx, by, mask);
+                }
+            }
+        }
+
+        // calls visit(x, y) for the pixels of a block mask, in row order
+        template <typename Visit>
+        static void forEachPixel(int blockX, int blockY, uint64_t mask, Visit &&visit) {
+            while (mask) {
+                int bit = lowestBit(mask);
+                mask &= mask - 1;
+                visit(blockX + (bit & (blockSize - 1)), blockY + (bit >> 3));
+            }
+        }
+
+        // number of covered pixels of a block mask
+        static int pixelCount(uint64_t mask) {
+#if defined(_MSC_VER) && defined(_M_X64)
+            return int(__popcnt64(mask));
+#elif defined(_MSC_VER)
+            return int(__popcnt(uint32_t(mask)) + __popcnt(uint32_t(mask >> 32)));
+#else
+            return __builtin_popcountll(mask);
+#endif
+        }
+
+    private:
+        struct Edge {
+            // E(x, y) = origin + stepX * x + stepY * y
+            int origin, stepX, stepY;
+
+            int at(int x, int y) const { return origin + stepX * x + stepY * y; }
+        };
+
+        Edge m_edges[3];
+        glm::ivec2 m_min, m_max;
+        bool m_empty;
+
+        // columns [begin, end) of a block row, clamped to [0, 8)
+        static uint64_t rangeMask(int begin, int end) {
+            begin = std::max(begin, 0);
+            end = std::min(end, blockSize);
+            if (begin >= end)
+                return 0;
+            return ((1u << end) - 1u) & ~((1u << begin) - 1u);
+        }
+
+        // rows [begin, end) of a block, clamped to [0, 8)
+        static uint64_t rowsMask(int begin, int end) {
+            begin = std::max(begin, 0);
+            end = std::min(end, blockSize);
+            if (begin >= end)
+                return 0;
+            uint64_t below = end == blockSize ? ~uint64_t(0) : (uint64_t(1) << (end * blockSize)) - 1;
+            return below & ~((uint64_t(1) << (begin * blockSize)) - 1);
+        }
+
+        static int lowestBit(uint64_t mask) {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, mask);
+            return int(index);
+#else
+            return __builtin_ctzll(mask);
+#endif
+        }
+
+        // coverage of a block crossed by an edge, values are the edge functions at its corner
+        uint64_t blockCoverage(const int values[3]) const {
+            uint64_t mask = 0;
+#ifdef SRL_BLOCK_SIMD
+            // the 8 pixels of a row in two registers of 4 lanes, per edge
+            __m128i left[3], right[3], stepY[3];
+            for (int i = 0; i < 3; i++) {
+                const Edge &e = m_edges[i];
+                left[i] = _mm_add_epi32(_mm_set1_epi32(values[i]), _mm_setr_epi32(0, e.stepX, 2 * e.stepX, 3 * e.stepX));
+                right[i] = _mm_add_epi32(left[i], _mm_set1_epi32(4 * e.stepX));
+                stepY[i] = _mm_set1_epi32(e.stepY);
+            }
+            for (int y = 0; y < blockSize; y++) {
+                // a pixel is inside when no edge function is negative, the sign bit of the or of the three is 0
+                __m128i outLeft = _mm_or_si128(_mm_or_si128(left[0], left[1]), left[2]);
+                __m128i outRight = _mm_or_si128(_mm_or_si128(right[0], right[1]), right[2]);
+                int out = _mm_movemask_ps(_mm_castsi128_ps(outLeft)) | (_mm_movemask_ps(_mm_castsi128_ps(outRight)) << 4);
+                mask |= uint64_t(~out & 0xff) << (y * blockSize);
+                for (int i = 0; i < 3; i++) {
+                    left[i] = _mm_add_epi32(left[i], stepY[i]);
+                    right[i] = _mm_add_epi32(right[i], stepY[i]);
+                }
+            }
+#else
+            int rowValues[3] = {values[0], values[1], values[2]};
+            for (int y = 0; y < blockSize; y++) {
+                int e0 = rowValues[0], e1 = rowValues[1], e2 = rowValues[2];
+                for (int x = 0; x < blockSize; x++) {
+                    if ((e0 | e1 | e2) >= 0)
+                        mask |= uint64_t(1) << (x + y * blockSize);
+                    e0 += m_edges[0].stepX;
+                    e1 += m_edges[1].stepX;
+                    e2 += m_edges[2].stepX;
+                }
+                for (int i = 0; i < 3; i++)
+                    rowValues[i] += m_edges[i].stepY;
+            }
+#endif
+            return mask;
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_SRL_BLOCK_RASTERIZER_H
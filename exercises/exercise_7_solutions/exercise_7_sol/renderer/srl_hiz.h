@@ -0,0 +1,106 @@
+//
+// Hierarchical z/depth-buffer, the largest depth of blocks and regions of the depth buffer
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_SRL_HIZ_H
+#define ITU_GRAPHICS_PROGRAMMING_SRL_HIZ_H
+
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+#include "srl_types.h"
+#include "srl_block_rasterizer.h"
+
+namespace srl {
+
+    // Two levels over the depth buffer: the largest depth of every 8x8 block (the blocks of BlockRasterizer) and of
+    // every region of regionSize x regionSize pixels. A triangle whose smallest depth over a block (or a region) is
+    // not smaller than the largest depth stored there fails the depth test at all of its pixels, so it can be skipped
+    // there. The depth test only lets depths decrease, so the maxima stay valid upper bounds while the frame is
+    // drawn, and updateBlock lowers them after a block was written.
+    // Regions are aligned to the tiles of the binned renderer (regionSize == tile size), so that the threads of
+    // different tiles update different blocks and regions.
+    class HiZBuffer {
+    public:
+        static const int blockSize = BlockRasterizer::blockSize;
+
+        // computes both levels from the depth buffer, at the start of every frame since the depth buffer is cleared
+        // outside of the renderer. regionSize must be a multiple of blockSize
+        void build(const CustomFrameBuffer <float> &db, int regionSize) {
+            m_width = db.W;
+            m_height = db.H;
+            m_blocksX = (m_width + blockSize - 1) / blockSize;
+            m_blocksY = (m_height + blockSize - 1) / blockSize;
+            m_blocksPerRegion = regionSize / blockSize;
+            m_regionsX = (m_blocksX + m_blocksPerRegion - 1) / m_blocksPerRegion;
+            m_regionsY = (m_blocksY + m_blocksPerRegion - 1) / m_blocksPerRegion;
+            m_blockMax.assign(m_blocksX * m_blocksY, -FLT_MAX);
+            m_regionMax.assign(m_regionsX * m_regionsY, -FLT_MAX);
+
+            for (int y = 0; y < m_height; y++) {
+                const float *row = db.buffer + y * m_width;
+                float *blockRow = &m_blockMax[(y / blockSize) * m_blocksX];
+                for (int x = 0; x < m_width; x++)
+                    blockRow[x / blockSize] = std::max(blockRow[x / blockSize], row[x]);
+            }
+            for (int by = 0; by < m_blocksY; by++)
+                for (int bx = 0; bx < m_blocksX; bx++) {
+                    float &region = m_regionMax[bx / m_blocksPerRegion + (by / m_blocksPerRegion) * m_regionsX];
+                    region = std::max(region, m_blockMax[bx + by * m_blocksX]);
+                }
+        }
+
+        // largest depth of the block with the pixel (x, y)
+        float blockMax(int x, int y) const {
+            return m_blockMax[x / blockSize + (y / blockSize) * m_blocksX];
+        }
+
+        // largest depth of the regions overlapping the pixels [x0, x1] x [y0, y1], inside of the buffer
+        float regionMax(int x0, int y0, int x1, int y1) const {
+            int regionSize = m_blocksPerRegion * blockSize;
+            float result = -FLT_MAX;
+            for (int ry = y0 / regionSize; ry <= y1 / regionSize; ry++)
+                for (int rx = x0 / regionSize; rx <= x1 / regionSize; rx++)
+                    result = std::max(result, m_regionMax[rx + ry * m_regionsX]);
+            return result;
+        }
+
+        // recomputes the block with the pixel (x, y) from the depth buffer, after depths were written over its
+        // largest depth
+        void updateBlock(int x, int y, const CustomFrameBuffer <float> &db) {
+            int bx = x / blockSize, by = y / blockSize;
+            int x1 = std::min((bx + 1) * blockSize, m_width), y1 = std::min((by + 1) * blockSize, m_height);
+            float depth = -FLT_MAX;
+            for (int py = by * blockSize; py < y1; py++)
+                for (int px = bx * blockSize; px < x1; px++)
+                    depth = std::max(depth, db.buffer[px + py * m_width]);
+            setBlockMax(x, y, depth);
+        }
+
+        // sets the largest depth of the block with the pixel (x, y), when it is known without reading the block
+        // (all of its pixels were just written), and updates its region if the block could have held its maximum
+        void setBlockMax(int x, int y, float depth) {
+            int bx = x / blockSize, by = y / blockSize;
+            float &block = m_blockMax[bx + by * m_blocksX];
+            float &region = m_regionMax[bx / m_blocksPerRegion + (by / m_blocksPerRegion) * m_regionsX];
+            bool wasRegionMax = block >= region;
+            block = depth;
+            if (wasRegionMax) {
+                int rbx = bx - bx % m_blocksPerRegion, rby = by - by % m_blocksPerRegion;
+                region = -FLT_MAX;
+                for (int j = rby; j < std::min(rby + m_blocksPerRegion, m_blocksY); j++)
+                    for (int i = rbx; i < std::min(rbx + m_blocksPerRegion, m_blocksX); i++)
+                        region = std::max(region, m_blockMax[i + j * m_blocksX]);
+            }
+        }
+
+    private:
+        int m_width = 0, m_height = 0;
+        int m_blocksX = 0, m_blocksY = 0;
+        int m_blocksPerRegion = 1, m_regionsX = 0, m_regionsY = 0;
+        std::vector<float> m_blockMax;
+        std::vector<float> m_regionMax;
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_SRL_HIZ_H
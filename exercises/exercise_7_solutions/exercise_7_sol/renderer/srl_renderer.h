@@ -6,15 +6,38 @@
 #define GRAPHICSPROGRAMMINGEXERCISES_RENDERER_H
 
 #include <vector>
+#include <memory>
+#include <thread>
 #include <algorithm>
 #include "glm/glm.hpp"
 #include "srl_types.h"
+#include "srl_scheduler.h"
+#include "srl_hiz.h"
 
 
 namespace srl {
     class Renderer {
 
     public:
+        // binned mode: after the primitives are set up, they are sorted into the screen tiles they overlap, and the
+        // tiles are rasterized, shaded and written by worker threads. Every tile owns its pixels of the color and
+        // depth buffers, so no locks are needed, and its primitives keep their order, so the image is the same as
+        // the one of the serial pipeline. Only renderers that implement binning (TriangleRenderer) use it
+        bool m_binned = false;
+        // width and height of the tiles of the binned mode, multiples of 8 do not split the 8x8 rasterizer blocks
+        int m_tileSize = 64;
+        // worker threads of the binned mode, 0 means one per hardware thread
+        unsigned int m_threadCount = 0;
+        // streaming mode: every pixel is depth tested as soon as it is rasterized, and shaded and written only if it
+        // passes, instead of collecting the fragments of the whole frame (or tile) first. The depth is interpolated
+        // before the other attributes, so hidden pixels cost only their depth. The image is the same as long as
+        // processFragment does not change the depth. Works with and without m_binned, only for renderers that
+        // implement it (TriangleRenderer)
+        bool m_streaming = false;
+        // hierarchical z-buffer for the streaming mode: triangles and 8x8 blocks that are behind everything already
+        // drawn in their region or block are skipped before any depth is interpolated (see HiZBuffer). In the binned
+        // mode the regions are the tiles, so it needs tiles that are multiples of 8
+        bool m_hierarchicalZ = false;
 
         // render vertices with mvp transformation in the fb framebuffer
         void render(const std::vector<vertex> &vts,
@@ -33,22 +56,143 @@ namespace srl {
 
             processVertices(modelViewProjection, _vts);
             assemblePrimitives(_vts);
+            renderPrimitives(fb, db, _frs);
+
+            //  MIND THAT THE METHODS BELOW ARE NOT DECLARED/DEFINED IN THE RIGHT ORDER!
+
+        }
+
+        // render an indexed mesh: every three indices (two for lines, one for points) select the vertices of a
+        // primitive. Each vertex is transformed once, into a post-transform buffer, and the primitives are assembled
+        // from it, instead of transforming a vertex for every primitive that uses it
+        void render(const std::vector<vertex> &vertices,
+                    const std::vector<unsigned int> &indices,
+                    const glm::mat4 &m,
+                    const glm::mat4 &vp,
+                    CustomFrameBuffer <uint32_t> &fb,
+                    CustomFrameBuffer <float> &db) {
+            std::vector<fragment> _frs;
+            glm::mat4 modelViewProjection = vp * m;
+
+            m_transformedVertices.assign(vertices.begin(), vertices.end());
+            processVertices(modelViewProjection, m_transformedVertices);
+            assembleIndexedPrimitives(m_transformedVertices, indices);
+            renderPrimitives(fb, db, _frs);
+        }
+
+        virtual ~Renderer(){};
+
+    private:
+        // the pipeline after primitive assembly, shared by both versions of render
+        void renderPrimitives(CustomFrameBuffer <uint32_t> &fb, CustomFrameBuffer <float> &db, std::vector<fragment> &_frs) {
             clipPrimitives();
             divideByW();
             toScreenSpace(fb.W, fb.H);
             backfaceCulling();
-            rasterPrimitives(_frs);
-            processFragments(_frs);
-            writeToFrameBuffer(_frs, fb, db);
+            bool binned = m_binned && binPrimitives(fb.W, fb.H);
+            HiZBuffer *hiZ = nullptr;
+            if (m_streaming && m_hierarchicalZ && (!binned || m_tileSize % HiZBuffer::blockSize == 0)) {
+                m_hiZ.build(db, binned ? m_tileSize : 8 * HiZBuffer::blockSize);
+                hiZ = &m_hiZ;
+            }
 
-            //  MIND THAT THE METHODS BELOW ARE NOT DECLARED/DEFINED IN THE RIGHT ORDER!
+            if (binned) {
+                renderTiles(fb, db, hiZ);
+            }
+            else if (m_streaming && streamPrimitives(nullptr, Tile{0, 0, int(fb.W), int(fb.H)}, fb, db, hiZ)) {
+                // done, the fragments were written as they were rasterized
+            }
+            else {
+                rasterPrimitives(_frs);
+                processFragments(_frs);
+                writeToFrameBuffer(_frs, fb, db);
+            }
+        }
+
+    protected:
+        // lists of primitive indices in primitive order, one per tile, row after row of tiles
+        std::vector<std::vector<unsigned int>> m_bins;
+        int m_tilesX = 0, m_tilesY = 0;
 
+        // a screen tile, [x0, x1) x [y0, y1)
+        struct Tile {
+            int x0, y0, x1, y1;
+        };
+
+        Tile tileAt(int index, int width, int height) const {
+            int x = index % m_tilesX * m_tileSize, y = index / m_tilesX * m_tileSize;
+            return Tile{x, y, std::min(x + m_tileSize, width), std::min(y + m_tileSize, height)};
+        }
+
+        // resizes m_bins for a width x height frame buffer and empties the bins
+        void resetBins(int width, int height) {
+            m_tilesX = (width + m_tileSize - 1) / m_tileSize;
+            m_tilesY = (height + m_tileSize - 1) / m_tileSize;
+            m_bins.resize(m_tilesX * m_tilesY);
+            for (auto &bin : m_bins)
+                bin.clear();
+        }
+
+        // fragment shader, applied to every fragment before it is written
+        static void processFragment(fragment &frg) {
+            (void) frg; // unused until the example below is uncommented
+            // example: uncomment this to make all fragments darker
+            // frg.col = frg.col * 0.5f;
         }
 
-        virtual ~Renderer(){};
     private:
+        // hierarchical z-buffer of the streaming mode
+        HiZBuffer m_hiZ;
+        // post-transform buffer of the indexed render, and the primitive vertices of renderers that assemble
+        // indexed primitives from a list of vertices
+        std::vector<vertex> m_transformedVertices, m_indexedVertices;
+        // worker threads of the binned mode, created on the first binned frame
+        std::unique_ptr<TileScheduler> m_scheduler;
+        // fragments of the tile that is being rendered, one list per worker thread
+        std::vector<std::vector<fragment>> m_tileFragments;
+
+        // rasterizes, shades and writes the primitives of every bin in its tile, on the worker threads
+        void renderTiles(CustomFrameBuffer <uint32_t> &fb, CustomFrameBuffer <float> &db, HiZBuffer *hiZ) {
+            unsigned int threads = m_threadCount > 0 ? m_threadCount : std::max(1u, std::thread::hardware_concurrency());
+            if (!m_scheduler || m_scheduler->threadCount() != threads)
+                m_scheduler.reset(new TileScheduler(threads));
+            m_tileFragments.resize(threads);
+
+            m_scheduler->run(m_bins.size(), [&](unsigned int index, unsigned int worker){
+                if (m_bins[index].empty())
+                    return;
+                Tile tile = tileAt(index, fb.W, fb.H);
+                if (m_streaming && streamPrimitives(&m_bins[index], tile, fb, db, hiZ))
+                    return;
+                std::vector<fragment> &frs = m_tileFragments[worker];
+                rasterTile(m_bins[index], tile, frs);
+                processFragments(frs);
+                writeToFrameBuffer(frs, fb, db);
+            });
+        }
+
+        // sorts the primitives into m_bins, returns false if the renderer does not support the binned mode
+        virtual bool binPrimitives(int /*width*/, int /*height*/) { return false; }
+        // generate the fragments of the listed primitives that are inside of the tile, in the order of the list
+        virtual void rasterTile(const std::vector<unsigned int> &/*primitives*/, const Tile &/*tile*/,
+                                std::vector<fragment> &/*outFrs*/) {}
+        // rasterize, depth test, shade and write the listed primitives (all of them if primitives is null) inside
+        // of the tile, pixel by pixel, skipping what hiZ (if not null) shows to be hidden. Returns false if the
+        // renderer does not support the streaming mode
+        virtual bool streamPrimitives(const std::vector<unsigned int> * /*primitives*/, const Tile &/*tile*/,
+                                      CustomFrameBuffer <uint32_t> &/*fb*/, CustomFrameBuffer <float> &/*db*/,
+                                      HiZBuffer * /*hiZ*/) { return false; }
 
         virtual void assemblePrimitives(const std::vector<vertex> &vts) = 0;
+        // create the primitives from the transformed vertices selected by indices. By default, the selected vertices
+        // are copied in a list for assemblePrimitives, renderers can override it to read them by index instead
+        virtual void assembleIndexedPrimitives(const std::vector<vertex> &vts, const std::vector<unsigned int> &indices) {
+            m_indexedVertices.clear();
+            m_indexedVertices.reserve(indices.size());
+            for (unsigned int index : indices)
+                m_indexedVertices.push_back(vts[index]);
+            assemblePrimitives(m_indexedVertices);
+        }
         // performs the perspective division
 
         // remove all geometry outside the visible volume (performed in clipping space)
@@ -76,8 +220,7 @@ namespace srl {
         static void processFragments(std::vector<fragment>& fInOut) {
             // fragment shader - not necessary for now since we are not modifying the color
             for (auto &frg : fInOut){
-                // example: uncomment this to make all fragments darker
-                // frg.col = frg.col * 0.5f;
+                processFragment(frg);
             }
         }
 
@@ -0,0 +1,105 @@
+//
+// Persistent worker threads that render the screen tiles of the binned mode of srl::Renderer
+//
+
+#ifndef ITU_GRAPHICS_PROGRAMMING_SRL_SCHEDULER_H
+#define ITU_GRAPHICS_PROGRAMMING_SRL_SCHEDULER_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+
+namespace srl {
+
+    // The threads are started once and wait for the next frame between frames. The tiles of a frame are taken in
+    // order from a shared counter, so a thread that finished a cheap tile takes the next one. The thread calling
+    // run() is worker 0, a scheduler with one thread does not start any thread.
+    class TileScheduler {
+    public:
+        explicit TileScheduler(unsigned int threadCount) {
+            m_threadCount = std::max(1u, threadCount);
+            for (unsigned int i = 1; i < m_threadCount; i++)
+                m_threads.emplace_back(&TileScheduler::workerLoop, this, i);
+        }
+
+        ~TileScheduler() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            for (auto &thread : m_threads)
+                thread.join();
+        }
+
+        TileScheduler(const TileScheduler&) = delete;
+        void operator=(const TileScheduler&) = delete;
+
+        unsigned int threadCount() const { return m_threadCount; }
+
+        // calls job(tile, worker) for every tile in [0, tileCount), returns when all tiles are done. worker is the
+        // index of the thread in [0, threadCount()), so that job can use per thread buffers
+        void run(unsigned int tileCount, const std::function<void(unsigned int, unsigned int)> &job) {
+            if (tileCount == 0)
+                return;
+            m_job = &job;
+            m_tileCount = tileCount;
+            m_nextTile = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_busyWorkers = m_threadCount - 1;
+                m_generation++;
+            }
+            m_wake.notify_all();
+
+            processTiles(0);
+
+            // all tiles are done once no worker is taking tiles anymore, waiting for that (rather than for the last
+            // tile) also ensures that no worker still reads the counter when the next frame resets it
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this]{ return m_busyWorkers == 0; });
+        }
+
+    private:
+        unsigned int m_threadCount;
+        std::vector<std::thread> m_threads;
+        const std::function<void(unsigned int, unsigned int)> *m_job = nullptr;
+        unsigned int m_tileCount = 0;
+        std::atomic<unsigned int> m_nextTile{0};
+
+        // used to wake up the workers when a new frame starts, and the caller of run() when it ends
+        std::mutex m_mutex;
+        std::condition_variable m_wake, m_done;
+        unsigned long m_generation = 0;
+        unsigned int m_busyWorkers = 0;
+        bool m_stop = false;
+
+        void processTiles(unsigned int worker) {
+            for (unsigned int tile = m_nextTile++; tile < m_tileCount; tile = m_nextTile++)
+                (*m_job)(tile, worker);
+        }
+
+        void workerLoop(unsigned int worker) {
+            unsigned long seenGeneration = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [&]{ return m_stop || m_generation != seenGeneration; });
+                    if (m_stop)
+                        return;
+                    seenGeneration = m_generation;
+                }
+                processTiles(worker);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_busyWorkers == 0)
+                    m_done.notify_all();
+            }
+        }
+    };
+}
+
+#endif //ITU_GRAPHICS_PROGRAMMING_SRL_SCHEDULER_H
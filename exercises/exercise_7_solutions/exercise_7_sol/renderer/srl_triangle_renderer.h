@@ -8,9 +8,10 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/transform.hpp>
 #include "srl_renderer.h"
-#include "rasterizer/trianglerasterizer.h"
+#include "srl_block_rasterizer.h"
 #include <glm/gtc/matrix_access.hpp>
 #include <iostream>
+#include <cfloat>
 #include "srl_types.h"
 
 namespace srl {
@@ -36,6 +37,21 @@ namespace srl {
             }
         }
 
+        // create triangle primitives from the post-transform buffer, three indices per triangle
+        void assembleIndexedPrimitives(const std::vector<vertex> &vts, const std::vector<unsigned int> &indices) override {
+            m_primitives.clear();
+            m_primitives.reserve(indices.size()/3);
+
+            for(int i = 0, size = int(indices.size())-2; i < size; i+=3){
+                triangle t;
+                t.v1 = vts[indices[i]];
+                t.v2 = vts[indices[i+1]];
+                t.v3 = vts[indices[i+2]];
+
+                m_primitives.push_back(t);
+            }
+        }
+
         bool clipTriangle(triangle &tIn, int i){
             // index to x, y or z coordinate (x=0, y=1, z=2)
             int idx = i % 3;
@@ -155,6 +171,8 @@ namespace srl {
 
         // normalized device coordinates to window coordinates
         void toScreenSpace(int width, int height) override  {
+            m_width = width;
+            m_height = height;
             float halfW = width / 2;
             float halfH = height / 2;
             glm::mat4 toWindowSpace = glm::scale(glm::vec3(halfW, halfH, 1.f)) * glm::translate(glm::vec3(1.f, 1.f, 0.f));
@@ -192,39 +210,187 @@ namespace srl {
                 if(tri.rejected)
                     continue;
 
-                // vertices of the triangle, rounded to the closest integer (aka pixel location)
-                glm::ivec2 iv1(tri.v1.pos.x + .5f, tri.v1.pos.y + .5f);
-                glm::ivec2 iv2(tri.v2.pos.x + .5f, tri.v2.pos.y + .5f);
-                glm::ivec2 iv3(tri.v3.pos.x + .5f, tri.v3.pos.y + .5f);
-                // run the rasterization and collect all pixel locations
-                triangle_rasterizer rasterizer(iv1.x, iv1.y, iv2.x, iv2.y, iv3.x, iv3.y);
-                std::vector<glm::ivec2> pixels = rasterizer.all_pixels();
+                // run the rasterization over the frame buffer, it covers the same pixels as triangle_rasterizer,
+                // but returns them as coverage masks of 8x8 blocks instead of a list of pixels
+                rasterTriangle(tri, makeRasterizer(tri), 0, 0, m_width, m_height, outFrs);
+            }
+        }
 
-                // create a fragment for each pixel
-                for (auto &pxl : pixels){
-                    fragment frag{};
+        // sort the triangles into the tiles that their bounding box overlaps
+        bool binPrimitives(int width, int height) override {
+            resetBins(width, height);
+            m_rasterizers.clear();
+            m_rasterizers.reserve(m_primitives.size());
 
-                    frag.pos = pxl;
+            for(unsigned int i = 0; i < m_primitives.size(); i++) {
+                triangle &tri = m_primitives[i];
+                if(tri.rejected) {
+                    m_rasterizers.emplace_back(glm::ivec2(0), glm::ivec2(0), glm::ivec2(0));
+                    continue;
+                }
+                m_rasterizers.push_back(makeRasterizer(tri));
+                const BlockRasterizer &rasterizer = m_rasterizers.back();
+                if(rasterizer.empty())
+                    continue;
+                // the tiles store read only triangles, the worker threads must not update them
+                tri.prepareInverse();
+
+                glm::ivec2 lo = glm::max(rasterizer.boundsMin(), glm::ivec2(0));
+                glm::ivec2 hi = glm::min(rasterizer.boundsMax(), glm::ivec2(width - 1, height - 1));
+                for(int ty = lo.y / m_tileSize; ty <= hi.y / m_tileSize; ty++)
+                    for(int tx = lo.x / m_tileSize; tx <= hi.x / m_tileSize; tx++)
+                        m_bins[tx + ty * m_tilesX].push_back(i);
+            }
+            return true;
+        }
 
-                    // barycentric coordinates (in 2D projected space)
-                    glm::vec3 bar = tri.barycentricCoordinatesAt(pxl);
-                    // hyperbolic interpolation correction
-                    float hypInterp = bar.x * tri.v1.hypInterp + bar.y * tri.v2.hypInterp + bar.z * tri.v3.hypInterp;
-                    bar = bar / hypInterp;
-                    frag.depth = bar.x * tri.v1.pos.z + bar.y * tri.v2.pos.z + bar.z * tri.v3.pos.z;
-                    frag.col = bar.x * tri.v1.col + bar.y * tri.v2.col + bar.z * tri.v3.col;
-                    frag.norm = bar.x * tri.v1.norm + bar.y * tri.v2.norm + bar.z * tri.v3.norm;
-                    frag.uv = bar.x * tri.v1.uv + bar.y * tri.v2.uv + bar.z * tri.v3.uv;
+        // rasterize the triangles of a bin inside of its tile, called by the worker threads
+        void rasterTile(const std::vector<unsigned int> &primitives, const Tile &tile,
+                        std::vector<fragment> &outFrs) override {
+            outFrs.clear();
+            for(unsigned int i : primitives)
+                rasterTriangle(m_primitives[i], m_rasterizers[i], tile.x0, tile.y0, tile.x1, tile.y1, outFrs);
+        }
 
+        // rasterize and write the triangles pixel by pixel, with the depth test before the attributes are interpolated
+        bool streamPrimitives(const std::vector<unsigned int> *primitives, const Tile &tile,
+                              CustomFrameBuffer <uint32_t> &fb, CustomFrameBuffer <float> &db, HiZBuffer *hiZ) override {
+            if(primitives) {
+                // binned, the rasterizers were set up while binning
+                for(unsigned int i : *primitives)
+                    streamTriangle(m_primitives[i], m_rasterizers[i], tile, fb, db, hiZ);
+            }
+            else {
+                for(auto &tri : m_primitives) {
+                    if(!tri.rejected)
+                        streamTriangle(tri, makeRasterizer(tri), tile, fb, db, hiZ);
+                }
+            }
+            return true;
+        }
 
-                    outFrs.push_back(frag);
+        static void streamTriangle(triangle &tri, const BlockRasterizer &rasterizer, const Tile &tile,
+                                   CustomFrameBuffer <uint32_t> &fb, CustomFrameBuffer <float> &db, HiZBuffer *hiZ){
+            if(rasterizer.empty())
+                return;
+            // pixels of the triangle's bounding box inside of the tile
+            glm::ivec2 lo = glm::max(rasterizer.boundsMin(), glm::ivec2(tile.x0, tile.y0));
+            glm::ivec2 hi = glm::min(rasterizer.boundsMax(), glm::ivec2(tile.x1 - 1, tile.y1 - 1));
+            if(lo.x > hi.x || lo.y > hi.y)
+                return;
+            // the whole triangle is behind the regions it overlaps
+            if(hiZ && hidden(tri, lo, hi, hiZ->regionMax(lo.x, lo.y, hi.x, hi.y)))
+                return;
+
+            rasterizer.rasterize(tile.x0, tile.y0, tile.x1, tile.y1, [&](int blockX, int blockY, uint64_t mask){
+                float blockMax = FLT_MAX;
+                if(hiZ) {
+                    // the part of the triangle in this block is behind the block
+                    blockMax = hiZ->blockMax(blockX, blockY);
+                    glm::ivec2 blockLo = glm::max(lo, glm::ivec2(blockX, blockY));
+                    glm::ivec2 blockHi = glm::min(hi, glm::ivec2(blockX, blockY) + (BlockRasterizer::blockSize - 1));
+                    if(hidden(tri, blockLo, blockHi, blockMax))
+                        return;
                 }
+                // what the writes did to the largest depth of the block
+                int written = 0;
+                float writtenMax = -FLT_MAX;
+                bool overMax = false;
+                BlockRasterizer::forEachPixel(blockX, blockY, mask, [&](int x, int y){
+                    glm::ivec2 pxl(x, y);
+                    glm::vec3 bar = perspectiveBarycentricAt(tri, pxl);
+                    float depth = depthAt(tri, bar);
+                    // early z/depth-test, the same test as writeToFrameBuffer
+                    float previous = db.valueAt(x, y);
+                    if (!(depth < previous))
+                        return;
+                    fragment frag = interpolateAt(tri, pxl, bar, depth);
+                    processFragment(frag);
+                    fb.paintAt(x, y, Colors::toRGBA32(frag.col));
+                    db.paintAt(x, y, depth);
+                    written++;
+                    writtenMax = std::max(writtenMax, depth);
+                    overMax = overMax || previous >= blockMax;
+                });
+                if(hiZ && written == BlockRasterizer::blockSize * BlockRasterizer::blockSize)
+                    hiZ->setBlockMax(blockX, blockY, writtenMax);
+                else if(hiZ && overMax)
+                    hiZ->updateBlock(blockX, blockY, db);
+            });
+        }
+
+        // true if the depth of the triangle is at least maxDepth at all pixel centers in [lo, hi] (inclusive).
+        // The perspective correct depth is the ratio of two functions that are linear in window coordinates, so its
+        // smallest value over the rectangle is at one of its corners, as long as the denominator (the interpolated
+        // hypInterp) is positive there. The margin covers the rounding of the depths computed per pixel
+        static bool hidden(triangle &tri, glm::ivec2 lo, glm::ivec2 hi, float maxDepth){
+            const float margin = 1e-5f;
+            const glm::ivec2 corners[4] = {lo, glm::ivec2(hi.x, lo.y), glm::ivec2(lo.x, hi.y), hi};
+            for(const glm::ivec2 &corner : corners) {
+                glm::vec3 bar = tri.barycentricCoordinatesAt(corner);
+                float hypInterp = bar.x * tri.v1.hypInterp + bar.y * tri.v2.hypInterp + bar.z * tri.v3.hypInterp;
+                if(!(hypInterp > 0) || depthAt(tri, bar / hypInterp) < maxDepth + margin)
+                    return false;
             }
+            return true;
+        }
+
+        static BlockRasterizer makeRasterizer(const triangle &tri){
+            // vertices of the triangle, rounded to the closest integer (aka pixel location)
+            glm::ivec2 iv1(tri.v1.pos.x + .5f, tri.v1.pos.y + .5f);
+            glm::ivec2 iv2(tri.v2.pos.x + .5f, tri.v2.pos.y + .5f);
+            glm::ivec2 iv3(tri.v3.pos.x + .5f, tri.v3.pos.y + .5f);
+            return BlockRasterizer(iv1, iv2, iv3);
+        }
+
+        // create a fragment for each pixel of the triangle in [x0, x1) x [y0, y1)
+        static void rasterTriangle(triangle &tri, const BlockRasterizer &rasterizer, int x0, int y0, int x1, int y1,
+                                   std::vector<fragment> &outFrs){
+            rasterizer.rasterize(x0, y0, x1, y1, [&](int blockX, int blockY, uint64_t mask){
+                BlockRasterizer::forEachPixel(blockX, blockY, mask, [&](int x, int y){
+                    outFrs.push_back(shadeFragment(tri, glm::ivec2(x, y)));
+                });
+            });
+        }
+
+        // interpolate the vertex attributes of the triangle at the pixel pxl
+        static fragment shadeFragment(triangle &tri, glm::ivec2 pxl){
+            glm::vec3 bar = perspectiveBarycentricAt(tri, pxl);
+            return interpolateAt(tri, pxl, bar, depthAt(tri, bar));
+        }
+
+        // barycentric coordinates at the pixel pxl, with the hyperbolic interpolation correction
+        static glm::vec3 perspectiveBarycentricAt(triangle &tri, glm::ivec2 pxl){
+            // barycentric coordinates (in 2D projected space)
+            glm::vec3 bar = tri.barycentricCoordinatesAt(pxl);
+            // hyperbolic interpolation correction
+            float hypInterp = bar.x * tri.v1.hypInterp + bar.y * tri.v2.hypInterp + bar.z * tri.v3.hypInterp;
+            return bar / hypInterp;
+        }
+
+        static float depthAt(const triangle &tri, const glm::vec3 &bar){
+            return bar.x * tri.v1.pos.z + bar.y * tri.v2.pos.z + bar.z * tri.v3.pos.z;
+        }
+
+        static fragment interpolateAt(const triangle &tri, glm::ivec2 pxl, const glm::vec3 &bar, float depth){
+            fragment frag{};
+
+            frag.pos = pxl;
+            frag.depth = depth;
+            frag.col = bar.x * tri.v1.col + bar.y * tri.v2.col + bar.z * tri.v3.col;
+            frag.norm = bar.x * tri.v1.norm + bar.y * tri.v2.norm + bar.z * tri.v3.norm;
+            frag.uv = bar.x * tri.v1.uv + bar.y * tri.v2.uv + bar.z * tri.v3.uv;
+
+            return frag;
         }
 
 
         // lists of triangle primitives, part of the class so that we avoid reallocating memory every frame
         std::vector<triangle> m_primitives;
+        // size of the frame buffer, set in toScreenSpace, the rasterizer only visits the pixels inside of it
+        int m_width = 0, m_height = 0;
+        // edge functions of the triangles, set up once while binning and used by all tiles of a triangle
+        std::vector<BlockRasterizer> m_rasterizers;
     };
 
 }
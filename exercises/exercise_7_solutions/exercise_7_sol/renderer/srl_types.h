@@ -5,7 +5,10 @@
 #ifndef ITU_GRAPHICS_PROGRAMMING_SRL_TYPES_H
 #define ITU_GRAPHICS_PROGRAMMING_SRL_TYPES_H
 
-
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
 
 namespace srl {
 
@@ -90,6 +93,36 @@ namespace srl {
         }
     };
 
+    // builds an indexed mesh from a triangle soup (three vertices per triangle): vertices that are equal in all
+    // attributes are stored once in vertices, and indices lists the vertices of every triangle
+    inline void indexVertices(const std::vector<vertex> &soup, std::vector<vertex> &vertices, std::vector<unsigned int> &indices) {
+        vertices.clear();
+        indices.clear();
+        indices.reserve(soup.size());
+        // vertices by a hash of their bytes, equal hashes are compared byte by byte
+        std::unordered_multimap<uint64_t, unsigned int> stored;
+        for (const vertex &v : soup) {
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&v);
+            uint64_t hash = 1469598103934665603ull;
+            for (size_t i = 0; i < sizeof(vertex); i++)
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+            unsigned int index = vertices.size();
+            auto range = stored.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (std::memcmp(&vertices[it->second], &v, sizeof(vertex)) == 0) {
+                    index = it->second;
+                    break;
+                }
+            }
+            if (index == vertices.size()) {
+                stored.emplace(hash, index);
+                vertices.push_back(v);
+            }
+            indices.push_back(index);
+        }
+    }
+
     struct fragment {
         glm::vec4 norm;
         Colors::color col;
@@ -122,13 +155,19 @@ namespace srl {
         glm::mat2x2 inverse = glm::mat2x2(1.0f);
         bool inverseReady = false;
 
-        glm::vec3 barycentricCoordinatesAt(glm::vec2 at){
+        // we only need to compute this inverse once per triangle, the binned renderer computes it before the
+        // triangle is shared by several threads
+        void prepareInverse(){
             if(!inverseReady){
-                // we only need to compute this inverse once per triangle
                 inverse[0] = glm::vec2(v1.pos.x - v3.pos.x, v1.pos.y - v3.pos.y);
                 inverse[1] = glm::vec2(v2.pos.x - v3.pos.x, v2.pos.y - v3.pos.y);
                 inverse = glm::inverse(inverse);
+                inverseReady = true;
             }
+        }
+
+        glm::vec3 barycentricCoordinatesAt(glm::vec2 at){
+            prepareInverse();
             glm::vec3 barycentric = glm::vec3(inverse * (at - glm::vec2(v3.pos.x, v3.pos.y)), 0);
             barycentric.z = 1.0f - barycentric.x - barycentric.y;
 